@@ -0,0 +1,75 @@
+/* actindex.c */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Motion activity index writer; see actindex.h.  Records are 24 bytes
+ * and go through stdio, so this costs the recording thread next to
+ * nothing.
+ */
+
+#include <string.h>
+#include "actindex.h"
+
+
+
+FILE *actopen(const char *recording, int cols, int rows, int framerate,
+	int threshold, int64_t start)
+{
+	struct actheader	hdr;
+	char			fn[1024];
+	const char		*dot;
+	FILE			*fd;
+
+	dot = strrchr(recording, '.');
+	snprintf(fn, sizeof(fn), "%.*s.act",
+		dot ? (int) (dot - recording) : (int) strlen(recording),
+		recording);
+	fd = fopen(fn, "wb");
+	if (!fd)
+		return NULL;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, ACT_MAGIC, sizeof(hdr.magic));
+	hdr.hdrsize = sizeof(hdr);
+	hdr.recsize = sizeof(struct actrecord);
+	hdr.cols = cols;
+	hdr.rows = rows;
+	hdr.framerate = framerate;
+	hdr.threshold = threshold;
+	hdr.start = start;
+	fwrite(&hdr, sizeof(hdr), 1, fd);
+
+	return fd;
+}
+
+
+
+void actframe(FILE *fd, const struct actrecord *r)
+{
+	if (fd)
+		fwrite(r, sizeof(*r), 1, fd);
+}
+
+
+
+void actclose(FILE *fd)
+{
+	if (fd)
+		fclose(fd);
+}
@@ -0,0 +1,67 @@
+/* actindex.h */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __ACTINDEX_H
+#define __ACTINDEX_H
+
+/*
+ * Motion activity index.
+ *
+ * With -a, each recording foo.mkv gets a foo.act alongside it: a struct
+ * actheader, then one struct actrecord per frame written, in order.  The
+ * pts is in the stream's timebase (microseconds; the OMX tick), and the
+ * offset is where the muxer was in the file when the frame was handed to
+ * it, which for a keyframe is somewhere a reader can start from.  The
+ * bounding box is in macroblocks, and is empty (x1 < x0) if nothing was
+ * hot.  Host byte order.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define ACT_MAGIC	"ACT1"
+
+#define ACT_KEY		(1<<0)
+#define ACT_MOVING	(1<<1)
+
+struct actheader {
+	char		magic[4];
+	uint16_t	hdrsize;
+	uint16_t	recsize;
+	uint16_t	cols, rows;	/* Macroblocks */
+	uint16_t	framerate;
+	uint16_t	threshold;
+	int64_t		start;		/* Wall clock, us since the epoch */
+};
+
+struct actrecord {
+	int64_t		pts;
+	uint64_t	offset;
+	uint16_t	hits;
+	uint8_t		flags;
+	uint8_t		x0, y0, x1, y1;
+	uint8_t		reserved;
+};
+
+FILE *actopen(const char *recording, int cols, int rows, int framerate,
+	int threshold, int64_t start);
+void actframe(FILE *, const struct actrecord *);
+void actclose(FILE *);
+
+#endif /* __ACTINDEX_H */
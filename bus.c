@@ -0,0 +1,201 @@
+/* bus.c */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Detection results on a Unix datagram socket; see bus.h.
+ *
+ * The detector publishes straight from lookformotion(), so it mustn't
+ * wait: every send is MSG_DONTWAIT, and a subscriber whose socket is
+ * full misses that frame.  One that's gone away is forgotten.  New
+ * subscriptions are picked up, without blocking, just before each
+ * publish, so there's no thread and no locking; only the detector
+ * touches the subscriber list.
+ *
+ * This file doesn't depend on OpenMAX, so the subscriber half can be
+ * linked into busdump.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "bus.h"
+
+static struct {
+	int			fd;
+	struct sockaddr_un	addr[BUS_SUBS];
+	socklen_t		addrlen[BUS_SUBS];
+	int			nsubs;
+	unsigned int		dropped;
+} bus = {
+	.fd = -1,
+};
+
+
+
+int initbus(const char *path)
+{
+	struct sockaddr_un	sun;
+
+	if (!path)
+		return 0;
+
+	bus.fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (bus.fd == -1)
+		return -1;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path);
+	unlink(path);
+	if (bind(bus.fd, (struct sockaddr *) &sun, sizeof(sun)) != 0) {
+		int e = errno;
+
+		close(bus.fd);
+		errno = e;
+		bus.fd = -1;
+		return -1;
+	}
+	fcntl(bus.fd, F_SETFL, O_NONBLOCK);
+
+	return 0;
+}
+
+
+
+static int findsub(const struct sockaddr_un *a, socklen_t len)
+{
+	int i;
+
+	for (i = 0; i < bus.nsubs; i++)
+		if (bus.addrlen[i] == len && memcmp(&bus.addr[i], a, len) == 0)
+			return i;
+
+	return -1;
+}
+
+
+
+static void dropsub(int i)
+{
+	bus.nsubs--;
+	bus.addr[i] = bus.addr[bus.nsubs];
+	bus.addrlen[i] = bus.addrlen[bus.nsubs];
+}
+
+
+
+/* Anything waiting on the socket is a subscription, or the end of one: */
+static void subscriptions(void)
+{
+	struct sockaddr_un	a;
+	socklen_t		len;
+	char			c;
+	int			i;
+
+	while (1) {
+		len = sizeof(a);
+		if (recvfrom(bus.fd, &c, 1, MSG_DONTWAIT,
+			(struct sockaddr *) &a, &len) != 1)
+			break;
+/* Unbound; we couldn't reply if we wanted to: */
+		if (len <= sizeof(sa_family_t))
+			continue;
+		i = findsub(&a, len);
+		if (c == BUS_SUBSCRIBE && i == -1 && bus.nsubs < BUS_SUBS) {
+			bus.addr[bus.nsubs] = a;
+			bus.addrlen[bus.nsubs] = len;
+			bus.nsubs++;
+		} else if (c == BUS_UNSUBSCRIBE && i != -1) {
+			dropsub(i);
+		}
+	}
+}
+
+
+
+/* Called from the detection thread for every frame analysed: */
+void buspublish(struct busmsg *m)
+{
+	int i;
+
+	if (bus.fd == -1)
+		return;
+
+	subscriptions();
+	m->magic = BUS_MAGIC;
+	m->size = sizeof(*m);
+	for (i = 0; i < bus.nsubs; i++) {
+		if (sendto(bus.fd, m, sizeof(*m), MSG_DONTWAIT | MSG_NOSIGNAL,
+			(struct sockaddr *) &bus.addr[i],
+			bus.addrlen[i]) == sizeof(*m))
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			errno == ENOBUFS) {
+			__atomic_fetch_add(&bus.dropped, 1, __ATOMIC_RELAXED);
+		} else {
+/* Gone: */
+			dropsub(i);
+			i--;
+		}
+	}
+	__atomic_store_n(&bus.nsubs, bus.nsubs, __ATOMIC_RELAXED);
+}
+
+
+
+void busstats(int *subscribers, unsigned int *dropped)
+{
+	*subscribers = __atomic_load_n(&bus.nsubs, __ATOMIC_RELAXED);
+	*dropped = __atomic_load_n(&bus.dropped, __ATOMIC_RELAXED);
+}
+
+
+
+/* Subscriber: */
+
+int bussubscribe(const char *path)
+{
+	struct sockaddr_un	sun;
+	sa_family_t		family = AF_UNIX;
+	char			c = BUS_SUBSCRIBE;
+	int			fd;
+
+	fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd == -1)
+		return -1;
+/* An abstract address of the kernel's choosing: */
+	if (bind(fd, (struct sockaddr *) &family, sizeof(family)) != 0) {
+		close(fd);
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path);
+	if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) != 0 ||
+		send(fd, &c, 1, 0) != 1) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
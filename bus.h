@@ -0,0 +1,74 @@
+/* bus.h */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __BUS_H
+#define __BUS_H
+
+/*
+ * Detection results, as they happen, on a Unix datagram socket.
+ *
+ * -U path binds a datagram socket at path.  To subscribe, bind a datagram
+ * socket of your own (autobinding is fine) and send BUS_SUBSCRIBE to
+ * path; from then on, one struct busmsg arrives per analysed vector
+ * frame.  BUS_UNSUBSCRIBE, or closing the socket, stops them.  Nothing
+ * is queued for a subscriber that isn't keeping up: if its socket's
+ * full, that message is dropped.  Subscriptions don't survive omxmotion
+ * restarting, so a subscriber which hears nothing for a while should
+ * subscribe again; doing so twice is harmless.
+ *
+ * bussubscribe() does all that; see busdump.c.
+ *
+ * Everything is in host byte order; the socket's local, after all.
+ */
+
+#include <stdint.h>
+
+#define BUS_MAGIC	(0x5355424d)	/* 'MBUS' */
+#define BUS_SUBSCRIBE	's'
+#define BUS_UNSUBSCRIBE	'u'
+#define BUS_SUBS	(8)
+
+struct busmsg {
+	uint32_t	magic;
+	uint16_t	size;		/* sizeof(struct busmsg) */
+	uint16_t	flags;
+#define BUS_MOVING	(1<<0)		/* hits >= threshold */
+#define BUS_CAMERA	(1<<1)		/* Camera motion; see -G */
+#define BUS_DOZING	(1<<2)		/* See -D */
+	uint32_t	framenum;	/* Vector frame count since start */
+	uint16_t	hits;
+	uint16_t	threshold;
+	int64_t		tick;		/* Encoder timestamp, us */
+	uint8_t		box[4];		/* x0, y0, x1, y1; empty if x1 < x0 */
+	int8_t		gx, gy;		/* Camera motion taken out */
+	uint8_t		state;		/* enum recstate */
+	uint8_t		reserved;
+	uint16_t	cols, rows;	/* Macroblocks */
+	uint32_t	reserved2;
+};
+
+/* Publisher; used by the detector: */
+int initbus(const char *path);
+void buspublish(struct busmsg *);
+void busstats(int *subscribers, unsigned int *dropped);
+
+/* Subscriber: */
+int bussubscribe(const char *path);
+
+#endif /* __BUS_H */
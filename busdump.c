@@ -0,0 +1,127 @@
+/* busdump.c
+ *
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * Usage: ./busdump [-m] path
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Example subscriber for omxmotion's -U detection bus: prints one line
+ * per analysed frame (or with -m, only frames over the threshold), in
+ * the same layout as mvconv -l, plus the bounding box and any camera
+ * motion.  If nothing arrives for a few seconds -- omxmotion restarted,
+ * say -- it subscribes again.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "bus.h"
+
+#define RESUBSCRIBE	(5000)		/* ms */
+
+extern int optind;
+
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-m] path\n\n"
+		"Where:\n"
+	"\t-m\t\tOnly show frames over the threshold\n"
+		"\n", name);
+	exit(1);
+}
+
+
+
+static void print(const struct busmsg *m)
+{
+	printf("%8u %14lld %5d / %5d %c%c%c %d", m->framenum,
+		(long long) m->tick, m->hits, m->threshold,
+		m->flags & BUS_MOVING ? '*' : ' ',
+		m->flags & BUS_CAMERA ? 'C' : ' ',
+		m->flags & BUS_DOZING ? 'z' : ' ', m->state);
+	if (m->box[2] >= m->box[0])
+		printf(" [%d,%d-%d,%d]", m->box[0], m->box[1], m->box[2],
+			m->box[3]);
+	if (m->gx || m->gy)
+		printf(" global=%d,%d", m->gx, m->gy);
+	printf("\n");
+	fflush(stdout);
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	struct busmsg		m;
+	struct pollfd		pfd;
+	int			opt;
+	int			moving = 0;
+	ssize_t			n;
+
+	while ((opt = getopt(argc, argv, "hm")) != -1) {
+		switch (opt) {
+		case 'm':
+			moving = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	pfd.fd = -1;
+	pfd.events = POLLIN;
+	while (1) {
+		if (pfd.fd == -1) {
+			pfd.fd = bussubscribe(argv[optind]);
+			if (pfd.fd == -1) {
+				fprintf(stderr, "Failed to subscribe to %s: %s\n",
+					argv[optind], strerror(errno));
+				sleep(RESUBSCRIBE / 1000);
+				continue;
+			}
+		}
+		if (poll(&pfd, 1, RESUBSCRIBE) == 0) {
+			close(pfd.fd);
+			pfd.fd = -1;
+			continue;
+		}
+		n = recv(pfd.fd, &m, sizeof(m), 0);
+		if (n != sizeof(m) || m.magic != BUS_MAGIC ||
+			m.size != sizeof(m)) {
+			if (n == -1 && errno != EINTR) {
+				close(pfd.fd);
+				pfd.fd = -1;
+			}
+			continue;
+		}
+		if (!moving || (m.flags & BUS_MOVING))
+			print(&m);
+	}
+
+	return 0;
+}
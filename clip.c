@@ -0,0 +1,595 @@
+/* clip.c
+ *
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * Usage: ./clip [-d outputdir] [-l] from to|+seconds [output.mkv]
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Cuts a wall-clock time range out of omxmotion's recordings, by stream
+ * copy: nothing is decoded, so it's limited by the card, not the CPU.
+ *
+ * Each recording's start time -- that of its first frame, at the start of
+ * the pre-roll -- comes from its .act sidecar (-a; the muxer's
+ * start_time_realtime) or, failing that, the creation_time omxmotion
+ * puts in the container's header.  Older recordings have neither, and
+ * fall back on their name, which is the trigger time: clips cut from
+ * those come out late by the length of the pre-roll.  With a .act, the
+ * keyframes and duration come from there too; without, from the
+ * container's header.  Either way, the results are cached in
+ * outputdir/.clipindex against each file's size and mtime, so a second
+ * run over a month of footage only has to stat() it.
+ *
+ * The range starts at the last keyframe at or before 'from', and may
+ * span several recordings; gaps between them are left as gaps in the
+ * timestamps.
+ */
+
+#define _XOPEN_SOURCE 700
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "libavformat/avformat.h"
+#include "libavcodec/avcodec.h"
+#include "libavutil/mathematics.h"
+#include "actindex.h"
+
+extern char *optarg;
+extern int optind;
+
+#define CLIP_MAGIC	"CLP2"
+
+struct clipfile {
+	char		name[64];
+	int64_t		size;
+	int64_t		mtime;
+	int64_t		start;		/* Wall clock, us since the epoch */
+	int64_t		duration;	/* us */
+	uint32_t	nkeys;
+	uint32_t	key;		/* First, in keys[] */
+};
+
+struct clipindex {
+	struct clipfile	*files;
+	unsigned int	nfiles, alloc;
+	int64_t		*keys;		/* us from the start of the file */
+	unsigned int	nkeys, keyalloc;
+};
+
+static AVRational us = { 1, 1000000 };
+
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-d outputdir] [-l] from to|+seconds "
+		"[output.mkv]\n\n"
+		"Where:\n"
+	"\t-d outputdir\tWhere the recordings are (default .)\n"
+	"\t-l\t\tList the recordings overlapping the range\n"
+	"\nTimes are local, eg. 2015-05-10T14:01:55 or 14:01:55 for today.\n"
+		"\n", name);
+	exit(1);
+}
+
+
+
+static int64_t parsetime(const char *s)
+{
+	static const char *formats[] = {
+		"%Y-%m-%dT%H:%M:%S", "%Y-%m-%dT%H:%M", "%Y-%m-%d %H:%M:%S",
+		"%Y-%m-%d %H:%M", "%H:%M:%S", "%H:%M", NULL
+	};
+	struct tm tm, today;
+	const char *end;
+	time_t t;
+	int i;
+
+	t = time(NULL);
+	localtime_r(&t, &today);
+	for (i = 0; formats[i]; i++) {
+		memset(&tm, 0, sizeof(tm));
+		end = strptime(s, formats[i], &tm);
+		if (end && !*end) {
+			if (formats[i][1] == 'H') {
+				tm.tm_year = today.tm_year;
+				tm.tm_mon = today.tm_mon;
+				tm.tm_mday = today.tm_mday;
+			}
+			tm.tm_isdst = -1;
+			return (int64_t) mktime(&tm) * 1000000;
+		}
+	}
+	fprintf(stderr, "Can't make sense of the time '%s'\n", s);
+	exit(1);
+}
+
+
+
+static void addkey(struct clipindex *ci, int64_t k)
+{
+	if (ci->nkeys == ci->keyalloc) {
+		ci->keyalloc = ci->keyalloc ? ci->keyalloc * 2 : 4096;
+		ci->keys = realloc(ci->keys, ci->keyalloc * sizeof(int64_t));
+	}
+	ci->keys[ci->nkeys++] = k;
+}
+
+
+
+static struct clipfile *addfile(struct clipindex *ci)
+{
+	if (ci->nfiles == ci->alloc) {
+		ci->alloc = ci->alloc ? ci->alloc * 2 : 1024;
+		ci->files = realloc(ci->files, ci->alloc * sizeof(*ci->files));
+	}
+	memset(&ci->files[ci->nfiles], 0, sizeof(*ci->files));
+	return &ci->files[ci->nfiles++];
+}
+
+
+
+static int loadcache(const char *dir, struct clipindex *ci)
+{
+	char fn[1024], magic[4];
+	uint32_t n[2];
+	FILE *fd;
+
+	memset(ci, 0, sizeof(*ci));
+	snprintf(fn, sizeof(fn), "%s/.clipindex", dir);
+	fd = fopen(fn, "rb");
+	if (!fd)
+		return -1;
+	if (fread(magic, 4, 1, fd) != 1 || memcmp(magic, CLIP_MAGIC, 4) ||
+		fread(n, sizeof(n), 1, fd) != 1) {
+		fclose(fd);
+		return -1;
+	}
+	ci->files = malloc(n[0] * sizeof(*ci->files) + 1);
+	ci->keys = malloc(n[1] * sizeof(int64_t) + 1);
+	ci->alloc = n[0];
+	ci->keyalloc = n[1];
+	if (fread(ci->files, sizeof(*ci->files), n[0], fd) != n[0] ||
+		fread(ci->keys, sizeof(int64_t), n[1], fd) != n[1]) {
+		fclose(fd);
+		free(ci->files);
+		free(ci->keys);
+		memset(ci, 0, sizeof(*ci));
+		return -1;
+	}
+	ci->nfiles = n[0];
+	ci->nkeys = n[1];
+	fclose(fd);
+
+	return 0;
+}
+
+
+
+static void savecache(const char *dir, const struct clipindex *ci)
+{
+	char fn[1024], tmp[1024];
+	uint32_t n[2];
+	FILE *fd;
+
+	snprintf(fn, sizeof(fn), "%s/.clipindex", dir);
+	snprintf(tmp, sizeof(tmp), "%s/.clipindex.tmp", dir);
+	fd = fopen(tmp, "wb");
+	if (!fd)
+		return;
+	n[0] = ci->nfiles;
+	n[1] = ci->nkeys;
+	fwrite(CLIP_MAGIC, 4, 1, fd);
+	fwrite(n, sizeof(n), 1, fd);
+	fwrite(ci->files, sizeof(*ci->files), ci->nfiles, fd);
+	fwrite(ci->keys, sizeof(int64_t), ci->nkeys, fd);
+	if (fclose(fd) == 0)
+		rename(tmp, fn);
+}
+
+
+
+/* From the .act, if there is one: */
+static int indexact(const char *path, struct clipindex *ci,
+	struct clipfile *f)
+{
+	struct actheader	hdr;
+	struct actrecord	r;
+	char			fn[1024];
+	int64_t			first = 0, last = 0;
+	int			n = 0;
+	FILE			*fd;
+
+	snprintf(fn, sizeof(fn), "%.*s.act", (int) strlen(path) - 4, path);
+	fd = fopen(fn, "rb");
+	if (!fd)
+		return -1;
+	if (fread(&hdr, sizeof(hdr), 1, fd) != 1 ||
+		memcmp(hdr.magic, ACT_MAGIC, 4) != 0 ||
+		hdr.recsize != sizeof(r)) {
+		fclose(fd);
+		return -1;
+	}
+	fseek(fd, hdr.hdrsize, SEEK_SET);
+	f->key = ci->nkeys;
+	while (fread(&r, sizeof(r), 1, fd) == 1) {
+		if (n++ == 0)
+			first = r.pts;
+		last = r.pts;
+		if (r.flags & ACT_KEY) {
+			addkey(ci, r.pts - first);
+			f->nkeys++;
+		}
+	}
+	fclose(fd);
+
+	if (hdr.start)
+		f->start = hdr.start;
+	f->duration = last - first + 1000000 / (hdr.framerate ?
+		hdr.framerate : 25);
+
+	return 0;
+}
+
+
+
+/*
+ * creation_time is UTC, as "2015-05-10T12:00:00.000000Z" or, from older
+ * demuxers, "2015-05-10 12:00:00"; the fraction may be missing.
+ */
+static int64_t parsecreated(const char *s)
+{
+	struct tm tm;
+	const char *end;
+	int64_t us = 0, scale = 100000;
+
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(s, "%Y-%m-%d", &tm);
+	if (!end || (*end != 'T' && *end != ' '))
+		return 0;
+	end = strptime(end + 1, "%H:%M:%S", &tm);
+	if (!end)
+		return 0;
+	if (*end == '.')
+		for (end++; *end >= '0' && *end <= '9' && scale; end++) {
+			us += (*end - '0') * scale;
+			scale /= 10;
+		}
+
+	return (int64_t) timegm(&tm) * 1000000 + us;
+}
+
+
+
+/* From the container's header; no keyframes, but no reading through: */
+static int indexmkv(const char *path, struct clipfile *f)
+{
+	AVFormatContext *ic = NULL;
+	AVDictionaryEntry *e;
+	int64_t start;
+
+	if (avformat_open_input(&ic, path, NULL, NULL) != 0)
+		return -1;
+	if (ic->duration != AV_NOPTS_VALUE)
+		f->duration = ic->duration;
+	e = av_dict_get(ic->metadata, "creation_time", NULL, 0);
+	if (e && (start = parsecreated(e->value)) > 0)
+		f->start = start;
+	avformat_close_input(&ic);
+
+	return 0;
+}
+
+
+
+static int byname(const void *a, const void *b)
+{
+	return strcmp(((const struct clipfile *) a)->name,
+		((const struct clipfile *) b)->name);
+}
+
+
+
+/*
+ * Bring the index up to date with the directory.  Recordings are named
+ * by their start time, so name order is time order.
+ */
+static void buildindex(const char *dir, struct clipindex *ci)
+{
+	struct clipindex	old, new;
+	struct clipfile		key, *o, *f;
+	struct dirent		*de;
+	struct stat		st;
+	struct tm		tm;
+	char			path[1024];
+	const char		*end;
+	int			changed = 0;
+	unsigned int		i;
+	DIR			*d;
+
+	if (loadcache(dir, &old) != 0)
+		changed = 1;
+	memset(&new, 0, sizeof(new));
+
+	d = opendir(dir);
+	if (!d) {
+		fprintf(stderr, "Failed to open %s: %s\n", dir,
+			strerror(errno));
+		exit(1);
+	}
+	while ((de = readdir(d)) != NULL) {
+		memset(&tm, 0, sizeof(tm));
+		end = strptime(de->d_name, "%Y-%m-%dT%H:%M:%S", &tm);
+		if (!end || strcmp(end, ".mkv") != 0 ||
+			strlen(de->d_name) >= sizeof(key.name))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if (stat(path, &st) != 0)
+			continue;
+
+		strcpy(key.name, de->d_name);
+		o = old.nfiles ? bsearch(&key, old.files, old.nfiles,
+			sizeof(key), byname) : NULL;
+		f = addfile(&new);
+		if (o && o->size == st.st_size && o->mtime == st.st_mtime) {
+			*f = *o;
+			f->key = new.nkeys;
+			for (i = 0; i < o->nkeys; i++)
+				addkey(&new, old.keys[o->key + i]);
+			continue;
+		}
+
+		changed = 1;
+		strcpy(f->name, de->d_name);
+		f->size = st.st_size;
+		f->mtime = st.st_mtime;
+		tm.tm_isdst = -1;
+		f->start = (int64_t) mktime(&tm) * 1000000;
+		if (indexact(path, &new, f) != 0)
+			indexmkv(path, f);
+	}
+	closedir(d);
+
+	if (new.nfiles != old.nfiles)
+		changed = 1;
+	qsort(new.files, new.nfiles, sizeof(*new.files), byname);
+	if (changed)
+		savecache(dir, &new);
+	free(old.files);
+	free(old.keys);
+	*ci = new;
+}
+
+
+
+static void timestr(char *s, size_t len, int64_t t)
+{
+	struct tm tm;
+	time_t secs = t / 1000000;
+
+	localtime_r(&secs, &tm);
+	strftime(s, len, "%Y-%m-%dT%H:%M:%S", &tm);
+}
+
+
+
+static AVFormatContext *openout(const char *fn, AVStream *ist, int *index)
+{
+	AVFormatContext *oc = NULL;
+	AVStream *st;
+
+	if (avformat_alloc_output_context2(&oc, NULL, NULL, fn) < 0 || !oc)
+		return NULL;
+	st = avformat_new_stream(oc, NULL);
+	avcodec_copy_context(st->codec, ist->codec);
+	st->codec->codec_tag = 0;
+	st->time_base = ist->time_base;
+	if (oc->oformat->flags & AVFMT_GLOBALHEADER)
+		st->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+	*index = st->index;
+	if (avio_open(&oc->pb, fn, AVIO_FLAG_WRITE) < 0 ||
+		avformat_write_header(oc, NULL) < 0) {
+		avformat_free_context(oc);
+		return NULL;
+	}
+
+	return oc;
+}
+
+
+
+/*
+ * Copy [from, to] out of one recording; returns packets written.  *last
+ * is the wall time of the last packet written from the one before.
+ */
+static int copyfile(const char *dir, const struct clipindex *ci,
+	const struct clipfile *f, int64_t from, int64_t to,
+	const char *out, AVFormatContext **oc, int *oindex, int64_t *base,
+	int64_t *last)
+{
+	AVFormatContext	*ic = NULL;
+	AVStream	*ist;
+	AVPacket	pkt;
+	char		path[1024];
+	int64_t		first = AV_NOPTS_VALUE, seekto = 0, wall, t;
+	int		si, n = 0, started = 0;
+	unsigned int	i;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, f->name);
+	if (avformat_open_input(&ic, path, NULL, NULL) != 0) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return 0;
+	}
+	for (si = 0; si < ic->nb_streams; si++)
+		if (ic->streams[si]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+			break;
+	if (si == ic->nb_streams) {
+		avformat_close_input(&ic);
+		return 0;
+	}
+	ist = ic->streams[si];
+
+/* Timestamps in the file are relative to its first packet: */
+	av_init_packet(&pkt);
+	while (av_read_frame(ic, &pkt) == 0) {
+		if (pkt.stream_index == si && pkt.pts != AV_NOPTS_VALUE)
+			first = av_rescale_q(pkt.pts, ist->time_base, us);
+		av_free_packet(&pkt);
+		if (first != AV_NOPTS_VALUE)
+			break;
+	}
+	if (first == AV_NOPTS_VALUE) {
+		avformat_close_input(&ic);
+		return 0;
+	}
+
+/* The last keyframe at or before from, if we know where they are: */
+	for (i = 0; i < f->nkeys; i++) {
+		if (f->start + ci->keys[f->key + i] > from)
+			break;
+		seekto = ci->keys[f->key + i];
+	}
+	if (!f->nkeys && from > f->start)
+		seekto = from - f->start;
+	av_seek_frame(ic, si, av_rescale_q(first + seekto, us, ist->time_base),
+		AVSEEK_FLAG_BACKWARD);
+
+	while (av_read_frame(ic, &pkt) == 0) {
+		if (pkt.stream_index != si || pkt.pts == AV_NOPTS_VALUE) {
+			av_free_packet(&pkt);
+			continue;
+		}
+		wall = f->start + av_rescale_q(pkt.pts, ist->time_base, us) -
+			first;
+		if (wall > to) {
+			av_free_packet(&pkt);
+			break;
+		}
+/*
+ * A recording cut short by the next trigger overlaps the next one's
+ * pre-roll, by up to a GOP.  It's the same stream, so skip what's been
+ * written already, and carry on from there without waiting for an I-frame.
+ */
+		if (*oc && wall <= *last) {
+			av_free_packet(&pkt);
+			started = 1;
+			continue;
+		}
+		if (!started && !(pkt.flags & AV_PKT_FLAG_KEY)) {
+			av_free_packet(&pkt);
+			continue;
+		}
+		started = 1;
+
+		if (!*oc) {
+			*oc = openout(out, ist, oindex);
+			if (!*oc) {
+				fprintf(stderr, "Failed to open %s\n", out);
+				exit(1);
+			}
+			*base = wall;
+		}
+		t = av_rescale_q(wall - *base, us,
+			(*oc)->streams[*oindex]->time_base);
+		pkt.pts = pkt.dts = t;
+		pkt.stream_index = *oindex;
+		pkt.pos = -1;
+		av_interleaved_write_frame(*oc, &pkt);
+		av_free_packet(&pkt);
+		*last = wall;
+		n++;
+	}
+	avformat_close_input(&ic);
+
+	return n;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	struct clipindex	ci;
+	AVFormatContext		*oc = NULL;
+	const char		*dir = ".";
+	char			s[64];
+	int64_t			from, to, base = 0, last = 0;
+	int			opt, list = 0, oindex = 0, n = 0;
+	unsigned int		i;
+
+	while ((opt = getopt(argc, argv, "d:hl")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'l':
+			list = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != (list ? 2 : 3))
+		usage(argv[0]);
+
+	from = parsetime(argv[optind]);
+	if (argv[optind+1][0] == '+')
+		to = from + (int64_t) (atof(&argv[optind+1][1]) * 1000000);
+	else
+		to = parsetime(argv[optind+1]);
+
+	av_register_all();
+	buildindex(dir, &ci);
+
+	for (i = 0; i < ci.nfiles; i++) {
+		struct clipfile *f = &ci.files[i];
+
+		if (f->start > to || (f->duration &&
+			f->start + f->duration < from))
+			continue;
+		if (list) {
+			timestr(s, sizeof(s), f->start);
+			printf("%s %s %7.1fs %4u keyframes\n", f->name, s,
+				f->duration / 1e6, f->nkeys);
+			continue;
+		}
+		n += copyfile(dir, &ci, f, from, to, argv[optind+2], &oc,
+			&oindex, &base, &last);
+	}
+
+	if (oc) {
+		av_write_trailer(oc);
+		avio_close(oc->pb);
+		avformat_free_context(oc);
+		timestr(s, sizeof(s), base);
+		printf("Wrote %d frames from %s to %s\n", n, s, argv[optind+2]);
+	} else if (!list) {
+		fprintf(stderr, "Nothing recorded in that range\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,476 @@
+/* ctl.c */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Runtime control socket.
+ *
+ * -S path listens on a Unix-domain stream socket for a simple line
+ * protocol, so things can be tuned without restarting, re-initialising
+ * the camera and losing the ring.  Try "socat - UNIX-CONNECT:path":
+ *
+ *   get <param>		ok <value>
+ *   set <param> <value>	ok applied at frame <n>
+ *   trigger			ok applied at frame <n>
+ *   stop			ok applied at frame <n>
+ *   status			ok state=... frame=... hits=... ...
+ *   ring			ok frames=... bytes=... ...
+ *   help
+ *
+ * where <param> is one of sensitivity, threshold, debounce, outro, subs
+ * or command.  Anything else gets "error <reason>".
+ *
+ * Changes to the recording state machine are queued and applied by the
+ * capture thread in applyctl(), between frames, and we wait for that to
+ * happen before replying.  Sensitivity and threshold changes are applied
+ * by the detection thread before its next frame.
+ */
+
+#include "omxmotion.h"
+#include "motion.h"
+#include "ctl.h"
+#include "hook.h"
+#include "ratectl.h"
+#include "prio.h"
+#include "log.h"
+#include "bus.h"
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static void *ctlstart(void *);
+
+#define CTLCLIENTS	(8)
+#define CTLTIMEOUT	(2)	/* Seconds to wait for a change to apply */
+
+#define CTL_DEBOUNCE	(1<<0)
+#define CTL_OUTRO	(1<<1)
+#define CTL_SUBS	(1<<2)
+#define CTL_TRIGGER	(1<<3)
+#define CTL_STOP	(1<<4)
+
+
+
+struct ctlclient {
+	int			fd;
+	char			buf[512];
+	int			len;
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	pthread_t		thread;
+	int			listenfd;
+	struct ctlclient	clients[CTLCLIENTS];
+/* Pending changes: */
+	volatile int		pending;
+	int			debounce;
+	int			outro;
+	char			*subs;
+	unsigned int		seq, applied;
+	unsigned int		appliedframe;
+} cs;
+
+
+
+int initctl(const char *path)
+{
+	struct sockaddr_un	sun;
+	pthread_attr_t		detach;
+	int			i;
+
+	memset(&cs, 0, sizeof(cs));
+	if (!path)
+		return 0;
+
+	cs.listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (cs.listenfd == -1)
+		return -1;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path);
+	unlink(path);
+	if (bind(cs.listenfd, (struct sockaddr *) &sun, sizeof(sun)) != 0 ||
+		listen(cs.listenfd, CTLCLIENTS) != 0) {
+		fprintf(stderr, "Failed to listen on %s: %s\n", path,
+			strerror(errno));
+		close(cs.listenfd);
+		return -1;
+	}
+	for (i = 0; i < CTLCLIENTS; i++)
+		cs.clients[i].fd = -1;
+
+	pthread_mutex_init(&cs.lock, NULL);
+	pthread_cond_init(&cs.cond, NULL);
+	pthread_attr_init(&detach);
+	pthread_attr_setdetachstate(&detach, PTHREAD_CREATE_DETACHED);
+	pthread_create(&cs.thread, &detach, ctlstart, NULL);
+
+	return 0;
+}
+
+
+
+/* Called by the capture thread once per frame, before checkstate(): */
+void applyctl(void)
+{
+	struct motionstats ms;
+
+	if (!cs.pending)
+		return;
+
+	pthread_mutex_lock(&cs.lock);
+	pthread_mutex_lock(&ctx.lock);
+	if (cs.pending & CTL_DEBOUNCE)
+		ctx.sm.debounce = cs.debounce;
+	if (cs.pending & CTL_OUTRO)
+		ctx.sm.outro = cs.outro;
+	if (cs.pending & CTL_SUBS)
+		ctx.subs = cs.subs;	/* The old one may still be in use */
+	if (cs.pending & CTL_TRIGGER) {
+		switch (ctx.sm.state) {
+		case waiting:
+		case triggered:
+/* Skip the debounce; checkstate() will start recording on this frame. */
+			ctx.sm.state = triggered;
+			ctx.sm.lastevent = ctx.framenum - ctx.sm.debounce - 1;
+			break;
+		case stopping:
+/* Still nothing moving: just start the outro again. */
+			getmotionstats(&ms);
+			if (ms.moving)
+				ctx.sm.state = recording;
+			else
+				ctx.sm.lastevent = ctx.framenum;
+			break;
+		case recording:
+			break;
+		}
+	}
+	if (cs.pending & CTL_STOP) {
+		switch (ctx.sm.state) {
+		case triggered:
+			ctx.sm.state = waiting;
+			break;
+		case recording:
+		case stopping:
+/* Skip the outro; we'll stop at the next I-frame. */
+			ctx.sm.state = stopping;
+			ctx.sm.lastevent = ctx.framenum - ctx.sm.outro - 1;
+			break;
+		case waiting:
+			break;
+		}
+	}
+	cs.appliedframe = ctx.framenum;
+	pthread_mutex_unlock(&ctx.lock);
+	cs.pending = 0;
+	cs.applied = cs.seq;
+	pthread_cond_broadcast(&cs.cond);
+	pthread_mutex_unlock(&cs.lock);
+}
+
+
+
+static const char *statename(enum recstate s)
+{
+	switch (s) {
+	case waiting:
+		return "waiting";
+	case triggered:
+		return "triggered";
+	case recording:
+		return "recording";
+	case stopping:
+		return "stopping";
+	}
+	return "?";
+}
+
+
+
+/* Queue a change for applyctl() and wait for it to happen: */
+static int queue(int what, char *reply, int len)
+{
+	struct timespec timeout;
+	unsigned int seq;
+	int r = 0;
+
+	pthread_mutex_lock(&cs.lock);
+	cs.pending |= what;
+	seq = ++cs.seq;
+	clock_gettime(CLOCK_REALTIME, &timeout);
+	timeout.tv_sec += CTLTIMEOUT;
+	while ((int) (cs.applied - seq) < 0 && r != ETIMEDOUT)
+		r = pthread_cond_timedwait(&cs.cond, &cs.lock, &timeout);
+	if (r == ETIMEDOUT)
+		snprintf(reply, len, "ok queued; capture isn't running\n");
+	else
+		snprintf(reply, len, "ok applied at frame %u\n",
+			cs.appliedframe);
+	pthread_mutex_unlock(&cs.lock);
+
+	return 0;
+}
+
+
+
+static void get(const char *param, char *reply, int len)
+{
+	const char *s;
+
+	if (strcmp(param, "sensitivity") == 0)
+		snprintf(reply, len, "ok %d\n", motionsensitivity());
+	else if (strcmp(param, "threshold") == 0)
+		snprintf(reply, len, "ok %d\n", motionthreshold());
+	else if (strcmp(param, "debounce") == 0)
+		snprintf(reply, len, "ok %d\n", ctx.sm.debounce);
+	else if (strcmp(param, "outro") == 0)
+		snprintf(reply, len, "ok %d\n", ctx.sm.outro);
+	else if (strcmp(param, "subs") == 0)
+		snprintf(reply, len, "ok %s\n", (s = ctx.subs) ? s : "");
+	else if (strcmp(param, "command") == 0)
+		snprintf(reply, len, "ok %s\n",
+			(s = gethookcommand()) ? s : "");
+	else
+		snprintf(reply, len, "error unknown parameter '%s'\n", param);
+}
+
+
+
+static void set(const char *param, char *value, char *reply, int len)
+{
+	char *end;
+	long v;
+
+	if (strcmp(param, "subs") == 0) {
+		pthread_mutex_lock(&cs.lock);
+		cs.subs = *value ? strdup(value) : NULL;
+		pthread_mutex_unlock(&cs.lock);
+		queue(CTL_SUBS, reply, len);
+		return;
+	}
+	if (strcmp(param, "command") == 0) {
+		sethookcommand(*value ? strdup(value) : NULL);
+		snprintf(reply, len, "ok\n");
+		return;
+	}
+
+	v = strtol(value, &end, 10);
+	if (!*value || *end || v < 0 || v > 65535) {
+		snprintf(reply, len, "error bad value '%s'\n", value);
+		return;
+	}
+
+	if (strcmp(param, "sensitivity") == 0) {
+		setmotion(v, -1);
+		snprintf(reply, len, "ok applied from next vector frame\n");
+	} else if (strcmp(param, "threshold") == 0) {
+		setmotion(-1, v);
+		snprintf(reply, len, "ok applied from next vector frame\n");
+	} else if (strcmp(param, "debounce") == 0) {
+		pthread_mutex_lock(&cs.lock);
+		cs.debounce = v;
+		pthread_mutex_unlock(&cs.lock);
+		queue(CTL_DEBOUNCE, reply, len);
+	} else if (strcmp(param, "outro") == 0) {
+		pthread_mutex_lock(&cs.lock);
+		cs.outro = v;
+		pthread_mutex_unlock(&cs.lock);
+		queue(CTL_OUTRO, reply, len);
+	} else {
+		snprintf(reply, len, "error unknown parameter '%s'\n", param);
+	}
+}
+
+
+
+static void status(char *reply, int len)
+{
+	struct motionstats	ms;
+	struct hookstats	hs;
+	struct jitterstats	js;
+	enum recstate		state;
+	unsigned int		framenum;
+	unsigned int		logdropped, loglimited;
+	int			subscribers;
+	unsigned int		busdropped;
+
+	getmotionstats(&ms);
+	gethookstats(&hs);
+	getjitter(&js, 0);
+	logstats(&logdropped, &loglimited);
+	busstats(&subscribers, &busdropped);
+	pthread_mutex_lock(&ctx.lock);
+	state = ctx.sm.state;
+	framenum = ctx.framenum;
+	pthread_mutex_unlock(&ctx.lock);
+
+	snprintf(reply, len, "ok state=%s frame=%u hits=%d threshold=%d "
+		"moving=%d peak=%d bitrate=%d hooks=%u/%u/%u "
+		"latency=%u/%uus turnaround=%u/%u/%uus log=%u/%u "
+		"bus=%d/%u global=%d,%d%s%s\n",
+		statename(state), framenum, ms.hits, ms.threshold, ms.moving,
+		motionpeak(0), currentrate(), hs.sent, hs.failed, hs.dropped,
+		ctx.reclatency, ctx.recmaxlatency, js.mean, js.p99, js.max,
+		logdropped, loglimited, subscribers, busdropped, ms.gx, ms.gy,
+		ms.camera ? " camera" : "", ms.dozing ? " dozing" : "");
+}
+
+
+
+static void ring(char *reply, int len)
+{
+	unsigned int	frames = 0, preroll;
+	uint64_t	bytes = 0;
+	int		i;
+
+	pthread_mutex_lock(&ctx.lock);
+	for (i = 0; i < INMEMFRAMES; i++) {
+		if (ctx.frames[i].buf) {
+			frames++;
+			bytes += ctx.frames[i].len;
+		}
+	}
+	preroll = ctx.framenum - ctx.previframe;
+	pthread_mutex_unlock(&ctx.lock);
+
+	snprintf(reply, len, "ok frames=%u/%d bytes=%llu preroll=%u "
+		"lastiframe=%u previframe=%u\n", frames, INMEMFRAMES,
+		(unsigned long long) bytes, preroll, ctx.lastiframe,
+		ctx.previframe);
+}
+
+
+
+static void command(char *line, char *reply, int len)
+{
+	char *cmd, *param, *value, *save;
+
+	cmd = strtok_r(line, " \t", &save);
+	if (!cmd) {
+		reply[0] = '\0';
+		return;
+	}
+	param = strtok_r(NULL, " \t", &save);
+	value = strtok_r(NULL, "", &save);
+	while (value && (*value == ' ' || *value == '\t'))
+		value++;
+
+	if (strcmp(cmd, "get") == 0 && param) {
+		get(param, reply, len);
+	} else if (strcmp(cmd, "set") == 0 && param) {
+		set(param, value ? value : "", reply, len);
+	} else if (strcmp(cmd, "trigger") == 0) {
+		queue(CTL_TRIGGER, reply, len);
+	} else if (strcmp(cmd, "stop") == 0) {
+		queue(CTL_STOP, reply, len);
+	} else if (strcmp(cmd, "status") == 0) {
+		status(reply, len);
+	} else if (strcmp(cmd, "ring") == 0) {
+		ring(reply, len);
+	} else if (strcmp(cmd, "help") == 0) {
+		snprintf(reply, len, "ok get|set <sensitivity|threshold|"
+			"debounce|outro|subs|command> [value], trigger, stop, "
+			"status, ring\n");
+	} else {
+		snprintf(reply, len, "error unknown command '%s'\n", cmd);
+	}
+}
+
+
+
+static void readclient(struct ctlclient *c)
+{
+	char reply[512];
+	char *nl;
+	int r;
+
+	r = read(c->fd, &c->buf[c->len], sizeof(c->buf) - 1 - c->len);
+	if (r <= 0) {
+		close(c->fd);
+		c->fd = -1;
+		return;
+	}
+	c->len += r;
+	c->buf[c->len] = '\0';
+
+	while ((nl = strchr(c->buf, '\n')) != NULL) {
+		*nl = '\0';
+		if (nl > c->buf && nl[-1] == '\r')
+			nl[-1] = '\0';
+		command(c->buf, reply, sizeof(reply));
+		if (reply[0] && write(c->fd, reply, strlen(reply)) < 0) {
+			close(c->fd);
+			c->fd = -1;
+			return;
+		}
+		c->len -= (nl + 1) - c->buf;
+		memmove(c->buf, nl + 1, c->len + 1);
+	}
+
+/* Overlong line; throw it away. */
+	if (c->len == sizeof(c->buf) - 1)
+		c->len = 0;
+}
+
+
+
+static void *ctlstart(void *args)
+{
+	struct pollfd	pfd[CTLCLIENTS + 1];
+	int		i, n, fd;
+
+	while (1) {
+		pfd[0].fd = cs.listenfd;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < CTLCLIENTS; i++) {
+			pfd[i+1].fd = cs.clients[i].fd;
+			pfd[i+1].events = POLLIN;
+			pfd[i+1].revents = 0;
+		}
+		n = poll(pfd, CTLCLIENTS + 1, -1);
+		if (n < 0)
+			continue;
+
+		for (i = 0; i < CTLCLIENTS; i++)
+			if (cs.clients[i].fd != -1 && pfd[i+1].revents)
+				readclient(&cs.clients[i]);
+
+		if (pfd[0].revents & POLLIN) {
+			fd = accept(cs.listenfd, NULL, NULL);
+			if (fd == -1)
+				continue;
+			for (i = 0; i < CTLCLIENTS; i++) {
+				if (cs.clients[i].fd == -1) {
+					cs.clients[i].fd = fd;
+					cs.clients[i].len = 0;
+					break;
+				}
+			}
+			if (i == CTLCLIENTS) {
+				const char *busy = "error too many clients\n";
+				write(fd, busy, strlen(busy));
+				close(fd);
+			}
+		}
+	}
+
+	return NULL; /* to shut the compiler up */
+}
@@ -0,0 +1,551 @@
+/* detect.c */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Decision logic shared between omxmotion and the offline tools; see
+ * detect.h.  The callers own the locking.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <png.h>
+#include "detect.h"
+
+
+
+void sminit(struct recsm *sm, int debounce, int outro)
+{
+	memset(sm, 0, sizeof(*sm));
+	sm->state = waiting;
+	sm->debounce = debounce;
+	sm->outro = outro;
+}
+
+
+
+/* The detector has changed its mind: */
+void smevent(struct recsm *sm, enum movementevents state,
+	unsigned int framenum)
+{
+	sm->lastevent = framenum;
+	if (state == quiescent) {
+		switch (sm->state) {
+		case waiting:
+			break;
+		case triggered:
+			sm->state = waiting;
+			break;
+		case recording:
+			sm->state = stopping;
+			break;
+		case stopping:
+			break;
+		}
+	} else if (state == movement) {
+		switch (sm->state) {
+		case waiting:
+			sm->state = triggered;
+			break;
+		case triggered:
+			break;
+		case recording:
+			break;
+		case stopping:
+			sm->state = recording;
+			break;
+		}
+	}
+}
+
+
+
+/* A frame has arrived; do we start or stop recording? */
+int smframe(struct recsm *sm, unsigned int framenum, int keyframe)
+{
+	switch (sm->state) {
+	case waiting:
+		break;
+	case triggered:
+		if ((framenum - sm->lastevent) > sm->debounce) {
+			sm->state = recording;
+			return SM_START;
+		}
+		break;
+	case recording:
+		break;
+	case stopping:
+		if ((framenum - sm->lastevent) > sm->outro && keyframe) {
+			sm->state = waiting;
+			return SM_STOP;
+		}
+		break;
+	}
+
+	return SM_NONE;
+}
+
+
+
+/*
+ * The map is cols wide, including the spare column the encoder appends
+ * to each row; that column can never trigger.  Thresholds are stored
+ * squared, as the magnitudes we compare them against are.
+ */
+void flatmap(uint16_t *map, int cols, int rows, int sens)
+{
+	int x, y;
+
+	sens = sens * sens;
+	if (sens > 65535)
+		sens = 65535;
+	for (y = 0; y < rows; y++) {
+		for (x = 0; x < cols-1; x++)
+			map[y*cols + x] = (uint16_t) sens;
+		map[y*cols + cols-1] = 65535;
+	}
+}
+
+
+
+/* Scale is a percentage applied to each heatmap pixel before squaring: */
+int loadmap(uint16_t *map, int cols, int rows, const char *fn, int scale)
+{
+	FILE *fd;
+	uint8_t header[8];
+	png_structp png;
+	png_infop info, end;
+	png_bytep *pngrows;
+	int i, j;
+
+	fd = fopen(fn, "rb");
+	if (!fd)
+		return -1;
+	if (fread(header, 1, sizeof(header), fd) != sizeof(header) ||
+		png_sig_cmp(header, 0, sizeof(header))) {
+		fclose(fd);
+		return -1;
+	}
+	png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png) {
+		fclose(fd);
+		return -1;
+	}
+	info = png_create_info_struct(png);
+	end = png_create_info_struct(png);
+	if (!info || !end) {
+		png_destroy_read_struct(&png, &info, &end);
+		fclose(fd);
+		return -1;
+	}
+	png_init_io(png, fd);
+	png_set_sig_bytes(png, sizeof(header));
+	png_read_png(png, info, PNG_TRANSFORM_STRIP_16 |
+		PNG_TRANSFORM_STRIP_ALPHA | PNG_TRANSFORM_PACKING, NULL);
+	if (png_get_image_width(png, info) < cols-1 ||
+		png_get_image_height(png, info) < rows) {
+		png_destroy_read_struct(&png, &info, &end);
+		fclose(fd);
+		return -1;
+	}
+	pngrows = png_get_rows(png, info);
+	for (i = 0; i < rows; i++) {
+		uint8_t *r = pngrows[i];
+		for (j = 0; j < cols-1; j++) {
+			int s = (r[j] * scale) / 100;
+			s = s * s;
+			map[i*cols + j] = (uint16_t) (s > 65535 ? 65535 : s);
+		}
+		map[i*cols + cols-1] = 65535;
+	}
+	png_destroy_read_struct(&png, &info, &end);
+	fclose(fd);
+
+	return 0;
+}
+
+
+
+/*
+ * The critical section.  Returns the number of macroblocks whose
+ * (squared) vector magnitude exceeds their (squared) threshold, and if
+ * grid is non-NULL, marks which ones did.
+ */
+int countmotion(const uint16_t *map, const struct motvec *v, int n,
+	uint8_t *grid)
+{
+	int i, t;
+
+	if (grid) {
+		for (i = t = 0; i < n; i++) {
+			grid[i] = map[i] <
+				((v[i].dx * v[i].dx) + (v[i].dy * v[i].dy));
+			t += grid[i];
+		}
+	} else {
+		for (i = t = 0; i < n; i++)
+			t += map[i] <
+				((v[i].dx * v[i].dx) + (v[i].dy * v[i].dy));
+	}
+
+	return t;
+}
+
+
+
+/*
+ * Bounding box (x0, y0, x1, y1, inclusive, in macroblocks) of the hot
+ * blocks in a grid from countmotion().  Empty, with x1 < x0, if there
+ * aren't any.
+ */
+void gridbox(const uint8_t *grid, int cols, int rows, uint8_t *box)
+{
+	int x, y;
+	int x0 = 255, y0 = 255, x1 = 0, y1 = 0;
+
+	for (y = 0; y < rows; y++) {
+		const uint8_t *r = &grid[y * cols];
+		for (x = 0; x < cols-1; x++) {
+			if (!r[x])
+				continue;
+			if (x < x0)
+				x0 = x;
+			if (x > x1)
+				x1 = x;
+			if (y < y0)
+				y0 = y;
+			y1 = y;
+		}
+	}
+	if (x0 == 255) {
+		box[0] = box[1] = 1;
+		box[2] = box[3] = 0;
+		return;
+	}
+	box[0] = x0;
+	box[1] = y0;
+	box[2] = x1;
+	box[3] = y1;
+}
+
+
+
+/*
+ * The blocks in map which can ever trigger, in ascending order so the
+ * vectors are read front to back.  Most heatmaps mask out a good part of
+ * the frame, and the spare column is always masked.  global is whether
+ * the global vector will be subtracted, which makes longer vectors
+ * possible.  list must have room for n entries; returns how many there
+ * are.
+ */
+int activelist(const uint16_t *map, int n, struct active *list, int global)
+{
+	int i, a, never = global ? NEVERGLOBAL : NEVERTRIGGER;
+
+	for (i = a = 0; i < n; i++) {
+		if (map[i] >= never)
+			continue;
+		list[a].i = i;
+		list[a].thr = map[i];
+		a++;
+	}
+
+	return a;
+}
+
+
+
+#define CHUNK	(64)
+
+/*
+ * countmotion() over an active list, less the global vector (gx, gy).
+ * With a grid (which must be zero
+ * for the inactive blocks) every block is counted.  Without, we stop as
+ * soon as the answer to "are at least need blocks hot?" is certain, so
+ * the count returned is only exact if it's less than need and nothing
+ * was skipped; in practice, a count at or over need means "moving".
+ */
+int countactive(const struct active *list, int n, const struct motvec *v,
+	int gx, int gy, uint8_t *grid, int need)
+{
+	int i, j, end, t = 0;
+
+	if (grid) {
+		for (i = 0; i < n; i++) {
+			const struct motvec *m = &v[list[i].i];
+			int dx = m->dx - gx, dy = m->dy - gy;
+			int hot = list[i].thr < (dx * dx) + (dy * dy);
+			grid[list[i].i] = hot;
+			t += hot;
+		}
+		return t;
+	}
+
+	for (i = 0; i < n; i = end) {
+		end = i + CHUNK < n ? i + CHUNK : n;
+		for (j = i; j < end; j++) {
+			const struct motvec *m = &v[list[j].i];
+			int dx = m->dx - gx, dy = m->dy - gy;
+			t += list[j].thr < (dx * dx) + (dy * dy);
+		}
+		if (t >= need || t + (n - end) < need)
+			break;
+	}
+
+	return t;
+}
+
+
+
+/*
+ * Oscillating motion -- branches, flags, washing on the line -- moves
+ * back and forth, so over a few frames the vectors in its part of the
+ * frame cancel out, while someone walking across keeps going the same
+ * way.  Each region keeps a decayed sum of its hot blocks' vectors, and
+ * of their lengths (|dx| + |dy|; no square roots).  The ratio of the
+ * first's length to the second is 1 for steady motion in one direction,
+ * and tends to 0 for motion which keeps reversing.  Hot blocks count
+ * in proportion to their region's ratio.
+ *
+ * Sums are fixed point, << FIXSHIFT, so small ones still decay.
+ */
+#define FIXSHIFT	(4)
+
+struct coherence *cohinit(int cols, int rows, int window)
+{
+	struct coherence *c;
+	int x, y, n;
+
+	c = calloc(1, sizeof(*c));
+	c->cols = (cols + REGIONSIZE - 1) / REGIONSIZE;
+	c->rows = (rows + REGIONSIZE - 1) / REGIONSIZE;
+	for (c->shift = 1; (1 << c->shift) < window && c->shift < 8; c->shift++)
+		;
+	n = c->cols * c->rows;
+	c->regionof = malloc(cols * rows * sizeof(uint16_t));
+	for (y = 0; y < rows; y++)
+		for (x = 0; x < cols; x++)
+			c->regionof[y * cols + x] = (y / REGIONSIZE) * c->cols +
+				x / REGIONSIZE;
+	c->sx = calloc(n, sizeof(int32_t));
+	c->sy = calloc(n, sizeof(int32_t));
+	c->sm = calloc(n, sizeof(int32_t));
+	c->fx = calloc(n, sizeof(int16_t));
+	c->fy = calloc(n, sizeof(int16_t));
+	c->fm = calloc(n, sizeof(uint16_t));
+	c->fh = calloc(n, sizeof(uint16_t));
+
+	return c;
+}
+
+
+
+/* Forget everything seen so far: */
+void cohreset(struct coherence *c)
+{
+	int n = c->cols * c->rows;
+
+	memset(c->sx, 0, n * sizeof(int32_t));
+	memset(c->sy, 0, n * sizeof(int32_t));
+	memset(c->sm, 0, n * sizeof(int32_t));
+}
+
+
+
+/* As countactive() with a grid, but weighted by coherence: */
+int cohcount(struct coherence *c, const struct active *list, int n,
+	const struct motvec *v, int gx, int gy, uint8_t *grid)
+{
+	int i, r, t = 0;
+	int nr = c->cols * c->rows;
+
+	memset(c->fx, 0, nr * sizeof(int16_t));
+	memset(c->fy, 0, nr * sizeof(int16_t));
+	memset(c->fm, 0, nr * sizeof(uint16_t));
+	memset(c->fh, 0, nr * sizeof(uint16_t));
+
+	for (i = 0; i < n; i++) {
+		const struct motvec *m = &v[list[i].i];
+		int dx = m->dx - gx, dy = m->dy - gy;
+		int hot = list[i].thr < (dx * dx) + (dy * dy);
+
+		if (grid)
+			grid[list[i].i] = hot;
+		if (!hot)
+			continue;
+		r = c->regionof[list[i].i];
+		c->fx[r] += dx;
+		c->fy[r] += dy;
+		c->fm[r] += abs(dx) + abs(dy);
+		c->fh[r]++;
+	}
+
+	for (r = 0; r < nr; r++) {
+		int32_t l;
+		int w;
+
+		c->sx[r] += (c->fx[r] << FIXSHIFT) - (c->sx[r] >> c->shift);
+		c->sy[r] += (c->fy[r] << FIXSHIFT) - (c->sy[r] >> c->shift);
+		c->sm[r] += (c->fm[r] << FIXSHIFT) - (c->sm[r] >> c->shift);
+		if (!c->fh[r] || c->sm[r] <= 0)
+			continue;
+		l = abs(c->sx[r]) + abs(c->sy[r]);
+		w = ((int64_t) l << 8) / c->sm[r];
+		if (w > 256)
+			w = 256;
+		t += (c->fh[r] * w + 128) >> 8;
+	}
+
+	return t;
+}
+
+
+
+/*
+ * The dominant vector in the frame: the most common dx and the most
+ * common dy, from one pass over the grid (less the spare column) into a
+ * pair of histograms.  When the camera shakes or pans, nearly every block
+ * moves by about the same amount, and that's what this finds; in a still
+ * scene it's (0, 0).  Returns how many blocks agree with it, to within
+ * one either way, in 256ths of the frame; as dx and dy are counted
+ * separately, it's an upper bound.
+ */
+int globalmotion(const struct motvec *v, int cols, int rows, int *gx,
+	int *gy)
+{
+	uint16_t hx[256], hy[256];
+	int x, y, i, bx, by, ax, ay;
+
+	memset(hx, 0, sizeof(hx));
+	memset(hy, 0, sizeof(hy));
+	for (y = 0; y < rows; y++) {
+		const struct motvec *r = &v[y * cols];
+		for (x = 0; x < cols-1; x++) {
+			hx[(uint8_t) r[x].dx]++;
+			hy[(uint8_t) r[x].dy]++;
+		}
+	}
+
+	for (i = bx = by = 0; i < 256; i++) {
+		if (hx[i] > hx[bx])
+			bx = i;
+		if (hy[i] > hy[by])
+			by = i;
+	}
+	*gx = (int8_t) bx;
+	*gy = (int8_t) by;
+
+	ax = hx[bx] + hx[(bx + 1) & 255] + hx[(bx - 1) & 255];
+	ay = hy[by] + hy[(by + 1) & 255] + hy[(by - 1) & 255];
+
+	return ((ax < ay ? ax : ay) << 8) / ((cols-1) * rows);
+}
+
+
+
+/*
+ * Add a grid from countactive() or cohcount() to a per-block running
+ * count.  Only the active blocks can be set, so only they're visited.
+ * Counts stick at 65535: at 30fps, over half an hour of solid motion.
+ */
+void accumulate(uint16_t *acc, const struct active *list, int n,
+	const uint8_t *grid)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		uint16_t *a = &acc[list[i].i];
+		*a += grid[list[i].i] && *a != 65535;
+	}
+}
+
+
+
+/* Black, through blue, red and yellow, to white: */
+static void heatcolour(int v, uint8_t *rgb)
+{
+	int f = (v & 63) << 2;
+
+	switch (v >> 6) {
+	case 0:
+		rgb[0] = 0;	rgb[1] = 0;	rgb[2] = f;
+		break;
+	case 1:
+		rgb[0] = f;	rgb[1] = 0;	rgb[2] = 255 - f;
+		break;
+	case 2:
+		rgb[0] = 255;	rgb[1] = f;	rgb[2] = 0;
+		break;
+	default:
+		rgb[0] = 255;	rgb[1] = 255;	rgb[2] = f;
+		break;
+	}
+}
+
+
+
+/*
+ * Write accumulated counts as a false-colour PNG, one pixel per
+ * macroblock (less the spare column): the same size as a -m heatmap, so
+ * it can be laid over one.  Scaled to the busiest block; any block hit
+ * at all is at least dark blue, so that the odd flicker still shows up.
+ */
+int writeheat(const char *fn, const uint16_t *acc, int cols, int rows)
+{
+	FILE *fd;
+	png_structp png;
+	png_infop info;
+	png_bytep *pngrows;
+	uint8_t *img;
+	int x, y, max = 0;
+
+	for (y = 0; y < rows; y++)
+		for (x = 0; x < cols-1; x++)
+			if (acc[y*cols + x] > max)
+				max = acc[y*cols + x];
+
+	fd = fopen(fn, "wb");
+	if (!fd)
+		return -1;
+	img = malloc((cols-1) * rows * 3);
+	pngrows = malloc(rows * sizeof(png_bytep));
+	for (y = 0; y < rows; y++) {
+		pngrows[y] = &img[y * (cols-1) * 3];
+		for (x = 0; x < cols-1; x++) {
+			int a = acc[y*cols + x];
+			int v = a ? 32 + (a * 223) / max : 0;
+			heatcolour(v, &pngrows[y][x * 3]);
+		}
+	}
+
+	png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	info = png_create_info_struct(png);
+	png_init_io(png, fd);
+	png_set_IHDR(png, info, cols-1, rows, 8,
+		PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+		PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_set_rows(png, info, pngrows);
+	png_write_png(png, info, PNG_TRANSFORM_IDENTITY, NULL);
+	png_destroy_write_struct(&png, &info);
+	fclose(fd);
+	free(pngrows);
+	free(img);
+
+	return 0;
+}
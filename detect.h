@@ -0,0 +1,111 @@
+/* detect.h */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __DETECT_H
+#define __DETECT_H
+
+/*
+ * The decision logic: heatmaps, macroblock counting and the recording
+ * state machine.  Nothing in here knows about OpenMAX, threads or the
+ * global context, so omxmotion and the offline tools run exactly the
+ * same code.
+ */
+
+#include <stdint.h>
+#include "motion.h"
+
+#define IFRAMEAFTER	(64)
+#define DEBOUNCE	(12)
+
+
+enum recstate {
+	waiting,
+	triggered,
+	recording,
+	stopping,
+};
+
+
+struct recsm {
+	enum recstate	state;
+	unsigned int	lastevent;
+	int		debounce;
+	int		outro;
+};
+
+/* smframe() return values: */
+#define SM_NONE		(0)
+#define SM_START	(1)
+#define SM_STOP		(2)
+
+
+void sminit(struct recsm *, int debounce, int outro);
+void smevent(struct recsm *, enum movementevents, unsigned int framenum);
+int smframe(struct recsm *, unsigned int framenum, int keyframe);
+
+/* A macroblock which can trigger, and its threshold: */
+struct active {
+	uint16_t	i;
+	uint16_t	thr;
+};
+
+/*
+ * Direction coherence, per REGIONSIZE x REGIONSIZE block region: decayed
+ * sums of the hot vectors, and of their lengths, over a window of about
+ * 1 << shift frames.
+ */
+#define REGIONSIZE	(4)
+
+struct coherence {
+	int		cols, rows;	/* In regions */
+	int		shift;
+	uint16_t	*regionof;	/* Per macroblock */
+	int32_t		*sx, *sy, *sm;
+	int16_t		*fx, *fy;
+	uint16_t	*fm, *fh;
+};
+
+/*
+ * Nothing reaches this; dx and dy are both at most 128 in magnitude.  Less
+ * the global vector, they can be up to 255, and then only the map's own
+ * "never" (the spare column, or anything clamped) is out of bounds.
+ */
+#define NEVERTRIGGER	(2 * 128 * 128)
+#define NEVERGLOBAL	(65535)
+
+
+void flatmap(uint16_t *map, int cols, int rows, int sens);
+int loadmap(uint16_t *map, int cols, int rows, const char *fn, int scale);
+int countmotion(const uint16_t *map, const struct motvec *v, int n,
+	uint8_t *grid);
+void gridbox(const uint8_t *grid, int cols, int rows, uint8_t *box);
+int activelist(const uint16_t *map, int n, struct active *list, int global);
+int countactive(const struct active *list, int n, const struct motvec *v,
+	int gx, int gy, uint8_t *grid, int need);
+struct coherence *cohinit(int cols, int rows, int window);
+void cohreset(struct coherence *);
+int cohcount(struct coherence *, const struct active *list, int n,
+	const struct motvec *v, int gx, int gy, uint8_t *grid);
+int globalmotion(const struct motvec *v, int cols, int rows, int *gx,
+	int *gy);
+void accumulate(uint16_t *acc, const struct active *list, int n,
+	const uint8_t *grid);
+int writeheat(const char *fn, const uint16_t *acc, int cols, int rows);
+
+#endif /* __DETECT_H */
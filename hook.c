@@ -0,0 +1,406 @@
+/* hook.c */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Event hooks.
+ *
+ * We used to fork() the whole process from the recording thread on
+ * every start and stop, which copied the page tables of a process
+ * holding the entire frame ring, right when that thread should have
+ * been writing the pre-roll.  Now the recording thread just queues the
+ * event and carries on; a hook thread delivers it, either by
+ * posix_spawn()ing -e command with 'start'/'stop' and the filename, as
+ * before, or by writing a line of JSON to the stdin of a -E helper
+ * which is started once and kept running:
+ *
+ *   {"event":"start","file":"...","time":1431270000.123,"frame":1234,
+ *    "peak":57,"threshold":20}
+ *
+ * The hook thread reaps its children, so exit statuses and the time
+ * from queueing to delivery can be reported.
+ */
+
+#include "omxmotion.h"
+#include "motion.h"
+#include "hook.h"
+#include "prio.h"
+#include "log.h"
+#include <spawn.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+static void *hookstart(void *);
+
+#define HOOKQUEUE	(32)
+#define HOOKCHILDREN	(16)
+#define HOOKTIMEOUT	(1000)	/* ms to wait for the helper to read */
+
+
+
+struct hookevent {
+	enum recstate		state;
+	char			file[256];
+	struct timespec		queued;		/* CLOCK_MONOTONIC */
+	struct timespec		wall;
+	unsigned int		framenum;
+	int			peak;
+	int			threshold;
+};
+
+
+
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	pthread_t		thread;
+	const char		*command;
+	const char		*helper;
+	int			running;
+	pid_t			helperpid;
+	int			helperfd;
+	struct hookevent	queue[HOOKQUEUE];
+	unsigned int		head, tail;
+	struct {
+		pid_t		pid;
+		struct timespec	started;
+		enum recstate	state;
+	}			children[HOOKCHILDREN];
+	struct hookstats	stats;
+} hk;
+
+
+
+static float since(struct timespec *then)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - then->tv_sec) * 1000.0 +
+		(now.tv_nsec - then->tv_nsec) / 1000000.0;
+}
+
+
+
+static void starthooks(void)
+{
+	pthread_attr_t detach;
+
+/* A helper going away shouldn't take us with it: */
+	signal(SIGPIPE, SIG_IGN);
+
+	pthread_attr_init(&detach);
+	pthread_attr_setdetachstate(&detach, PTHREAD_CREATE_DETACHED);
+	pthread_create(&hk.thread, &detach, hookstart, NULL);
+	hk.running = 1;
+}
+
+
+
+int inithooks(const char *command, const char *helper)
+{
+	memset(&hk, 0, sizeof(hk));
+	hk.command = command;
+	hk.helper = helper;
+	hk.helperfd = -1;
+	pthread_mutex_init(&hk.lock, NULL);
+	pthread_cond_init(&hk.cond, NULL);
+	if (command || helper)
+		starthooks();
+
+	return 0;
+}
+
+
+
+/* Swap the -e command at runtime; NULL turns it off. */
+void sethookcommand(const char *command)
+{
+	pthread_mutex_lock(&hk.lock);
+	hk.command = command;
+	if (command && !hk.running)
+		starthooks();
+	pthread_mutex_unlock(&hk.lock);
+}
+
+
+
+const char *gethookcommand(void)
+{
+	return hk.command;
+}
+
+
+
+/* Called from the recording thread.  Doesn't block. */
+void hook(enum recstate state, const char *filename)
+{
+	struct hookevent *e;
+
+	pthread_mutex_lock(&hk.lock);
+	if (!hk.command && !hk.helper) {
+		pthread_mutex_unlock(&hk.lock);
+		return;
+	}
+	if (hk.head - hk.tail >= HOOKQUEUE) {
+		hk.stats.dropped++;
+		pthread_mutex_unlock(&hk.lock);
+		return;
+	}
+	e = &hk.queue[hk.head % HOOKQUEUE];
+	e->state = state;
+	snprintf(e->file, sizeof(e->file), "%s", filename);
+	clock_gettime(CLOCK_MONOTONIC, &e->queued);
+	clock_gettime(CLOCK_REALTIME, &e->wall);
+	e->framenum = ctx.framenum;
+	e->peak = motionpeak(0);
+	e->threshold = motionthreshold();
+	hk.head++;
+	pthread_cond_signal(&hk.cond);
+	pthread_mutex_unlock(&hk.lock);
+}
+
+
+
+void gethookstats(struct hookstats *s)
+{
+	pthread_mutex_lock(&hk.lock);
+	*s = hk.stats;
+	pthread_mutex_unlock(&hk.lock);
+}
+
+
+
+static void report(struct hookevent *e, const char *how, int ok)
+{
+	float ms = since(&e->queued);
+
+	pthread_mutex_lock(&hk.lock);
+	hk.stats.lastms = ms;
+	if (ms > hk.stats.maxms)
+		hk.stats.maxms = ms;
+	if (ok)
+		hk.stats.sent++;
+	else
+		hk.stats.failed++;
+	pthread_mutex_unlock(&hk.lock);
+
+	logmsg(ok ? V_INFO : V_ERROR, "Hook %s %s %s after %.1fms\n",
+		e->state == recording ? "start" : "stop", how,
+		ok ? "delivered" : "FAILED", ms);
+}
+
+
+
+static void spawncommand(const char *command, struct hookevent *e)
+{
+	char *argv[4];
+	pid_t pid;
+	int i, r;
+
+	argv[0] = (char *) command;
+	argv[1] = (e->state == recording) ? "start" : "stop";
+	argv[2] = e->file;
+	argv[3] = NULL;
+
+	r = posix_spawnp(&pid, command, NULL, NULL, argv, environ);
+	if (r != 0) {
+		logmsg(V_ERROR, "Failed to spawn %s: %s\n", command,
+			strerror(r));
+		report(e, "command", 0);
+		return;
+	}
+	report(e, "command", 1);
+
+	for (i = 0; i < HOOKCHILDREN; i++) {
+		if (hk.children[i].pid == 0) {
+			hk.children[i].pid = pid;
+			hk.children[i].state = e->state;
+			clock_gettime(CLOCK_MONOTONIC, &hk.children[i].started);
+			break;
+		}
+	}
+}
+
+
+
+static int spawnhelper(void)
+{
+	posix_spawn_file_actions_t fa;
+	char *argv[4];
+	int p[2];
+	int r;
+
+	if (pipe(p) != 0)
+		return -1;
+	fcntl(p[1], F_SETFD, FD_CLOEXEC);
+
+	argv[0] = "sh";
+	argv[1] = "-c";
+	argv[2] = (char *) hk.helper;
+	argv[3] = NULL;
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, p[0], 0);
+	posix_spawn_file_actions_addclose(&fa, p[0]);
+	r = posix_spawn(&hk.helperpid, "/bin/sh", &fa, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	close(p[0]);
+	if (r != 0) {
+		logmsg(V_ERROR, "Failed to start hook helper %s: %s\n",
+			hk.helper, strerror(r));
+		close(p[1]);
+		hk.helperpid = 0;
+		return -1;
+	}
+	hk.helperfd = p[1];
+
+	return 0;
+}
+
+
+
+static void writehelper(struct hookevent *e)
+{
+	char line[1024];
+	char file[512];
+	struct pollfd pfd;
+	int i, j, l;
+
+	if (hk.helperfd == -1 && spawnhelper() != 0) {
+		report(e, "helper", 0);
+		return;
+	}
+
+/* Escape the filename for JSON: */
+	for (i = j = 0; e->file[i] && j < sizeof(file) - 7; i++) {
+		unsigned char c = e->file[i];
+		if (c == '"' || c == '\\') {
+			file[j++] = '\\';
+			file[j++] = c;
+		} else if (c < 0x20) {
+			j += sprintf(&file[j], "\\u%04x", c);
+		} else {
+			file[j++] = c;
+		}
+	}
+	file[j] = '\0';
+
+	l = snprintf(line, sizeof(line), "{\"event\":\"%s\",\"file\":\"%s\","
+		"\"time\":%ld.%03ld,\"frame\":%u,\"peak\":%d,"
+		"\"threshold\":%d}\n",
+		e->state == recording ? "start" : "stop", file,
+		(long) e->wall.tv_sec, e->wall.tv_nsec / 1000000,
+		e->framenum, e->peak, e->threshold);
+
+	pfd.fd = hk.helperfd;
+	pfd.events = POLLOUT;
+	if (poll(&pfd, 1, HOOKTIMEOUT) != 1 || (pfd.revents & POLLOUT) == 0 ||
+		write(hk.helperfd, line, l) != l) {
+/* Stuck or gone; we'll start another next time. */
+		logmsg(V_ERROR, "Hook helper isn't listening: %s\n",
+			strerror(errno));
+		close(hk.helperfd);
+		hk.helperfd = -1;
+		if (hk.helperpid)
+			kill(hk.helperpid, SIGTERM);
+		report(e, "helper", 0);
+		return;
+	}
+	report(e, "helper", 1);
+}
+
+
+
+static void reap(void)
+{
+	pid_t pid;
+	int status, i;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		int failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+
+		if (pid == hk.helperpid) {
+			logmsg(V_ERROR, "Hook helper exited (status %x); "
+				"restarting on next event\n", status);
+			hk.helperpid = 0;
+			if (hk.helperfd != -1) {
+				close(hk.helperfd);
+				hk.helperfd = -1;
+			}
+			continue;
+		}
+		for (i = 0; i < HOOKCHILDREN; i++) {
+			if (hk.children[i].pid != pid)
+				continue;
+			if (failed) {
+				pthread_mutex_lock(&hk.lock);
+				hk.stats.failed++;
+				pthread_mutex_unlock(&hk.lock);
+			}
+			logmsg(failed ? V_ERROR : V_INFO, "Hook %s exited with "
+				"status %x after %.0fms\n",
+				hk.children[i].state == recording ?
+					"start" : "stop",
+				status, since(&hk.children[i].started));
+			hk.children[i].pid = 0;
+			break;
+		}
+	}
+}
+
+
+
+static void *hookstart(void *args)
+{
+	struct hookevent e;
+	struct timespec timeout;
+	const char *command;
+
+	schedthread(ROLE_HOOK);
+	while (1) {
+		pthread_mutex_lock(&hk.lock);
+		while (hk.head == hk.tail) {
+			clock_gettime(CLOCK_REALTIME, &timeout);
+			timeout.tv_sec++;
+			if (pthread_cond_timedwait(&hk.cond, &hk.lock,
+				&timeout) == ETIMEDOUT)
+				break;
+		}
+		if (hk.head == hk.tail) {
+			pthread_mutex_unlock(&hk.lock);
+			reap();
+			continue;
+		}
+		e = hk.queue[hk.tail % HOOKQUEUE];
+		hk.tail++;
+		command = hk.command;
+		pthread_mutex_unlock(&hk.lock);
+
+		if (command)
+			spawncommand(command, &e);
+		if (hk.helper)
+			writehelper(&e);
+		reap();
+	}
+
+	return NULL; /* to shut the compiler up */
+}
@@ -0,0 +1,37 @@
+/* hook.h */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __HOOK_H
+#define __HOOK_H
+
+struct hookstats {
+	unsigned int	sent;
+	unsigned int	failed;
+	unsigned int	dropped;
+	float		lastms;		/* Queue to spawn/write, ms */
+	float		maxms;
+};
+
+int inithooks(const char *command, const char *helper);
+void hook(enum recstate state, const char *filename);
+void gethookstats(struct hookstats *);
+void sethookcommand(const char *);
+const char *gethookcommand(void);
+
+#endif /* __HOOK_H */
@@ -0,0 +1,627 @@
+/* httpd.c */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Live HTTP endpoint, for -w.
+ *
+ * GET / (or /live.ts) returns the live stream as MPEG-TS, with chunked
+ * transfer encoding, to as many clients as there are slots.  The capture
+ * thread hands each frame over by copying it into a small queue and
+ * poking a pipe; everything else happens in our own thread.  Each frame
+ * is muxed once, into a reference-counted chunk (already framed for the
+ * chunked encoding) which every client's send queue points at.
+ *
+ * The chunks since the latest keyframe are kept, so a new client is sent
+ * the PAT and PMT, then the current GOP from its keyframe, and can start
+ * decoding at once instead of waiting up to IFRAMEAFTER frames.  A GOP
+ * of more than HTTPGOPFRAMES frames or HTTPGOPBYTES isn't kept, and
+ * clients joining during it wait for the next keyframe; that leaves half
+ * of each client's queue for live frames while it works through the GOP.
+ *
+ * Nobody waits for a client.  One that falls HTTPMAXQUEUED behind, not
+ * counting what's left of the GOP it joined with, has its queue thrown
+ * away (bar the chunk it's part-way through) and picks up again at the
+ * next keyframe; one that makes no progress at all for
+ * HTTPSTALL seconds is dropped, as is one that hasn't sent its request
+ * within HTTPSTALL seconds of connecting.  We listen on the loopback
+ * unless -w is given an address; there's no authentication.  If we fall behind ourselves, the capture
+ * thread drops frames up to the next keyframe rather than wait.
+ */
+
+#include "omxmotion.h"
+#include "httpd.h"
+#include "prio.h"
+#include "log.h"
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+static void *httpstart(void *);
+
+#define HTTPCLIENTS	(16)
+#define HTTPQUEUE	(512)		/* Chunks per client */
+#define HTTPMAXQUEUED	(4 << 20)	/* Bytes, per client, past the GOP */
+#define HTTPGOPFRAMES	(HTTPQUEUE / 2)
+#define HTTPGOPBYTES	(4 << 20)
+#define HTTPPENDING	(32)		/* Frames from capture, not yet muxed */
+#define HTTPSTALL	(10)
+#define TSPACKET	(188)
+
+
+
+struct chunk {
+	int			refs;
+	int			len;
+	int			key;
+	uint8_t			data[];
+};
+
+struct httpclient {
+	int			fd;
+	int			streaming;
+	int			closing;	/* Once the queue's sent */
+	char			req[1024];
+	int			reqlen;
+	struct chunk		*queue[HTTPQUEUE];
+	unsigned int		head, tail;
+	int			off;		/* Into queue[tail] */
+	int			queued;		/* Bytes */
+	int			burst;		/* Of those, the GOP joined with */
+	int			waitkey;
+	unsigned int		skips;
+	time_t			progress;
+};
+
+struct pendframe {
+	uint8_t			*buf;
+	int			len;
+	int64_t			tick;
+	int			key;
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	pthread_t		thread;
+	int			running;
+	int			listenfd;
+	int			wake[2];
+/* Shared with the capture thread: */
+	struct pendframe	pending[HTTPPENDING];
+	unsigned int		phead, ptail;
+	int			needkey;
+	unsigned int		dropped;
+/* Ours: */
+	AVFormatContext		*oc;
+	uint8_t			*mux;
+	int			muxlen, muxalloc;
+	int			pmtpid;
+	uint8_t			pat[TSPACKET], pmt[TSPACKET];
+	struct chunk		*tables;
+	struct chunk		*gop[HTTPGOPFRAMES];
+	int			ngop, gopbytes;
+	struct httpclient	clients[HTTPCLIENTS];
+} ws;
+
+
+
+static int muxwrite(void *opaque, uint8_t *buf, int len)
+{
+	if (ws.muxlen + len > ws.muxalloc) {
+		ws.muxalloc = (ws.muxlen + len) * 2;
+		ws.mux = realloc(ws.mux, ws.muxalloc);
+	}
+	memcpy(&ws.mux[ws.muxlen], buf, len);
+	ws.muxlen += len;
+
+	return len;
+}
+
+
+
+static int openmux(void)
+{
+	AVRational	ts = { 1, 90000 };
+	AVCodecContext	*cc;
+	AVStream	*st;
+	int		r;
+
+	r = avformat_alloc_output_context2(&ws.oc, NULL, "mpegts", NULL);
+	if (r < 0 || !ws.oc)
+		return -1;
+	st = avformat_new_stream(ws.oc, avcodec_find_encoder(AV_CODEC_ID_H264));
+	cc = st->codec;
+	cc->width = ctx.width;
+	cc->height = ctx.height;
+	cc->codec_id = AV_CODEC_ID_H264;
+	cc->codec_type = AVMEDIA_TYPE_VIDEO;
+	cc->bit_rate = ctx.bitrate;
+	cc->time_base.num = 1;
+	cc->time_base.den = ctx.framerate;
+	st->time_base = ts;
+
+	ws.oc->pb = avio_alloc_context(av_malloc(4096), 4096, 1, NULL, NULL,
+		muxwrite, NULL);
+	ws.oc->flags |= AVFMT_FLAG_CUSTOM_IO;
+	if (avformat_write_header(ws.oc, NULL) < 0)
+		return -1;
+	avio_flush(ws.oc->pb);
+
+	return 0;
+}
+
+
+
+static struct chunk *newchunk(const uint8_t *data, int len, int key,
+	int framed)
+{
+	struct chunk *c;
+	char hdr[16];
+	int hl = 0;
+
+	if (framed)
+		hl = snprintf(hdr, sizeof(hdr), "%x\r\n", len);
+	c = malloc(sizeof(*c) + hl + len + 2);
+	c->refs = 1;
+	c->key = key;
+	memcpy(c->data, hdr, hl);
+	memcpy(&c->data[hl], data, len);
+	c->len = hl + len;
+	if (framed) {
+		memcpy(&c->data[c->len], "\r\n", 2);
+		c->len += 2;
+	}
+
+	return c;
+}
+
+
+
+static void unref(struct chunk *c)
+{
+	if (c && --c->refs == 0)
+		free(c);
+}
+
+
+
+/*
+ * Keep copies of the PAT and PMT as the muxer writes them, so each new
+ * client can be sent them first.
+ */
+static void findtables(const uint8_t *ts, int len)
+{
+	int i, pid, ptr;
+	const uint8_t *s;
+
+	for (i = 0; i + TSPACKET <= len; i += TSPACKET) {
+		const uint8_t *p = &ts[i];
+
+		if (p[0] != 0x47 || !(p[1] & 0x40))
+			continue;	/* Not the start of a section */
+		pid = ((p[1] & 0x1f) << 8) | p[2];
+		if (pid == 0) {
+			ptr = p[4];
+			s = &p[5 + ptr];
+			if (5 + ptr + 12 > TSPACKET)
+				continue;
+			ws.pmtpid = ((s[10] & 0x1f) << 8) | s[11];
+			memcpy(ws.pat, p, TSPACKET);
+		} else if (ws.pmtpid && pid == ws.pmtpid) {
+			memcpy(ws.pmt, p, TSPACKET);
+			if (!ws.tables) {
+				uint8_t both[2 * TSPACKET];
+				memcpy(both, ws.pat, TSPACKET);
+				memcpy(&both[TSPACKET], ws.pmt, TSPACKET);
+				ws.tables = newchunk(both, sizeof(both), 0, 1);
+			}
+		}
+	}
+}
+
+
+
+static void enqueue(struct httpclient *c, struct chunk *ch)
+{
+	ch->refs++;
+	c->queue[c->head++ % HTTPQUEUE] = ch;
+	c->queued += ch->len;
+}
+
+
+
+/* Throw away everything not yet started on; resume from the next key: */
+static void skipahead(struct httpclient *c)
+{
+	unsigned int keep = c->tail + (c->off > 0);
+
+	while (c->head != keep) {
+		struct chunk *ch = c->queue[--c->head % HTTPQUEUE];
+		c->queued -= ch->len;
+		unref(ch);
+	}
+	if (c->burst > c->queued)
+		c->burst = c->queued;
+	c->waitkey = 1;
+	c->skips++;
+}
+
+
+
+static void dropclient(struct httpclient *c)
+{
+	while (c->tail != c->head)
+		unref(c->queue[c->tail++ % HTTPQUEUE]);
+	close(c->fd);
+	c->fd = -1;
+	if (c->streaming)
+		logmsg(V_INFO, "HTTP client gone; skipped ahead %u times\n",
+			c->skips);
+}
+
+
+
+static void distribute(struct chunk *ch)
+{
+	int i;
+
+	for (i = 0; i < HTTPCLIENTS; i++) {
+		struct httpclient *c = &ws.clients[i];
+
+		if (c->fd == -1 || !c->streaming)
+			continue;
+		if (c->queued - c->burst + ch->len > HTTPMAXQUEUED ||
+			c->head - c->tail >= HTTPQUEUE - 2)
+			skipahead(c);
+		if (c->waitkey) {
+			if (!ch->key || !ws.tables)
+				continue;
+			c->waitkey = 0;
+			enqueue(c, ws.tables);
+		}
+		enqueue(c, ch);
+	}
+}
+
+
+
+/* Mux what the capture thread's handed us, and send it on: */
+static void takeframes(void)
+{
+	AVRational	us = { 1, 1000000 };
+	struct pendframe *p;
+	struct chunk	*ch;
+	AVPacket	pkt;
+	char		c[64];
+	int		i;
+
+	while (read(ws.wake[0], c, sizeof(c)) > 0)
+		;
+
+	pthread_mutex_lock(&ws.lock);
+	while (ws.ptail != ws.phead) {
+		p = &ws.pending[ws.ptail % HTTPPENDING];
+		pthread_mutex_unlock(&ws.lock);
+
+		av_init_packet(&pkt);
+		pkt.data = p->buf;
+		pkt.size = p->len;
+		pkt.pts = pkt.dts = av_rescale_q(p->tick, us,
+			ws.oc->streams[0]->time_base);
+		pkt.flags = p->key ? AV_PKT_FLAG_KEY : 0;
+		pkt.stream_index = 0;
+		av_write_frame(ws.oc, &pkt);
+		avio_flush(ws.oc->pb);
+		free(p->buf);
+
+		findtables(ws.mux, ws.muxlen);
+		ch = newchunk(ws.mux, ws.muxlen, p->key, 1);
+		ws.muxlen = 0;
+
+/* The GOP cache: */
+		if (ch->key || ws.ngop) {
+			if (ch->key || ws.gopbytes + ch->len > HTTPGOPBYTES ||
+				ws.ngop == HTTPGOPFRAMES) {
+				for (i = 0; i < ws.ngop; i++)
+					unref(ws.gop[i]);
+				ws.ngop = ws.gopbytes = 0;
+			}
+			if (ch->key || ws.ngop) {
+				ch->refs++;
+				ws.gop[ws.ngop++] = ch;
+				ws.gopbytes += ch->len;
+			}
+		}
+		distribute(ch);
+		unref(ch);
+
+		pthread_mutex_lock(&ws.lock);
+		ws.ptail++;
+	}
+	pthread_mutex_unlock(&ws.lock);
+}
+
+
+
+static void startstream(struct httpclient *c)
+{
+	static const char *ok = "HTTP/1.1 200 OK\r\n"
+		"Content-Type: video/mp2t\r\n"
+		"Transfer-Encoding: chunked\r\n"
+		"Cache-Control: no-cache\r\n"
+		"Connection: close\r\n\r\n";
+	struct chunk *ch;
+	int i;
+
+	ch = newchunk((const uint8_t *) ok, strlen(ok), 0, 0);
+	enqueue(c, ch);
+	unref(ch);
+	c->streaming = 1;
+
+/* Straight in at the latest keyframe, if we've got it all: */
+	if (ws.tables && ws.ngop) {
+		enqueue(c, ws.tables);
+		for (i = 0; i < ws.ngop; i++)
+			enqueue(c, ws.gop[i]);
+		c->burst = c->queued;
+	} else {
+		c->waitkey = 1;
+	}
+	logmsg(V_INFO, "HTTP client joined with %d frames of GOP\n", ws.ngop);
+}
+
+
+
+static void readrequest(struct httpclient *c)
+{
+	static const char *notfound = "HTTP/1.1 404 Not Found\r\n"
+		"Content-Length: 0\r\nConnection: close\r\n\r\n";
+	char path[256];
+	int r;
+
+/* Past the request, we don't care what they've got to say: */
+	if (c->streaming || c->closing) {
+		if (read(c->fd, path, sizeof(path)) <= 0)
+			dropclient(c);
+		return;
+	}
+
+	r = read(c->fd, &c->req[c->reqlen], sizeof(c->req) - 1 - c->reqlen);
+	if (r <= 0) {
+		dropclient(c);
+		return;
+	}
+	c->reqlen += r;
+	c->req[c->reqlen] = '\0';
+	if (!strstr(c->req, "\r\n\r\n") && !strstr(c->req, "\n\n")) {
+		if (c->reqlen == sizeof(c->req) - 1)
+			dropclient(c);
+		return;
+	}
+
+	if (sscanf(c->req, "GET %255s", path) == 1 &&
+		(strcmp(path, "/") == 0 || strcmp(path, "/live.ts") == 0)) {
+		startstream(c);
+	} else {
+		struct chunk *ch = newchunk((const uint8_t *) notfound,
+			strlen(notfound), 0, 0);
+		enqueue(c, ch);
+		unref(ch);
+		c->closing = 1;
+	}
+}
+
+
+
+static void sendclient(struct httpclient *c)
+{
+	struct chunk *ch;
+	int n;
+
+	while (c->tail != c->head) {
+		ch = c->queue[c->tail % HTTPQUEUE];
+		n = send(c->fd, &ch->data[c->off], ch->len - c->off,
+			MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				dropclient(c);
+			return;
+		}
+		c->progress = time(NULL);
+		c->off += n;
+		if (c->off < ch->len)
+			return;
+		c->queued -= ch->len;
+		c->burst -= c->burst < ch->len ? c->burst : ch->len;
+		c->off = 0;
+		c->tail++;
+		unref(ch);
+	}
+	if (c->closing)
+		dropclient(c);
+}
+
+
+
+static void acceptclient(void)
+{
+	struct httpclient *c;
+	int fd, i;
+
+	fd = accept(ws.listenfd, NULL, NULL);
+	if (fd == -1)
+		return;
+	for (i = 0; i < HTTPCLIENTS; i++)
+		if (ws.clients[i].fd == -1)
+			break;
+	if (i == HTTPCLIENTS) {
+		const char *busy = "HTTP/1.1 503 Service Unavailable\r\n"
+			"Content-Length: 0\r\nConnection: close\r\n\r\n";
+		write(fd, busy, strlen(busy));
+		close(fd);
+		return;
+	}
+	c = &ws.clients[i];
+	memset(c, 0, sizeof(*c));
+	c->fd = fd;
+	c->progress = time(NULL);
+}
+
+
+
+int inithttp(const char *addr, int port)
+{
+	struct sockaddr_in	sin;
+	pthread_attr_t		detach;
+	int			i, one = 1;
+
+	memset(&ws, 0, sizeof(ws));
+	if (!port)
+		return 0;
+
+	ws.listenfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (ws.listenfd == -1)
+		return -1;
+	setsockopt(ws.listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(port);
+	if (addr && inet_pton(AF_INET, addr, &sin.sin_addr) != 1) {
+		fprintf(stderr, "Can't listen on %s: not an IPv4 address\n",
+			addr);
+		close(ws.listenfd);
+		return -1;
+	}
+	if (bind(ws.listenfd, (struct sockaddr *) &sin, sizeof(sin)) != 0 ||
+		listen(ws.listenfd, HTTPCLIENTS) != 0 || pipe(ws.wake) != 0) {
+		fprintf(stderr, "Failed to listen on %s:%d: %s\n",
+			addr ? addr : "127.0.0.1", port, strerror(errno));
+		close(ws.listenfd);
+		return -1;
+	}
+	fcntl(ws.wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(ws.wake[1], F_SETFL, O_NONBLOCK);
+	for (i = 0; i < HTTPCLIENTS; i++)
+		ws.clients[i].fd = -1;
+	if (openmux() != 0) {
+		fprintf(stderr, "Failed to set up the HTTP stream's muxer\n");
+		close(ws.listenfd);
+		return -1;
+	}
+	findtables(ws.mux, ws.muxlen);
+	ws.muxlen = 0;
+
+	pthread_mutex_init(&ws.lock, NULL);
+	pthread_attr_init(&detach);
+	pthread_attr_setdetachstate(&detach, PTHREAD_CREATE_DETACHED);
+	pthread_create(&ws.thread, &detach, httpstart, NULL);
+	ws.running = 1;
+
+	return 0;
+}
+
+
+
+/*
+ * Called from the capture loop for every frame stored.  Only copies it;
+ * if we're too far behind to take it, it's dropped, along with the rest
+ * of its GOP.
+ */
+void httpframe(const uint8_t *buf, int len, int64_t tick, int key)
+{
+	struct pendframe *p;
+
+	if (!ws.running)
+		return;
+
+	pthread_mutex_lock(&ws.lock);
+	if ((ws.needkey && !key) || ws.phead - ws.ptail >= HTTPPENDING) {
+		ws.needkey = 1;
+		ws.dropped++;
+		pthread_mutex_unlock(&ws.lock);
+		return;
+	}
+	ws.needkey = 0;
+	pthread_mutex_unlock(&ws.lock);
+
+/* Only we advance phead, and the HTTP thread doesn't touch slots past it: */
+	p = &ws.pending[ws.phead % HTTPPENDING];
+	p->buf = malloc(len);
+	memcpy(p->buf, buf, len);
+	p->len = len;
+	p->tick = tick;
+	p->key = key;
+
+	pthread_mutex_lock(&ws.lock);
+	ws.phead++;
+	pthread_mutex_unlock(&ws.lock);
+	write(ws.wake[1], "", 1);
+}
+
+
+
+static void *httpstart(void *args)
+{
+	struct pollfd	pfd[HTTPCLIENTS + 2];
+	time_t		now;
+	int		i;
+
+	schedthread(ROLE_HTTP);
+	while (1) {
+		pfd[0].fd = ws.listenfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = ws.wake[0];
+		pfd[1].events = POLLIN;
+		for (i = 0; i < HTTPCLIENTS; i++) {
+			struct httpclient *c = &ws.clients[i];
+
+			pfd[i+2].fd = c->fd;
+			pfd[i+2].events = POLLIN |
+				(c->tail != c->head ? POLLOUT : 0);
+			pfd[i+2].revents = 0;
+		}
+		if (poll(pfd, HTTPCLIENTS + 2, 1000) < 0)
+			continue;
+
+		if (pfd[1].revents & POLLIN)
+			takeframes();
+
+		now = time(NULL);
+		for (i = 0; i < HTTPCLIENTS; i++) {
+			struct httpclient *c = &ws.clients[i];
+
+			if (c->fd != -1 && (pfd[i+2].revents & POLLIN))
+				readrequest(c);
+			if (c->fd != -1 && c->tail != c->head)
+				sendclient(c);
+			if (c->fd != -1 && c->tail != c->head &&
+				now - c->progress > HTTPSTALL)
+				dropclient(c);
+/* Nor can one hold a slot without ever finishing its request: */
+			if (c->fd != -1 && !c->streaming && !c->closing &&
+				now - c->progress > HTTPSTALL)
+				dropclient(c);
+		}
+
+		if (pfd[0].revents & POLLIN)
+			acceptclient();
+	}
+
+	return NULL; /* to shut the compiler up */
+}
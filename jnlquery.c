@@ -0,0 +1,144 @@
+/* jnlquery.c
+ *
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * Usage: ./jnlquery [-f from] [-t to] [-s] outputdir
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Lists the events in an omxmotion output directory's journal between two
+ * times.  Only the index is searched, so it's quick however long the
+ * journal, and the recordings themselves are never opened.
+ */
+
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "journal.h"
+
+extern char *optarg;
+extern int optind;
+
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-f from] [-t to] [-s] outputdir\n\n"
+		"Where:\n"
+	"\t-f from\t\tEarliest time, eg. 2015-05-10T02:00 (local time)\n"
+	"\t-s\t\tOnly list stops: one line per recording\n"
+	"\t-t to\t\tLatest time\n"
+		"\n", name);
+	exit(1);
+}
+
+
+
+static int64_t parsetime(const char *s)
+{
+	static const char *formats[] = {
+		"%Y-%m-%dT%H:%M:%S", "%Y-%m-%dT%H:%M", "%Y-%m-%d %H:%M:%S",
+		"%Y-%m-%d %H:%M", "%Y-%m-%d", NULL
+	};
+	struct tm tm;
+	const char *end;
+	int i;
+
+	for (i = 0; formats[i]; i++) {
+		memset(&tm, 0, sizeof(tm));
+		end = strptime(s, formats[i], &tm);
+		if (end && !*end) {
+			tm.tm_isdst = -1;
+			return (int64_t) mktime(&tm) * 1000000;
+		}
+	}
+	fprintf(stderr, "Can't make sense of the time '%s'\n", s);
+	exit(1);
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	struct jnlfile		*j;
+	struct jnlrecord	r;
+	struct tm		tm;
+	time_t			t;
+	char			when[64];
+	int64_t			from = INT64_MIN, to = INT64_MAX;
+	int			opt, stops = 0;
+	unsigned int		n;
+
+	while ((opt = getopt(argc, argv, "f:hst:")) != -1) {
+		switch (opt) {
+		case 'f':
+			from = parsetime(optarg);
+			break;
+		case 's':
+			stops = 1;
+			break;
+		case 't':
+			to = parsetime(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	j = jnlmap(argv[optind]);
+	if (!j) {
+		fprintf(stderr, "Failed to open the journal in %s: %s\n",
+			argv[optind], strerror(errno));
+		exit(1);
+	}
+
+	for (n = jnlfind(j, from); n < j->nindex &&
+		j->index[n].walltime <= to; n++) {
+		if (jnlread(j, n, &r) != 0)
+			break;
+		if (stops && r.event != JNL_STOP)
+			continue;
+
+		t = r.walltime / 1000000;
+		localtime_r(&t, &tm);
+		strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+		r.file[sizeof(r.file) - 1] = '\0';
+		if (r.event == JNL_START)
+			printf("%s.%03d start %9u %26s %s\n", when,
+				(int) (r.walltime / 1000 % 1000), r.firstframe,
+				"", r.file);
+		else
+			printf("%s.%03d stop  %9u-%-9u peak %5u/%-5u %s\n",
+				when, (int) (r.walltime / 1000 % 1000),
+				r.firstframe, r.lastframe, r.peak, r.threshold,
+				r.file);
+	}
+
+	jnlunmap(j);
+
+	return 0;
+}
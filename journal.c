@@ -0,0 +1,286 @@
+/* journal.c */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Event journal; see journal.h.  Records are a few per recording, so the
+ * recorder thread writes them directly.  Each record and index entry is a
+ * single O_APPEND write, and the index is only ever a convenience: if it's
+ * missing or short (we died between the two writes), it's rebuilt from
+ * the journal.
+ *
+ * This file doesn't depend on OpenMAX, so jnlquery can link it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "journal.h"
+
+
+
+static struct {
+	pthread_mutex_t		lock;
+	int			fd, ifd;
+	uint32_t		nrecs;
+	int64_t			lasttime;
+} jnl = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+	.ifd = -1,
+};
+
+
+
+static void names(const char *dir, char *fn, char *ifn, size_t len)
+{
+	snprintf(fn, len, "%s/journal.omj", dir);
+	snprintf(ifn, len, "%s/journal.omi", dir);
+}
+
+
+
+/* Index entries for records from onwards, into idx (which has room): */
+static uint32_t scan(int fd, const struct jnlheader *hdr, uint32_t from,
+	int64_t last, struct jnlindex *idx, uint32_t max)
+{
+	struct jnlrecord r;
+	uint32_t n = 0;
+
+	while (from + n < max) {
+		if (pread(fd, &r, sizeof(r), hdr->hdrsize +
+			(off_t) (from + n) * hdr->recsize) != sizeof(r) ||
+			r.sync != JNL_SYNC)
+			break;
+		if (r.walltime > last)
+			last = r.walltime;
+		idx[n].walltime = last;
+		idx[n].recno = from + n;
+		idx[n].reserved = 0;
+		n++;
+	}
+
+	return n;
+}
+
+
+
+int jnlopen(const char *dir)
+{
+	struct jnlheader	hdr;
+	struct jnlindex		*idx, tail;
+	struct stat		st;
+	char			fn[1024], ifn[1024];
+	uint32_t		nrecs, nidx, n;
+
+	names(dir, fn, ifn, sizeof(fn));
+	jnl.fd = open(fn, O_RDWR | O_CREAT | O_APPEND, 0666);
+	if (jnl.fd == -1)
+		return -1;
+	jnl.ifd = open(ifn, O_RDWR | O_CREAT | O_APPEND, 0666);
+	if (jnl.ifd == -1) {
+		close(jnl.fd);
+		jnl.fd = -1;
+		return -1;
+	}
+
+	fstat(jnl.fd, &st);
+	if (st.st_size == 0) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, JNL_MAGIC, sizeof(hdr.magic));
+		hdr.hdrsize = sizeof(hdr);
+		hdr.recsize = sizeof(struct jnlrecord);
+		hdr.created = time(NULL);
+		write(jnl.fd, &hdr, sizeof(hdr));
+		ftruncate(jnl.ifd, 0);
+		return 0;
+	}
+	if (pread(jnl.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		memcmp(hdr.magic, JNL_MAGIC, sizeof(hdr.magic)) != 0 ||
+		hdr.recsize != sizeof(struct jnlrecord)) {
+		fprintf(stderr, "%s isn't a journal I understand\n", fn);
+		jnlclose();
+		errno = EINVAL;
+		return -1;
+	}
+
+/* Drop any partial record, and catch the index up: */
+	nrecs = (st.st_size - hdr.hdrsize) / hdr.recsize;
+	ftruncate(jnl.fd, hdr.hdrsize + (off_t) nrecs * hdr.recsize);
+	fstat(jnl.ifd, &st);
+	nidx = st.st_size / sizeof(struct jnlindex);
+	if (nidx > nrecs)
+		nidx = 0;
+	ftruncate(jnl.ifd, (off_t) nidx * sizeof(struct jnlindex));
+	jnl.lasttime = 0;
+	if (nidx > 0 && pread(jnl.ifd, &tail, sizeof(tail),
+		(off_t) (nidx - 1) * sizeof(tail)) == sizeof(tail))
+		jnl.lasttime = tail.walltime;
+	if (nidx < nrecs) {
+		idx = malloc((nrecs - nidx) * sizeof(*idx));
+		n = scan(jnl.fd, &hdr, nidx, jnl.lasttime, idx, nrecs);
+		write(jnl.ifd, idx, n * sizeof(*idx));
+		if (n)
+			jnl.lasttime = idx[n-1].walltime;
+		free(idx);
+	}
+	jnl.nrecs = nrecs;
+
+	return 0;
+}
+
+
+
+void jnlappend(struct jnlrecord *r)
+{
+	struct jnlindex idx;
+
+	if (jnl.fd == -1)
+		return;
+
+	r->sync = JNL_SYNC;
+	pthread_mutex_lock(&jnl.lock);
+	if (write(jnl.fd, r, sizeof(*r)) != sizeof(*r)) {
+		fprintf(stderr, "Failed to write to the journal: %s\n",
+			strerror(errno));
+		pthread_mutex_unlock(&jnl.lock);
+		return;
+	}
+	if (r->walltime > jnl.lasttime)
+		jnl.lasttime = r->walltime;
+	memset(&idx, 0, sizeof(idx));
+	idx.walltime = jnl.lasttime;
+	idx.recno = jnl.nrecs++;
+	write(jnl.ifd, &idx, sizeof(idx));
+	pthread_mutex_unlock(&jnl.lock);
+}
+
+
+
+void jnlclose(void)
+{
+	if (jnl.fd != -1)
+		close(jnl.fd);
+	if (jnl.ifd != -1)
+		close(jnl.ifd);
+	jnl.fd = jnl.ifd = -1;
+}
+
+
+
+/* Reader: */
+
+struct jnlfile *jnlmap(const char *dir)
+{
+	struct jnlfile		*j;
+	struct stat		st;
+	char			fn[1024], ifn[1024];
+	uint32_t		nrecs;
+	int			ifd;
+
+	names(dir, fn, ifn, sizeof(fn));
+	j = calloc(1, sizeof(*j));
+	j->fd = open(fn, O_RDONLY);
+	if (j->fd == -1) {
+		free(j);
+		return NULL;
+	}
+	if (read(j->fd, &j->hdr, sizeof(j->hdr)) != sizeof(j->hdr) ||
+		memcmp(j->hdr.magic, JNL_MAGIC, sizeof(j->hdr.magic)) != 0 ||
+		j->hdr.recsize != sizeof(struct jnlrecord)) {
+		close(j->fd);
+		free(j);
+		errno = EINVAL;
+		return NULL;
+	}
+	fstat(j->fd, &st);
+	nrecs = (st.st_size - j->hdr.hdrsize) / j->hdr.recsize;
+
+	ifd = open(ifn, O_RDONLY);
+	if (ifd != -1 && fstat(ifd, &st) == 0 &&
+		st.st_size / sizeof(struct jnlindex) >= nrecs && nrecs > 0) {
+		j->maplen = nrecs * sizeof(struct jnlindex);
+		j->map = mmap(NULL, j->maplen, PROT_READ, MAP_SHARED, ifd, 0);
+		if (j->map == MAP_FAILED)
+			j->map = NULL;
+	}
+	if (ifd != -1)
+		close(ifd);
+
+	if (j->map) {
+		j->index = j->map;
+		j->nindex = nrecs;
+	} else if (nrecs > 0) {
+/* The index is a convenience; we can do without: */
+		struct jnlindex *idx = malloc(nrecs * sizeof(*idx));
+		j->nindex = scan(j->fd, &j->hdr, 0, 0, idx, nrecs);
+		j->index = idx;
+	}
+
+	return j;
+}
+
+
+
+/* The first entry at or after walltime; nindex if there isn't one: */
+unsigned int jnlfind(const struct jnlfile *j, int64_t walltime)
+{
+	unsigned int lo = 0, hi = j->nindex;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (j->index[mid].walltime < walltime)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+
+
+int jnlread(const struct jnlfile *j, unsigned int n, struct jnlrecord *r)
+{
+	if (n >= j->nindex)
+		return -1;
+	if (pread(j->fd, r, sizeof(*r), j->hdr.hdrsize +
+		(off_t) j->index[n].recno * j->hdr.recsize) != sizeof(*r))
+		return -1;
+
+	return r->sync == JNL_SYNC ? 0 : -1;
+}
+
+
+
+void jnlunmap(struct jnlfile *j)
+{
+	if (j->map)
+		munmap(j->map, j->maplen);
+	else
+		free((void *) j->index);
+	close(j->fd);
+	free(j);
+}
@@ -0,0 +1,95 @@
+/* journal.h */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __JOURNAL_H
+#define __JOURNAL_H
+
+/*
+ * The event journal.
+ *
+ * outdir/journal.omj is a struct jnlheader followed by one fixed-size
+ * struct jnlrecord per event, appended and never rewritten.  Alongside,
+ * journal.omi holds one struct jnlindex per record, sorted by time, so a
+ * reader can mmap() it and binary search for a time range without
+ * reading the journal itself, let alone the recordings.
+ *
+ * Everything is in host byte order.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define JNL_MAGIC	"OMJ1"
+#define JNL_SYNC	(0x43455254)	/* 'TREC' */
+
+#define JNL_START	(1)
+#define JNL_STOP	(2)
+
+struct jnlheader {
+	char		magic[4];
+	uint16_t	hdrsize;
+	uint16_t	recsize;
+	int64_t		created;
+};
+
+struct jnlrecord {
+	uint32_t	sync;
+	uint8_t		event;		/* JNL_START or JNL_STOP */
+	uint8_t		reserved[3];
+	int64_t		walltime;	/* First frame's, or last's; us */
+	int64_t		tick;		/* OMX timestamp of the first frame, us */
+	uint32_t	firstframe;
+	uint32_t	lastframe;	/* Same as firstframe for JNL_START */
+	uint16_t	peak;		/* Highest hit count */
+	uint16_t	threshold;
+	uint32_t	reserved2;
+	char		file[216];	/* Recording, NUL terminated */
+};
+
+/*
+ * The clock can go backwards (a Pi without an RTC, when NTP catches up),
+ * so the index's time is never less than the one before it.
+ */
+struct jnlindex {
+	int64_t		walltime;
+	uint32_t	recno;
+	uint32_t	reserved;
+};
+
+/* Writer; used by omxmotion: */
+int jnlopen(const char *dir);
+void jnlappend(struct jnlrecord *);
+void jnlclose(void);
+
+/* Reader: */
+struct jnlfile {
+	int			fd;
+	struct jnlheader	hdr;
+	const struct jnlindex	*index;
+	unsigned int		nindex;
+	void			*map;		/* Or NULL, if rebuilt */
+	size_t			maplen;
+};
+
+struct jnlfile *jnlmap(const char *dir);
+unsigned int jnlfind(const struct jnlfile *, int64_t walltime);
+int jnlread(const struct jnlfile *, unsigned int recno, struct jnlrecord *);
+void jnlunmap(struct jnlfile *);
+
+#endif /* __JOURNAL_H */
@@ -0,0 +1,392 @@
+/* log.c */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Asynchronous logging.
+ *
+ * The capture loop, OMX's callback thread and the detector used to
+ * printf() as they went, and would stall for as long as stdout took to
+ * accept it -- a slow terminal, a full pipe, an ssh session on a bad
+ * link.  Now each thread formats its message into a ring of its own and
+ * carries on; the log thread merges the rings in order and writes them
+ * to stdout, syslog or a file.
+ *
+ * Each ring has one writer (its thread) and one reader (whoever holds
+ * lg.lock: the log thread, or logflush() at exit), so needs no locks.
+ * A thread's ring is allocated the first time it logs, and never freed;
+ * all of our threads live as long as the process does.
+ *
+ * Messages above the configured level are discarded before they're
+ * formatted.  If a ring is full, or its thread is logging faster than
+ * LOGRATE a second (after a burst of LOGBURST), messages are dropped and
+ * counted, and the log thread says so.  Errors aren't rate-limited.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "log.h"
+#include "prio.h"
+
+#define LOGSLOTS	(64)		/* Records per thread */
+#define LOGTEXT		(496)
+#define LOGRATE		(50)		/* Records per second per thread, */
+#define LOGBURST	(200)		/* after this many */
+#define LOGREPORT	(10)		/* Seconds between complaints about it */
+
+enum logdest {
+	DEST_STDOUT,
+	DEST_SYSLOG,
+	DEST_FILE
+};
+
+struct logrec {
+	struct timespec	when;
+	uint32_t	seq;
+	int		level;
+	char		text[LOGTEXT];
+};
+
+struct logring {
+	struct logring	*next;
+	unsigned int	head;		/* Only the owning thread moves this */
+	unsigned int	tail;		/* Only the drainer moves this */
+	unsigned int	dropped;	/* Ring full */
+	unsigned int	limited;	/* Over the rate */
+	int		tokens;
+	int64_t		refill;		/* ms */
+	struct logrec	rec[LOGSLOTS];
+};
+
+static void *logstart(void *);
+
+
+
+static struct {
+	pthread_mutex_t		lock;	/* Held while draining */
+	pthread_t		thread;
+	struct logring		*rings;
+	enum logdest		dest;
+	FILE			*fd;
+	int			level;
+	int			wake[2];
+	int			asleep;
+	uint32_t		seq;
+	unsigned int		reported;
+	time_t			lastreport;
+	int			running;
+} lg = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.level = V_INFO,
+};
+
+static __thread struct logring *mine;
+
+
+
+int initlog(const char *dest, int level)
+{
+	pthread_attr_t		detach;
+	int			i;
+
+	lg.level = level;
+	if (!dest || strcmp(dest, "-") == 0) {
+		lg.dest = DEST_STDOUT;
+	} else if (strcmp(dest, "syslog") == 0) {
+		lg.dest = DEST_SYSLOG;
+		openlog("omxmotion", LOG_PID, LOG_DAEMON);
+	} else {
+		lg.dest = DEST_FILE;
+		lg.fd = fopen(dest, "a");
+		if (!lg.fd)
+			return -1;
+	}
+
+	if (pipe(lg.wake) != 0)
+		return -1;
+	for (i = 0; i < 2; i++)
+		fcntl(lg.wake[i], F_SETFL, O_NONBLOCK);
+
+	lg.running = 1;
+	atexit(logflush);
+	pthread_attr_init(&detach);
+	pthread_attr_setdetachstate(&detach, PTHREAD_CREATE_DETACHED);
+	pthread_create(&lg.thread, &detach, logstart, NULL);
+	pthread_attr_destroy(&detach);
+
+	return 0;
+}
+
+
+
+static struct logring *newring(void)
+{
+	struct logring *r;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->tokens = LOGBURST;
+
+/* Push it on to the list without taking lg.lock, which the drainer may
+ * be holding while it waits for stdout: */
+	r->next = __atomic_load_n(&lg.rings, __ATOMIC_ACQUIRE);
+	while (!__atomic_compare_exchange_n(&lg.rings, &r->next, r, 0,
+		__ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+		;
+	mine = r;
+
+	return r;
+}
+
+
+
+static int ratelimit(struct logring *r, const struct timespec *now)
+{
+	int64_t ms = (int64_t) now->tv_sec * 1000 + now->tv_nsec / 1000000;
+
+	if (ms > r->refill) {
+		int64_t t = r->tokens + (ms - r->refill) * LOGRATE / 1000;
+
+		r->tokens = t > LOGBURST ? LOGBURST : t;
+		r->refill = ms;
+	}
+	if (r->tokens == 0)
+		return 1;
+	r->tokens--;
+
+	return 0;
+}
+
+
+
+/*
+ * Never blocks, apart from the allocation the first time a thread logs.
+ * Before initlog(), or without it, this is an ordinary printf().
+ */
+void logmsg(int level, const char *fmt, ...)
+{
+	struct logring		*r;
+	struct logrec		*rec;
+	struct timespec		now;
+	va_list			ap;
+	unsigned int		head;
+	int			l;
+
+	if (level > lg.level)
+		return;
+	if (!lg.running) {
+		va_start(ap, fmt);
+		vfprintf(level == V_ERROR ? stderr : stdout, fmt, ap);
+		va_end(ap);
+		return;
+	}
+
+	r = mine ? mine : newring();
+	if (!r)
+		return;
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (level > V_ERROR && ratelimit(r, &now)) {
+		__atomic_fetch_add(&r->limited, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	head = r->head;
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= LOGSLOTS) {
+		__atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec = &r->rec[head % LOGSLOTS];
+	rec->when = now;
+	rec->level = level;
+	rec->seq = __atomic_fetch_add(&lg.seq, 1, __ATOMIC_RELAXED);
+	va_start(ap, fmt);
+	l = vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+	va_end(ap);
+	if (l >= (int) sizeof(rec->text))
+		rec->text[sizeof(rec->text) - 2] = '\n';
+
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&lg.asleep, 0, __ATOMIC_SEQ_CST))
+		write(lg.wake[1], "", 1);
+}
+
+
+
+static void emit(int level, const struct timespec *when, const char *text)
+{
+	static const int priorities[] = {
+		LOG_ERR, LOG_WARNING, LOG_INFO, LOG_DEBUG
+	};
+	int		l;
+	struct tm	tm;
+
+	if (lg.dest == DEST_STDOUT) {
+		if (level == V_ERROR) {
+			fflush(stdout);
+			fputs(text, stderr);
+		} else {
+			fputs(text, stdout);
+		}
+		return;
+	}
+
+/* Elsewhere, one line each, without the blank lines meant for a tty: */
+	while (*text == '\n')
+		text++;
+	l = strlen(text);
+	while (l > 0 && text[l-1] == '\n')
+		l--;
+	if (l == 0)
+		return;
+
+	if (lg.dest == DEST_SYSLOG) {
+		syslog(priorities[level], "%.*s", l, text);
+	} else {
+		localtime_r(&when->tv_sec, &tm);
+		fprintf(lg.fd, "%04d-%02d-%02d %02d:%02d:%02d.%03ld %.*s\n",
+			tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+			tm.tm_hour, tm.tm_min, tm.tm_sec,
+			when->tv_nsec / 1000000, l, text);
+	}
+}
+
+
+
+/* Write out everything that's waiting, oldest first.  With lg.lock held: */
+static void drain(int final)
+{
+	struct logring		*r, *best;
+	struct logrec		*rec, *oldest;
+	unsigned int		dropped, limited;
+	struct timespec		now;
+	char			msg[128];
+
+	while (1) {
+		best = NULL;
+		oldest = NULL;
+		for (r = __atomic_load_n(&lg.rings, __ATOMIC_ACQUIRE); r;
+			r = r->next) {
+			if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) ==
+				r->tail)
+				continue;
+			rec = &r->rec[r->tail % LOGSLOTS];
+			if (!oldest || (int32_t) (rec->seq - oldest->seq) < 0) {
+				best = r;
+				oldest = rec;
+			}
+		}
+		if (!best)
+			break;
+		emit(oldest->level, &oldest->when, oldest->text);
+		__atomic_store_n(&best->tail, best->tail + 1, __ATOMIC_RELEASE);
+	}
+
+	logstats(&dropped, &limited);
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (dropped + limited != lg.reported &&
+		(final || now.tv_sec - lg.lastreport >= LOGREPORT)) {
+		snprintf(msg, sizeof(msg), "Log: %u messages dropped, %u "
+			"rate-limited so far\n", dropped, limited);
+		emit(V_WARN, &now, msg);
+		lg.reported = dropped + limited;
+		lg.lastreport = now.tv_sec;
+	}
+
+	if (lg.dest == DEST_STDOUT)
+		fflush(stdout);
+	else if (lg.dest == DEST_FILE)
+		fflush(lg.fd);
+}
+
+
+
+static int pending(void)
+{
+	struct logring *r;
+
+	for (r = __atomic_load_n(&lg.rings, __ATOMIC_ACQUIRE); r; r = r->next)
+		if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != r->tail)
+			return 1;
+
+	return 0;
+}
+
+
+
+static void *logstart(void *args)
+{
+	struct pollfd		pfd;
+	char			buf[64];
+
+	schedthread(ROLE_LOG);
+	pfd.fd = lg.wake[0];
+	pfd.events = POLLIN;
+
+	while (1) {
+		pthread_mutex_lock(&lg.lock);
+		drain(0);
+		pthread_mutex_unlock(&lg.lock);
+
+/* Anything logged after this will wake us; anything before, we'll see: */
+		__atomic_store_n(&lg.asleep, 1, __ATOMIC_SEQ_CST);
+		if (!pending())
+			poll(&pfd, 1, 1000);
+		__atomic_store_n(&lg.asleep, 0, __ATOMIC_SEQ_CST);
+		while (read(lg.wake[0], buf, sizeof(buf)) > 0)
+			;
+	}
+
+	return NULL;
+}
+
+
+
+/* Called at exit, so nothing's lost: */
+void logflush(void)
+{
+	if (!lg.running)
+		return;
+
+	pthread_mutex_lock(&lg.lock);
+	drain(1);
+	pthread_mutex_unlock(&lg.lock);
+}
+
+
+
+void logstats(unsigned int *dropped, unsigned int *limited)
+{
+	struct logring *r;
+
+	*dropped = 0;
+	*limited = 0;
+	for (r = __atomic_load_n(&lg.rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		*dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+		*limited += __atomic_load_n(&r->limited, __ATOMIC_RELAXED);
+	}
+}
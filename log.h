@@ -0,0 +1,38 @@
+/* log.h */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __LOG_H
+#define __LOG_H
+
+/*
+ * Asynchronous logging.  See log.c.
+ */
+
+#define V_ERROR		0
+#define V_WARN		1
+#define V_INFO		2
+#define V_DEBUG		3
+
+int initlog(const char *dest, int level);
+void logmsg(int level, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+void logflush(void);
+void logstats(unsigned int *dropped, unsigned int *limited);
+
+#endif /* __LOG_H */
@@ -0,0 +1,216 @@
+/* monitor.c */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The -n ncurses monitor.
+ *
+ * The detection thread hands us its hit grid with monitorframe(), which
+ * is a memcpy under a lock and nothing more; the most recent grid wins.
+ * Our own thread wakes at most MONITORHZ times a second, squashes the
+ * grid down to fit whatever size the terminal is, and only touches the
+ * cells that have changed since the last update, which keeps the
+ * traffic over a slow ssh session down to a trickle.
+ *
+ * Where several macroblocks share a cell, the character shows how many
+ * of them were hot: ' ', '.', ':', '+' and '*' for all of them.
+ */
+
+#include "omxmotion.h"
+#include "motion.h"
+#include "monitor.h"
+#include "mvrec.h"
+#include "prio.h"
+#include <ncurses.h>
+
+static void *monitorstart(void *);
+
+#define STATLINES	(2)
+
+
+
+static struct {
+	pthread_mutex_t		lock;
+	pthread_t		thread;
+	int			cols, rows;	/* Grid, without the spare column */
+	uint8_t			*grid;
+	int			hits, threshold, moving;
+	unsigned int		seq;
+	char			*shown;
+	int			sw, sh;		/* Size of shown */
+} mon;
+
+
+
+int initmonitor(struct context *ctx)
+{
+	pthread_attr_t detach;
+
+	memset(&mon, 0, sizeof(mon));
+	mon.rows = (ctx->height + 15) / 16;
+	mon.cols = (ctx->width + 15) / 16;
+	mon.grid = calloc(mon.cols * mon.rows, 1);
+	pthread_mutex_init(&mon.lock, NULL);
+
+	initscr();
+	cbreak();
+	noecho();
+	curs_set(0);
+	nodelay(stdscr, TRUE);
+	keypad(stdscr, TRUE);
+
+	pthread_attr_init(&detach);
+	pthread_attr_setdetachstate(&detach, PTHREAD_CREATE_DETACHED);
+	pthread_create(&mon.thread, &detach, monitorstart, NULL);
+
+	return 0;
+}
+
+
+
+/*
+ * Called from the detection thread.  grid has the encoder's spare column
+ * on each row, which we drop here.
+ */
+void monitorframe(const uint8_t *grid, int hits, int threshold, int moving)
+{
+	int y;
+
+	pthread_mutex_lock(&mon.lock);
+	for (y = 0; y < mon.rows; y++)
+		memcpy(&mon.grid[y * mon.cols], &grid[y * (mon.cols+1)],
+			mon.cols);
+	mon.hits = hits;
+	mon.threshold = threshold;
+	mon.moving = moving;
+	mon.seq++;
+	pthread_mutex_unlock(&mon.lock);
+}
+
+
+
+static const char *statename(enum recstate s)
+{
+	switch (s) {
+	case waiting:
+		return "waiting";
+	case triggered:
+		return "triggered";
+	case recording:
+		return "recording";
+	case stopping:
+		return "stopping";
+	}
+	return "?";
+}
+
+
+
+static void *monitorstart(void *args)
+{
+	uint8_t			*grid;
+	struct timespec		then, now;
+	unsigned int		seq, lastseq = 0;
+	int			hits, threshold, moving;
+	float			fps = 0;
+	static const char	levels[] = " .:+*";
+
+	schedthread(ROLE_MONITOR);
+	grid = malloc(mon.cols * mon.rows);
+	clock_gettime(CLOCK_MONOTONIC, &then);
+
+	while (1) {
+		int w, h, x, y, lines, cols;
+		double dt;
+		int queued = 0;
+		unsigned int dropped = 0;
+
+		usleep(1000000 / MONITORHZ);
+
+/* Let ncurses notice SIGWINCH: */
+		while (getch() != ERR)
+			;
+
+		pthread_mutex_lock(&mon.lock);
+		memcpy(grid, mon.grid, mon.cols * mon.rows);
+		seq = mon.seq;
+		hits = mon.hits;
+		threshold = mon.threshold;
+		moving = mon.moving;
+		pthread_mutex_unlock(&mon.lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		dt = (now.tv_sec - then.tv_sec) +
+			(now.tv_nsec - then.tv_nsec) / 1e9;
+		if (dt >= 1.0) {
+			fps = (seq - lastseq) / dt;
+			lastseq = seq;
+			then = now;
+		}
+
+		getmaxyx(stdscr, lines, cols);
+		w = cols < mon.cols ? cols : mon.cols;
+		h = lines - STATLINES < mon.rows ? lines - STATLINES : mon.rows;
+		if (w < 1 || h < 1)
+			continue;
+
+		if (w != mon.sw || h != mon.sh) {
+			free(mon.shown);
+			mon.shown = malloc(w * h);
+			memset(mon.shown, 0, w * h);	/* Forces a redraw */
+			mon.sw = w;
+			mon.sh = h;
+			clear();
+		}
+
+		for (y = 0; y < h; y++) {
+			int y0 = (y * mon.rows) / h;
+			int y1 = ((y+1) * mon.rows) / h;
+			for (x = 0; x < w; x++) {
+				int x0 = (x * mon.cols) / w;
+				int x1 = ((x+1) * mon.cols) / w;
+				int i, j, n = 0, t = 0;
+				char c;
+
+				for (i = y0; i < y1; i++)
+					for (j = x0; j < x1; j++, n++)
+						t += grid[i * mon.cols + j];
+				c = levels[t == 0 ? 0 : (t == n) ? 4 :
+					1 + (t * 3 - 1) / n];
+				if (mon.shown[y * w + x] != c) {
+					mvaddch(y, x, c);
+					mon.shown[y * w + x] = c;
+				}
+			}
+		}
+
+		if (ctx.vecfile)
+			mvrecstats(&queued, &dropped);
+		mvprintw(h, 0, "%5d / %d (%c)  %-9s  %4.1f fps  %dx%d -> %dx%d",
+			hits, threshold, moving ? '*' : ' ',
+			statename(ctx.sm.state), fps, mon.cols, mon.rows, w, h);
+		clrtoeol();
+		mvprintw(h+1, 0, "ring %3d/%d  frame %u  vectors queued %d "
+			"dropped %u", ctx.framenum - ctx.previframe, INMEMFRAMES,
+			ctx.framenum, queued, dropped);
+		clrtoeol();
+		refresh();
+	}
+
+	return NULL; /* to shut the compiler up */
+}
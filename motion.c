@@ -36,22 +36,21 @@
  * half-word loads, and a bit of trivial maths.  Or would be, if I wrote it
  * in assembly; the compiler does a very poor job.
  *
+ * The maps and the counting itself live in detect.c, so that mvsweep can
+ * replay recorded vectors through exactly the same code.
+ *
  */
 
 #include "omxmotion.h"
 #include "motion.h"
-#include <png.h>
-#include <ncurses.h>
+#include "mvrec.h"
+#include "bus.h"
+#include "monitor.h"
+#include "prio.h"
+#include "log.h"
 
 static void *motionstart(void *);
-
-
-
-struct motvec {
-	int8_t			dx;
-	int8_t			dy;
-	uint16_t		sad;
-};
+static void rebuildactive(void);
 
 
 
@@ -60,72 +59,48 @@ static struct {
 	pthread_mutex_t		lock;
 	int			width, height;
 	uint16_t		*map;
+	uint8_t			*grid;
+	struct active		*active;
+	int			nactive;
+	struct coherence	*coh;
+	int			camagree;	/* 256ths; 0 for off */
+	int			doze;		/* 1 in doze frames when quiet */
+	int			wake;		/* Hits to stop dozing */
+	int			hold;		/* Quiet frames before dozing */
+	int			awake;		/* Left of hold */
+	unsigned int		skipped;	/* Since the last analysed */
 	struct motvec		*vectors;
+	int64_t			tick;
+	unsigned int		framenum;
 	int			threshold;
+	int			sens;		/* -1 if using a mapfile */
+	int			pendsens, pendthresh;
+	int			peak;		/* Under lock; see motionpeak() */
 	pthread_t		detectionthread;
+	pthread_cond_t		idle;
+	int			busy;		/* In lookformotion() */
 #define FLAGS_MOVEMENT		(1<<0)
 #define FLAGS_MOTMONITOR	(1<<1)
-	int			flags;
+#define FLAGS_MOTINDEX		(1<<2)
+#define FLAGS_FULLCOUNT		(1<<3)
+#define FLAGS_MOTHEAT		(1<<4)
+#define FLAGS_DOZING		(1<<6)
+#define FLAGS_MOTBUS		(1<<7)
+	int			flags;		/* Only the detector changes these */
 	void 			(*eventcb)(void *, enum movementevents);
 	void			*eventcbp;
-	char			*pngfn;
+	char			*vecfile;
+	struct motionstats	stats;
+	uint16_t		*acc;		/* Hits per block, this recording */
+	int			accumulating;	/* Under lock; the recorder sets it */
 } mctx;
 
 
 
-static int readmap(char *mf)
-{
-	FILE *fd;
-	uint8_t header[8];
-	png_structp png;
-	png_infop info, end;
-	png_bytep *rows;
-	int i, j;
-
-	fd = fopen(mf, "rb");
-	if (!fd)
-		return -1;
-	fread(header, 1, sizeof(header), fd);
-	if (png_sig_cmp(header, 0, sizeof(header)))
-		return -1;
-	png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (!png)
-		return -1;
-	info = png_create_info_struct(png);
-	if (!info)
-		return -1;
-	end = png_create_info_struct(png);
-	if (!end)
-		return -1;
-	png_init_io(png, fd);
-	png_set_sig_bytes(png, sizeof(header));
-	png_read_png(png, info, PNG_TRANSFORM_STRIP_16 |
-		PNG_TRANSFORM_STRIP_ALPHA | PNG_TRANSFORM_PACKING, NULL);
-	rows = png_get_rows(png, info);
-printf("Mapfile: \n");
-	for (i = 0; i < mctx.height; i++) {
-		uint8_t *r = rows[i];
-		for (j = 0; j < mctx.width-1; j++) {
-			mctx.map[i*(mctx.width) + j] =
-				(uint16_t) (r[j] * r[j]);
-printf("%d ", mctx.map[i*(mctx.width) + j]);
-		}
-		mctx.map[(i+1)*(mctx.width)] = 65535;
-printf("\n");
-	}
-	png_destroy_read_struct(&png, &info, &end);
-	fclose(fd);
-
-	return 0;
-}
-
-
-
 int initmotion(struct context *ctx, char *map, int sens, int thresh,
 	void(*eventcb)(void *, enum movementevents), void *cbp)
 {
 	int rows, cols;
-	int x, y;
 	pthread_attr_t detach;
 
 	memset(&mctx, 0, sizeof(mctx));
@@ -133,27 +108,58 @@ int initmotion(struct context *ctx, char *map, int sens, int thresh,
 	mctx.height = rows = (ctx->height + 15) / 16;
 	mctx.width = cols = ((ctx->width + 15) / 16) + 1;
 	mctx.map = (uint16_t *) malloc((sizeof(uint16_t)) * (cols+1)*rows);
+	mctx.grid = (uint8_t *) malloc(cols*rows);
+	mctx.active = malloc(cols * rows * sizeof(struct active));
 	mctx.threshold = thresh; //(rows * cols * thresh) / 100;
-	mctx.pngfn = ctx->dumppattern;
+	mctx.sens = map ? -1 : sens;
+	mctx.pendsens = mctx.pendthresh = -1;
+	mctx.vecfile = ctx->vecfile;
 	mctx.flags = (ctx->flags & FLAGS_MONITOR) ? FLAGS_MOTMONITOR : 0;
-
-	printf("PNG filename: %s\n", mctx.pngfn);
+	if (ctx->flags & FLAGS_INDEX)
+		mctx.flags |= FLAGS_MOTINDEX;
+	if (ctx->flags & FLAGS_HEAT) {
+		mctx.flags |= FLAGS_MOTHEAT;
+		mctx.acc = calloc(cols * rows, sizeof(uint16_t));
+	}
+/* Subscribers get the bounding box, so the grid has to be filled in: */
+	if (ctx->buspath)
+		mctx.flags |= FLAGS_MOTINDEX | FLAGS_MOTBUS;
+/* Anything recording the hit count or the grid needs every block counted: */
+	if ((mctx.flags & (FLAGS_MOTMONITOR | FLAGS_MOTINDEX | FLAGS_MOTHEAT)) ||
+		ctx->vecfile)
+		mctx.flags |= FLAGS_FULLCOUNT;
 	if (map) {
-		printf("Reading mapfile %s\n", map);
-		if (readmap(map) != 0) {
-			printf("Failed to read mapfile: %s\n",
+		logmsg(V_INFO, "Reading mapfile %s\n", map);
+		if (loadmap(mctx.map, cols, rows, map, 100) != 0) {
+			logmsg(V_ERROR, "Failed to read mapfile: %s\n",
 				strerror(errno));
 			return -1;
 		}
 	} else {
-		sens = sens * sens;
-		if (sens > 65535)
-			sens = 65535;
-		for (y = 0; y < rows; y++) {
-			for (x = 0; x < cols-1; x++) {
-				mctx.map[y*cols + x] = (uint16_t) sens;
-			}
-			mctx.map[y*cols + cols] = 65535;
+		flatmap(mctx.map, cols, rows, sens);
+	}
+	mctx.camagree = (ctx->camagree * 256) / 100;
+	rebuildactive();
+	if (ctx->cohwindow > 0)
+		mctx.coh = cohinit(cols, rows, ctx->cohwindow);
+	if (ctx->dozeframes > 1) {
+		mctx.doze = ctx->dozeframes;
+		mctx.wake = ctx->dozewake > 0 ? ctx->dozewake :
+			(thresh + 3) / 4;
+		mctx.hold = mctx.awake = ctx->framerate * 2;
+		logmsg(V_INFO, "Looking at 1 in %d vector frames when quiet, "
+			"waking at %d blocks; up to %dms extra latency\n",
+			mctx.doze, mctx.wake,
+			((mctx.doze - 1) * 1000) / ctx->framerate);
+	}
+
+	if (mctx.vecfile) {
+		logmsg(V_INFO, "Recording motion vectors to %s\n",
+			mctx.vecfile);
+		if (mvrecopen(mctx.vecfile, cols, rows, ctx->framerate) != 0) {
+			logmsg(V_ERROR, "Failed to open %s: %s\n", mctx.vecfile,
+				strerror(errno));
+			return -1;
 		}
 	}
 
@@ -162,106 +168,148 @@ int initmotion(struct context *ctx, char *map, int sens, int thresh,
 
 	pthread_mutex_init(&mctx.lock, NULL);
 	pthread_cond_init(&mctx.cond, NULL);
+	pthread_cond_init(&mctx.idle, NULL);
 	pthread_attr_init(&detach);
 	pthread_attr_setdetachstate(&detach, PTHREAD_CREATE_DETACHED);	
 	pthread_create(&mctx.detectionthread, &detach, motionstart, NULL);
 
-	if (mctx.flags & FLAGS_MOTMONITOR) {
-		initscr();
-		if (COLS < 121 || LINES < 69) {
-			endwin();
-			fprintf(stderr, "Please resize your terminal to 121x69 or greater.\n");
-			exit(1);
-		}
-	}
-
 	return 0;
 }
 
 
 
-void dumppng(struct motvec *v)
+static void rebuildactive(void)
 {
-	int i, j;
-	static int fnum = 0;
-	static png_bytep *rows;
-	FILE *fd;
-	png_structp png;
-	png_infop info;
-	static char fn[256];
-
-	if (fnum == 0) {
-		rows = malloc(mctx.height * sizeof(png_bytep));
-		for (i = 0; i < mctx.height; i++) {
-			rows[i] = (png_bytep) malloc(mctx.width);
-		}
-	}
+	mctx.nactive = activelist(mctx.map, mctx.width * mctx.height,
+		mctx.active, mctx.camagree != 0);
+	memset(mctx.grid, 0, mctx.width * mctx.height);
+}
+
+
 
-	for (i = 0; i < mctx.height; i++) {
-		for (j = 0; j < mctx.width; j++) {
-			uint8_t *t;
-			struct motvec *tv;
-			t = (uint8_t *) rows[i];
-			tv = &v[(i * mctx.width) + j];
-			t[j] = sqrt((double)
-				((tv->dx * tv->dx) + (tv->dy * tv->dy)));
+/*
+ * While nothing's being recorded and nothing has come near the threshold
+ * for hold frames, only every doze'th vector frame is looked at; any
+ * frame with wake or more hits, or a recording starting, goes back to
+ * every frame.  Motion can go unseen for at most doze - 1 frames.
+ */
+static void doze(int t)
+{
+	if (!mctx.doze)
+		return;
+
+	if (t >= mctx.wake || t >= mctx.threshold ||
+		ctx.sm.state != waiting) {
+		mctx.awake = mctx.hold;
+		if (mctx.flags & FLAGS_DOZING) {
+			pthread_mutex_lock(&mctx.lock);
+			mctx.flags &= ~FLAGS_DOZING;
+			pthread_mutex_unlock(&mctx.lock);
+			logmsg(V_DEBUG, "Waking at frame %u: %d hits\n",
+				mctx.framenum, t);
 		}
+	} else if (mctx.awake > 0) {
+		mctx.awake--;
+	} else if (!(mctx.flags & FLAGS_DOZING)) {
+		pthread_mutex_lock(&mctx.lock);
+		mctx.flags |= FLAGS_DOZING;
+		mctx.skipped = 0;
+		pthread_mutex_unlock(&mctx.lock);
+		logmsg(V_DEBUG, "Dozing at frame %u\n", mctx.framenum);
 	}
-
-	png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	info = png_create_info_struct(png);
-	sprintf(fn, mctx.pngfn, fnum);
-	fd = fopen(fn, "wb");
-	png_init_io(png, fd);
-	png_set_compression_level(png, 0);
-	png_set_IHDR(png, info, mctx.width-1, mctx.height, 8,
-		PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE,
-		PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-	png_set_rows(png, info, rows);
-	png_write_png(png, info, PNG_TRANSFORM_IDENTITY, NULL);
-	png_write_end(png, NULL);
-	png_destroy_write_struct(&png, &info);
-	fclose(fd);
-//	sprintf(fn, "vo/img%05d.raw", fnum);
-//	fd = fopen(fn, "wb");
-//	fwrite(v, mctx.width * mctx.height, sizeof(struct motvec), fd);
-//	fclose(fd);
-	fnum++;
 }
 
 
 
-static void lookformotion(struct motvec *v)
+static void lookformotion(struct motvec *v, int64_t tick)
 {
-	int i;
-	int n;
 	int t;
-	int d;
-	int d2;
-	char m[122*68+1];
-
-	n = (mctx.width) * mctx.height;
-
-	for (i = t = d = d2 = 0; i < n /* && t < mctx.threshold */; i++, d++, d2++) {
-		if (mctx.map[i] <
-			((v[i].dx * v[i].dx) + (v[i].dy * v[i].dy))) {
-			m[d2] = '*';
-			t++;
-		} else m[d2] = ' ';
-		if (d == mctx.width + 0) { m[d2] = '\n'; d = 0; }
+	int gx = 0, gy = 0, camera = 0;
+
+/* Take out any camera shake or pan first: */
+	if (mctx.camagree > 0)
+		camera = globalmotion(v, mctx.width, mctx.height, &gx, &gy) >=
+			mctx.camagree && (gx || gy);
+
+/*
+ * Only the blocks the map lets trigger are looked at, and unless someone
+ * wants the grid or the exact count, only until the outcome is certain.
+ */
+	if (mctx.coh) {
+		t = cohcount(mctx.coh, mctx.active, mctx.nactive, v, gx, gy,
+			(mctx.flags & FLAGS_FULLCOUNT) ? mctx.grid : NULL);
+	} else {
+		int need = mctx.flags & FLAGS_DOZING ? mctx.wake :
+			mctx.threshold;
+
+		t = countactive(mctx.active, mctx.nactive, v, gx, gy,
+			(mctx.flags & FLAGS_FULLCOUNT) ? mctx.grid : NULL,
+			need);
+/* Woken; now is it actually over the threshold? */
+		if (need < mctx.threshold && t >= need &&
+			!(mctx.flags & FLAGS_FULLCOUNT))
+			t = countactive(mctx.active, mctx.nactive, v, gx, gy,
+				NULL, mctx.threshold);
 	}
-	m[d2] = '\0';
-	if (mctx.flags & FLAGS_MOTMONITOR) {
-		mvprintw(0, 0, "%s\n%5d / %d (%d) (%c).", m, t, mctx.threshold,
-			n, (int) (mctx.flags & FLAGS_MOVEMENT ? '*' : ' '));
-		refresh();
+	doze(t);
+
+	pthread_mutex_lock(&mctx.lock);
+	mctx.stats.tick = tick;
+	mctx.stats.hits = t;
+	mctx.stats.threshold = mctx.threshold;
+	mctx.stats.moving = t >= mctx.threshold;
+	mctx.stats.gx = gx;
+	mctx.stats.gy = gy;
+	mctx.stats.camera = camera;
+	mctx.stats.dozing = !!(mctx.flags & FLAGS_DOZING);
+	if (mctx.flags & FLAGS_MOTINDEX)
+		gridbox(mctx.grid, mctx.width, mctx.height, mctx.stats.box);
+	if (mctx.accumulating)
+		accumulate(mctx.acc, mctx.active, mctx.nactive, mctx.grid);
+	if (t > mctx.peak)
+		mctx.peak = t;
+	pthread_mutex_unlock(&mctx.lock);
+
+	if (mctx.flags & FLAGS_MOTMONITOR)
+		monitorframe(mctx.grid, t, mctx.threshold,
+			t >= mctx.threshold);
+
+	if (mctx.vecfile) {
+		struct mvrframe f;
+
+		memset(&f, 0, sizeof(f));
+		f.framenum = mctx.framenum;
+		f.tick = tick;
+		f.hits = t;
+		f.threshold = mctx.threshold;
+		f.movement = t >= mctx.threshold;
+		f.recstate = ctx.sm.state;
+		f.flags = camera ? MVR_CAMERA : 0;
+		mvrecframe(&f, v);
 	}
 
-	if (mctx.pngfn)
-		dumppng(v);
+	if (mctx.flags & FLAGS_MOTBUS) {
+		struct busmsg m;
+
+/* Only we write stats.box, so there's no need for the lock: */
+		memset(&m, 0, sizeof(m));
+		m.framenum = mctx.framenum;
+		m.tick = tick;
+		m.hits = t;
+		m.threshold = mctx.threshold;
+		memcpy(m.box, mctx.stats.box, sizeof(m.box));
+		m.gx = gx;
+		m.gy = gy;
+		m.state = ctx.sm.state;
+		m.cols = mctx.width - 1;
+		m.rows = mctx.height;
+		m.flags = (t >= mctx.threshold ? BUS_MOVING : 0) |
+			(camera ? BUS_CAMERA : 0) |
+			(mctx.flags & FLAGS_DOZING ? BUS_DOZING : 0);
+		buspublish(&m);
+	}
+	mctx.framenum++;
 
-// printf("\r%5d / %d (%d).", t, mctx.threshold, n);
-fflush(stdout);
 	if (t >= mctx.threshold) {
 		if (mctx.flags & FLAGS_MOVEMENT) {
 			/* Do nothing */
@@ -283,14 +331,34 @@ fflush(stdout);
 static void *motionstart(void *args)
 {
 	struct motvec *tv;
+	int64_t tick;
 
+	schedthread(ROLE_DETECT);
 	while (1) {
 		pthread_mutex_lock(&mctx.lock);
+		mctx.busy = 0;
+		pthread_cond_broadcast(&mctx.idle);
 		pthread_cond_wait(&mctx.cond, &mctx.lock);
 		tv = mctx.vectors;
+		tick = mctx.tick;
 		mctx.vectors = NULL;
+		mctx.busy = tv != NULL;
+/* Parameter changes take effect between frames: */
+		if (mctx.pendsens != -1) {
+			flatmap(mctx.map, mctx.width, mctx.height,
+				mctx.pendsens);
+			mctx.sens = mctx.pendsens;
+			mctx.pendsens = -1;
+			rebuildactive();
+		}
+		if (mctx.pendthresh != -1) {
+			mctx.threshold = mctx.pendthresh;
+			mctx.pendthresh = -1;
+		}
 		pthread_mutex_unlock(&mctx.lock);
-		lookformotion(tv);
+		if (!tv)
+			continue;
+		lookformotion(tv, tick);
 		av_free(tv);
 	}
 
@@ -299,12 +367,171 @@ static void *motionstart(void *args)
 
 
 
-void findmotion(uint8_t *b)
+void findmotion(uint8_t *b, int64_t tick)
 {
 	pthread_mutex_lock(&mctx.lock);
+/* Dozing: don't even wake the detector for the ones it'd skip: */
+	if ((mctx.flags & FLAGS_DOZING) && ++mctx.skipped < mctx.doze) {
+		pthread_mutex_unlock(&mctx.lock);
+		av_free(b);
+		return;
+	}
+	mctx.skipped = 0;
 	if (mctx.vectors)
 		av_free(mctx.vectors);
 	mctx.vectors = (struct motvec *) b;
+	mctx.tick = tick;
 	pthread_cond_signal(&mctx.cond);
 	pthread_mutex_unlock(&mctx.lock);
 }
+
+
+
+/*
+ * The source has run out: let the detector finish with whatever it's been
+ * given, nudging it in case it was busy when the last one came, and close
+ * the -z recording, so the writer's queue and the index go out in full.
+ */
+void closemotion(void)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&mctx.lock);
+	while (mctx.busy || mctx.vectors) {
+		pthread_cond_signal(&mctx.cond);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&mctx.idle, &mctx.lock, &ts);
+	}
+	pthread_mutex_unlock(&mctx.lock);
+
+	if (mctx.vecfile)
+		mvrecclose();
+}
+
+
+
+/* Highest hit count seen since the last reset: */
+int motionpeak(int reset)
+{
+	int p;
+
+	pthread_mutex_lock(&mctx.lock);
+	p = mctx.peak;
+	if (reset)
+		mctx.peak = 0;
+	pthread_mutex_unlock(&mctx.lock);
+
+	return p;
+}
+
+
+
+int motionthreshold(void)
+{
+	return mctx.threshold;
+}
+
+
+
+/* The most recent frame's results: */
+void getmotionstats(struct motionstats *s)
+{
+	pthread_mutex_lock(&mctx.lock);
+	*s = mctx.stats;
+	pthread_mutex_unlock(&mctx.lock);
+}
+
+
+
+/*
+ * Change the flat-field sensitivity (replacing any mapfile) and/or the
+ * threshold; -1 leaves either alone.  Applied before the next frame.
+ */
+void setmotion(int sens, int thresh)
+{
+	pthread_mutex_lock(&mctx.lock);
+	if (sens >= 0)
+		mctx.pendsens = sens;
+	if (thresh >= 0)
+		mctx.pendthresh = thresh;
+	pthread_mutex_unlock(&mctx.lock);
+}
+
+
+
+int motionsensitivity(void)
+{
+	return mctx.sens;
+}
+
+
+
+/* Start counting where the motion is, for a new recording: */
+void motionaccum(void)
+{
+	if (!(mctx.flags & FLAGS_MOTHEAT))
+		return;
+
+	pthread_mutex_lock(&mctx.lock);
+	memset(mctx.acc, 0, mctx.width * mctx.height * sizeof(uint16_t));
+	mctx.accumulating = 1;
+	pthread_mutex_unlock(&mctx.lock);
+}
+
+
+
+/*
+ * Stop counting, and take a copy of the counts, for motionheat() to write
+ * out later; the next recording may have started counting by then.
+ */
+uint16_t *motionheatstop(void)
+{
+	uint16_t *acc;
+	int n = mctx.width * mctx.height;
+
+	if (!(mctx.flags & FLAGS_MOTHEAT))
+		return NULL;
+
+	acc = malloc(n * sizeof(uint16_t));
+	pthread_mutex_lock(&mctx.lock);
+	mctx.accumulating = 0;
+	if (acc)
+		memcpy(acc, mctx.acc, n * sizeof(uint16_t));
+	pthread_mutex_unlock(&mctx.lock);
+
+	return acc;
+}
+
+
+
+/*
+ * Write counts from motionheatstop() alongside the recording, as
+ * name.heat.png, and free them.  The detector isn't held up by the PNG
+ * encoder.
+ */
+int motionheat(const char *recording, uint16_t *acc)
+{
+	char fn[1024];
+	const char *dot;
+	int r;
+
+	if (!acc)
+		return -1;
+
+	dot = strrchr(recording, '.');
+	snprintf(fn, sizeof(fn), "%.*s.heat.png",
+		dot ? (int) (dot - recording) : (int) strlen(recording),
+		recording);
+	r = writeheat(fn, acc, mctx.width, mctx.height);
+	if (r != 0)
+		logmsg(V_ERROR, "Failed to write %s: %s\n", fn,
+			strerror(errno));
+	free(acc);
+
+	return r;
+}
@@ -17,6 +17,30 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#ifndef __MOTION_H
+#define __MOTION_H
+
+#include <stdint.h>
+
+struct context;
+
+struct motvec {
+	int8_t			dx;
+	int8_t			dy;
+	uint16_t		sad;
+};
+
+struct motionstats {
+	int64_t			tick;
+	int			hits;
+	int			threshold;
+	int			moving;
+	uint8_t			box[4];		/* See gridbox() */
+	int8_t			gx, gy;		/* Global vector, subtracted */
+	uint8_t			camera;		/* Nearly all blocks agree */
+	uint8_t			dozing;		/* Only looking at 1 in -D frames */
+};
+
 enum movementevents {
 	quiescent,
 	movement,
@@ -24,5 +48,16 @@ enum movementevents {
 
 int initmotion(struct context *, char *, int, int,
 	void(*)(void *, enum movementevents), void *);
-void findmotion(uint8_t *);
+void findmotion(uint8_t *, int64_t);
+void closemotion(void);
+int motionpeak(int reset);
+int motionthreshold(void);
+int motionsensitivity(void);
+void setmotion(int sens, int thresh);
+void getmotionstats(struct motionstats *);
+void motionaccum(void);
+uint16_t *motionheatstop(void);
+int motionheat(const char *recording, uint16_t *acc);
+
+#endif /* __MOTION_H */
 
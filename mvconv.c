@@ -0,0 +1,228 @@
+/* mvconv.c
+ *
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * Usage: ./mvconv [-f first] [-n count] [-x scale] <-l | -p pattern | -y file.y4m> file.mvr
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Offline renderer for omxmotion's -z motion vector recordings.  Each
+ * macroblock becomes a (scaled-up) pixel whose brightness is the
+ * magnitude of its vector, as the old -z PNG dump used to produce, but
+ * without the detection thread having to pay for it.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <png.h>
+#include "mvrec.h"
+
+extern char *optarg;
+extern int optind;
+
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-f first] [-n count] [-x scale]\n"
+		"\t<-l | -p pattern.png | -y file.y4m> file.mvr\n\n"
+		"Where:\n"
+	"\t-f first\tFirst vector frame to convert\n"
+	"\t-l\t\tList frame headers\n"
+	"\t-n count\tNumber of frames to convert\n"
+	"\t-p pattern\tWrite one PNG per frame (eg. 'vo/img%%05d.png')\n"
+	"\t-x scale\tPixels per macroblock (default 1)\n"
+	"\t-y file.y4m\tWrite a greyscale YUV4MPEG2 stream ('-' for stdout)\n"
+		"\n", name);
+	exit(1);
+}
+
+
+
+/* One row of magnitudes per macroblock row, minus the spare column: */
+static void render(struct mvrfile *m, struct motvec *v, uint8_t *img,
+	int scale)
+{
+	int x, y, i, j;
+	int w = (m->hdr.cols - 1) * scale;
+
+	for (y = 0; y < m->hdr.rows; y++) {
+		for (x = 0; x < m->hdr.cols - 1; x++) {
+			struct motvec *tv = &v[y * m->hdr.cols + x];
+			uint8_t mag = sqrt((double)
+				((tv->dx * tv->dx) + (tv->dy * tv->dy)));
+			for (i = 0; i < scale; i++)
+				for (j = 0; j < scale; j++)
+					img[(y*scale + i) * w + x*scale + j] =
+						mag;
+		}
+	}
+}
+
+
+
+static int writepng(const char *fn, uint8_t *img, int w, int h)
+{
+	FILE *fd;
+	png_structp png;
+	png_infop info;
+	png_bytep *rows;
+	int i;
+
+	fd = fopen(fn, "wb");
+	if (!fd)
+		return -1;
+	rows = malloc(h * sizeof(png_bytep));
+	for (i = 0; i < h; i++)
+		rows[i] = &img[i * w];
+
+	png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	info = png_create_info_struct(png);
+	png_init_io(png, fd);
+	png_set_IHDR(png, info, w, h, 8,
+		PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE,
+		PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_set_rows(png, info, rows);
+	png_write_png(png, info, PNG_TRANSFORM_IDENTITY, NULL);
+	png_destroy_write_struct(&png, &info);
+	fclose(fd);
+	free(rows);
+
+	return 0;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	struct mvrfile		*m;
+	struct mvrframe		f;
+	struct motvec		*v;
+	uint8_t			*img, *chroma;
+	int			opt;
+	int			list = 0;
+	char			*pattern = NULL, *y4m = NULL;
+	unsigned int		first = 0;
+	int			count = -1;
+	int			scale = 1;
+	int			w, h, n;
+	FILE			*yfd = NULL;
+	char			fn[1024];
+
+	while ((opt = getopt(argc, argv, "f:hln:p:x:y:")) != -1) {
+		switch (opt) {
+		case 'f':
+			first = atoi(optarg);
+			break;
+		case 'l':
+			list = 1;
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'p':
+			pattern = optarg;
+			break;
+		case 'x':
+			scale = atoi(optarg);
+			if (scale < 1)
+				scale = 1;
+			break;
+		case 'y':
+			y4m = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1 || (!list && !pattern && !y4m))
+		usage(argv[0]);
+
+	m = mvropen(argv[optind]);
+	if (!m) {
+		fprintf(stderr, "Failed to open %s: %s\n", argv[optind],
+			strerror(errno));
+		exit(1);
+	}
+	if (first && mvrseek(m, first) != 0) {
+		fprintf(stderr, "No frame %d in %s\n", first, argv[optind]);
+		exit(1);
+	}
+
+	w = (m->hdr.cols - 1) * scale;
+	h = m->hdr.rows * scale;
+	v = malloc(m->hdr.cols * m->hdr.rows * sizeof(struct motvec));
+	img = malloc(w * h);
+	chroma = malloc((w/2) * (h/2));
+	memset(chroma, 128, (w/2) * (h/2));
+
+	if (y4m) {
+		yfd = strcmp(y4m, "-") == 0 ? stdout : fopen(y4m, "wb");
+		if (!yfd) {
+			fprintf(stderr, "Failed to open %s: %s\n", y4m,
+				strerror(errno));
+			exit(1);
+		}
+		fprintf(yfd, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+			w & ~1, h & ~1, m->hdr.framerate ? m->hdr.framerate : 25);
+	}
+
+	for (n = 0; count < 0 || n < count; n++) {
+		if (mvrnext(m, &f, v) != 0)
+			break;
+
+		if (list)
+			printf("%8u %14lld %5d / %5d %c%c %d\n", f.framenum,
+				(long long) f.tick, f.hits, f.threshold,
+				f.movement ? '*' : ' ',
+				f.flags & MVR_CAMERA ? 'C' : ' ', f.recstate);
+		if (!pattern && !yfd)
+			continue;
+
+		render(m, v, img, scale);
+		if (pattern) {
+			snprintf(fn, sizeof(fn), pattern, f.framenum);
+			if (writepng(fn, img, w, h) != 0)
+				fprintf(stderr, "Failed to write %s: %s\n", fn,
+					strerror(errno));
+		}
+		if (yfd) {
+			int i;
+
+			fprintf(yfd, "FRAME\n");
+			for (i = 0; i < (h & ~1); i++)
+				fwrite(&img[i * w], 1, w & ~1, yfd);
+			fwrite(chroma, 1, (w/2) * (h/2), yfd);
+			fwrite(chroma, 1, (w/2) * (h/2), yfd);
+		}
+	}
+
+	if (yfd && yfd != stdout)
+		fclose(yfd);
+	mvrclose(m);
+	free(v);
+	free(img);
+	free(chroma);
+
+	return 0;
+}
@@ -0,0 +1,359 @@
+/* mvrec.c */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Motion vector recorder.
+ *
+ * The detection thread mustn't wait on the SD card, so it copies each
+ * vector frame into one of MVR_SLOTS preallocated records and carries
+ * on; a writer thread appends them to the file.  If the writer falls
+ * behind far enough to fill every slot, frames are dropped and counted
+ * rather than stalling detection.  See mvrec.h for the file format.
+ *
+ * This file doesn't depend on OpenMAX, so the offline tools can link it
+ * for the reader half.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "mvrec.h"
+
+#define MVR_SLOTS	(64)
+
+static void *mvrecwriter(void *);
+
+
+
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	pthread_t		writer;
+	FILE			*fd;
+	FILE			*ifd;
+	uint8_t			*slots;
+	size_t			recsize;
+	int			nvecs;
+	unsigned int		head, tail;
+	unsigned int		dropped;
+	uint64_t		offset;
+	int			running;
+	int			failed;		/* A write failed; stopped */
+} rctx;
+
+
+
+static void indexname(char *out, size_t len, const char *fn)
+{
+	size_t l = strlen(fn);
+
+	if (l > 4 && strcmp(&fn[l-4], ".mvr") == 0)
+		snprintf(out, len, "%.*s.mvi", (int) (l-4), fn);
+	else
+		snprintf(out, len, "%s.mvi", fn);
+}
+
+
+
+int mvrecopen(const char *fn, int cols, int rows, int framerate)
+{
+	struct mvrheader	hdr;
+	char			ifn[1024];
+
+	memset(&rctx, 0, sizeof(rctx));
+	rctx.nvecs = cols * rows;
+	rctx.recsize = sizeof(struct mvrframe) +
+		rctx.nvecs * sizeof(struct motvec);
+
+	rctx.fd = fopen(fn, "wb");
+	if (!rctx.fd)
+		return -1;
+	indexname(ifn, sizeof(ifn), fn);
+	rctx.ifd = fopen(ifn, "wb");
+	if (!rctx.ifd) {
+		fclose(rctx.fd);
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MVR_MAGIC, sizeof(hdr.magic));
+	hdr.hdrsize = sizeof(hdr);
+	hdr.framesize = sizeof(struct mvrframe);
+	hdr.cols = cols;
+	hdr.rows = rows;
+	hdr.framerate = framerate;
+	hdr.created = time(NULL);
+	fwrite(&hdr, sizeof(hdr), 1, rctx.fd);
+	rctx.offset = sizeof(hdr);
+
+	rctx.slots = malloc(MVR_SLOTS * rctx.recsize);
+	if (!rctx.slots) {
+		fclose(rctx.fd);
+		fclose(rctx.ifd);
+		return -1;
+	}
+
+	pthread_mutex_init(&rctx.lock, NULL);
+	pthread_cond_init(&rctx.cond, NULL);
+	rctx.running = 1;
+	pthread_create(&rctx.writer, NULL, mvrecwriter, NULL);
+
+	return 0;
+}
+
+
+
+/*
+ * Called from the detection thread.  Never blocks for longer than it
+ * takes to copy the grid.
+ */
+void mvrecframe(const struct mvrframe *f, const struct motvec *v)
+{
+	uint8_t *slot;
+
+	if (!rctx.running)
+		return;
+
+	pthread_mutex_lock(&rctx.lock);
+	if (rctx.failed || rctx.head - rctx.tail >= MVR_SLOTS) {
+		rctx.dropped++;
+		pthread_mutex_unlock(&rctx.lock);
+		return;
+	}
+	pthread_mutex_unlock(&rctx.lock);
+
+/* Only we advance head, and the writer doesn't touch slots past it: */
+	slot = &rctx.slots[(rctx.head % MVR_SLOTS) * rctx.recsize];
+	memcpy(slot, f, sizeof(*f));
+	((struct mvrframe *) slot)->sync = MVR_SYNC;
+	memcpy(&slot[sizeof(*f)], v, rctx.nvecs * sizeof(struct motvec));
+
+	pthread_mutex_lock(&rctx.lock);
+	rctx.head++;
+	pthread_cond_signal(&rctx.cond);
+	pthread_mutex_unlock(&rctx.lock);
+}
+
+
+
+static void *mvrecwriter(void *args)
+{
+	unsigned int		n, i, tail;
+	struct mvrindex		idx;
+
+	memset(&idx, 0, sizeof(idx));
+
+	while (1) {
+		pthread_mutex_lock(&rctx.lock);
+		while (rctx.head == rctx.tail && rctx.running)
+			pthread_cond_wait(&rctx.cond, &rctx.lock);
+		n = rctx.head - rctx.tail;
+		tail = rctx.tail;
+		pthread_mutex_unlock(&rctx.lock);
+
+		if (n == 0)
+			break;
+
+		for (i = 0; i < n; i++) {
+			uint8_t *slot;
+			struct mvrframe *f;
+
+			slot = &rctx.slots[((tail+i) % MVR_SLOTS) * rctx.recsize];
+			f = (struct mvrframe *) slot;
+			if (fwrite(slot, rctx.recsize, 1, rctx.fd) != 1)
+				break;
+			idx.framenum = f->framenum;
+			idx.tick = f->tick;
+			idx.offset = rctx.offset;
+			if (fwrite(&idx, sizeof(idx), 1, rctx.ifd) != 1)
+				break;
+			rctx.offset += rctx.recsize;
+		}
+
+/*
+ * Out of space, most likely.  offset no longer matches the file, so
+ * anything more would be indexed wrongly; stop, and count the rest as
+ * dropped.  Nothing in the index points past the last whole frame.
+ */
+		pthread_mutex_lock(&rctx.lock);
+		if (i < n) {
+			rctx.failed = 1;
+			rctx.dropped += n - i;
+		}
+		rctx.tail += n;
+		pthread_mutex_unlock(&rctx.lock);
+	}
+
+	return NULL;
+}
+
+
+
+void mvrecstats(int *queued, unsigned int *dropped)
+{
+	pthread_mutex_lock(&rctx.lock);
+	if (queued)
+		*queued = rctx.head - rctx.tail;
+	if (dropped)
+		*dropped = rctx.dropped;
+	pthread_mutex_unlock(&rctx.lock);
+}
+
+
+
+void mvrecclose(void)
+{
+	if (!rctx.running)
+		return;
+
+	pthread_mutex_lock(&rctx.lock);
+	rctx.running = 0;
+	pthread_cond_signal(&rctx.cond);
+	pthread_mutex_unlock(&rctx.lock);
+	pthread_join(rctx.writer, NULL);
+
+	fclose(rctx.fd);
+	fclose(rctx.ifd);
+	free(rctx.slots);
+	rctx.slots = NULL;
+}
+
+
+
+/* Reader: */
+
+static int rebuildindex(struct mvrfile *m)
+{
+	struct mvrframe		f;
+	uint64_t		off;
+	unsigned int		alloc = 0;
+
+	off = m->hdr.hdrsize;
+	while (1) {
+		if (fseeko(m->fd, off, SEEK_SET) != 0)
+			break;
+		if (fread(&f, sizeof(f), 1, m->fd) != 1 || f.sync != MVR_SYNC)
+			break;
+		if (m->nindex == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			m->index = realloc(m->index, alloc * sizeof(*m->index));
+		}
+		m->index[m->nindex].framenum = f.framenum;
+		m->index[m->nindex].reserved = 0;
+		m->index[m->nindex].tick = f.tick;
+		m->index[m->nindex].offset = off;
+		m->nindex++;
+		off += m->recsize;
+	}
+
+	return 0;
+}
+
+
+
+struct mvrfile *mvropen(const char *fn)
+{
+	struct mvrfile		*m;
+	char			ifn[1024];
+	FILE			*ifd;
+	long			l;
+
+	m = calloc(1, sizeof(*m));
+	m->fd = fopen(fn, "rb");
+	if (!m->fd) {
+		free(m);
+		return NULL;
+	}
+	if (fread(&m->hdr, sizeof(m->hdr), 1, m->fd) != 1 ||
+		memcmp(m->hdr.magic, MVR_MAGIC, sizeof(m->hdr.magic)) != 0 ||
+		m->hdr.framesize != sizeof(struct mvrframe)) {
+		fclose(m->fd);
+		free(m);
+		errno = EINVAL;
+		return NULL;
+	}
+	m->recsize = m->hdr.framesize +
+		m->hdr.cols * m->hdr.rows * sizeof(struct motvec);
+
+	indexname(ifn, sizeof(ifn), fn);
+	ifd = fopen(ifn, "rb");
+	if (ifd) {
+		fseek(ifd, 0, SEEK_END);
+		l = ftell(ifd);
+		fseek(ifd, 0, SEEK_SET);
+		m->nindex = l / sizeof(struct mvrindex);
+		m->index = malloc(m->nindex * sizeof(struct mvrindex) + 1);
+		m->nindex = fread(m->index, sizeof(struct mvrindex),
+			m->nindex, ifd);
+		fclose(ifd);
+	} else {
+/* The index is a convenience; we can do without: */
+		rebuildindex(m);
+	}
+
+	fseeko(m->fd, m->hdr.hdrsize, SEEK_SET);
+
+	return m;
+}
+
+
+
+/* Position on the first record at or after framenum: */
+int mvrseek(struct mvrfile *m, unsigned int framenum)
+{
+	unsigned int lo = 0, hi = m->nindex;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (m->index[mid].framenum < framenum)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == m->nindex)
+		return -1;
+
+	return fseeko(m->fd, m->index[lo].offset, SEEK_SET);
+}
+
+
+
+int mvrnext(struct mvrfile *m, struct mvrframe *f, struct motvec *v)
+{
+	if (fread(f, sizeof(*f), 1, m->fd) != 1)
+		return -1;
+	if (f->sync != MVR_SYNC)
+		return -1;
+	if (fread(v, sizeof(struct motvec), m->hdr.cols * m->hdr.rows,
+		m->fd) != m->hdr.cols * m->hdr.rows)
+		return -1;
+
+	return 0;
+}
+
+
+
+void mvrclose(struct mvrfile *m)
+{
+	fclose(m->fd);
+	free(m->index);
+	free(m);
+}
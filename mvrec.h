@@ -0,0 +1,92 @@
+/* mvrec.h */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __MVREC_H
+#define __MVREC_H
+
+/*
+ * Motion vector recordings.
+ *
+ * A .mvr file is a struct mvrheader, followed by one record per vector
+ * frame: a struct mvrframe and then cols * rows struct motvecs, exactly
+ * as the encoder handed them to us (including the spare column).  Every
+ * record is the same size.  Alongside it, name.mvi holds one struct
+ * mvrindex per record, so a reader can find a given frame or tick with
+ * a binary search rather than reading through the whole file.
+ *
+ * Everything is in host byte order; in practice, little-endian.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include "motion.h"
+
+#define MVR_MAGIC	"MVR1"
+#define MVR_SYNC	(0x5246564d)	/* 'MVFR' */
+
+struct mvrheader {
+	char		magic[4];
+	uint16_t	hdrsize;
+	uint16_t	framesize;	/* sizeof(struct mvrframe) */
+	uint16_t	cols, rows;	/* cols includes the spare column */
+	uint16_t	framerate;
+	uint16_t	reserved;
+	int64_t		created;	/* time(NULL) at open */
+};
+
+struct mvrframe {
+	uint32_t	sync;
+	uint32_t	framenum;	/* Vector frame count since start */
+	int64_t		tick;		/* OMX timestamp, us */
+	uint16_t	hits;
+	uint16_t	threshold;
+	uint8_t		movement;	/* Detector's verdict on this frame */
+	uint8_t		recstate;	/* enum recstate at the time */
+	uint16_t	flags;
+#define MVR_CAMERA	(1<<0)		/* Camera motion; see globalmotion() */
+};
+
+struct mvrindex {
+	uint32_t	framenum;
+	uint32_t	reserved;
+	int64_t		tick;
+	uint64_t	offset;
+};
+
+/* Writer; used by the detector: */
+int mvrecopen(const char *fn, int cols, int rows, int framerate);
+void mvrecframe(const struct mvrframe *, const struct motvec *);
+void mvrecstats(int *queued, unsigned int *dropped);
+void mvrecclose(void);
+
+/* Reader; used by the offline tools: */
+struct mvrfile {
+	FILE		*fd;
+	struct mvrheader hdr;
+	struct mvrindex	*index;
+	unsigned int	nindex;
+	size_t		recsize;
+};
+
+struct mvrfile *mvropen(const char *fn);
+int mvrseek(struct mvrfile *, unsigned int framenum);
+int mvrnext(struct mvrfile *, struct mvrframe *, struct motvec *);
+void mvrclose(struct mvrfile *);
+
+#endif /* __MVREC_H */
@@ -0,0 +1,705 @@
+/* mvsweep.c
+ *
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * Usage: see usage()
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Offline parameter sweep.
+ *
+ * Replays -z motion vector recordings through the same counting and
+ * recording state machine omxmotion uses (see detect.c), for every
+ * combination of sensitivity (or heatmap scale), coherence window (-C),
+ * threshold, debounce, outro and doze factor (-D) asked for, optionally
+ * less the global vector (-G), and reports how many recordings each would
+ * have made, how long they'd have been, and how well they agree with a
+ * list of hand-labelled events.
+ *
+ * It works in two passes.  Counting is the expensive bit, and only
+ * depends on the map, coherence window and -G, so the first pass reads
+ * every vector frame exactly once and counts it against every map and
+ * window, in parallel across chunks of frames.  Coherence depends on the
+ * frames before, so each chunk starts early enough for it to have
+ * settled; it can differ from a straight run by a little rounding.  That
+ * leaves a couple of bytes per frame per map and window, and the second
+ * pass runs dozing and the state machine over those for every threshold,
+ * debounce, outro and doze factor, in parallel across combinations.
+ *
+ * Two things differ from omxmotion with -C and -D together: frames dozed
+ * through here still went into the coherence sums.  And a recording made
+ * with -D is missing the frames omxmotion skipped, so it can't say what
+ * would have happened without; we warn about those.
+ *
+ * The encoder doesn't record which frames were I-frames in the vector
+ * stream, so they're assumed to fall every -k frames (IFRAMEAFTER by
+ * default), which is how omxmotion configures it.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <libgen.h>
+#include "detect.h"
+#include "mvrec.h"
+
+extern char *optarg;
+extern int optind;
+
+#define CHUNK		(4096)	/* Vector frames per counting work unit */
+
+
+
+struct label {
+	unsigned int		first, last;	/* Inclusive */
+};
+
+struct input {
+	char			*fn;
+	unsigned int		nrecs;
+	uint32_t		*framenum;
+	uint16_t		*hits;		/* [variant][record] */
+	struct label		*labels;
+	int			nlabels;
+	uint64_t		labelled;	/* Frames */
+};
+
+struct result {
+	int			map, coh, thresh, debounce, outro, doze;
+	unsigned int		triggers;
+	uint64_t		recframes;
+	uint64_t		tpframes;
+	unsigned int		evhit;
+	double			precision, recall, f1;
+};
+
+
+
+static struct {
+	int			cols, rows;
+	int			framerate;
+	int			keyint;
+	struct input		*inputs;
+	int			ninputs;
+	uint16_t		**maps;
+	struct active		**active;
+	int			*nactive;
+	int			*mapparam;
+	int			nmaps;
+	int			heatmap;
+	int			*coh, ncoh;
+	int			nvariants;	/* Maps times windows */
+	unsigned int		warmup;		/* Frames, for coherence */
+	int			global;
+	int			*thresh, nthresh;
+	int			*debounce, ndebounce;
+	int			*outro, noutro;
+	int			*doze, ndoze;
+	unsigned int		(*units)[2];
+	unsigned int		nunits;
+	volatile unsigned int	next;
+	struct result		*results;
+	unsigned int		nresults;
+	int			nlabels;
+	uint64_t		labelled;
+} sw;
+
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-s list | -m heatmap.png -x list] "
+		"[-C list] [-G]\n"
+		"\t[-t list] [-d list] [-o list] [-D list] "
+		"[-l labels] [-j threads] [-k keyint]\n"
+		"\t[-S] [-N top] file.mvr ...\n\n"
+		"Where:\n"
+	"\t-C list\t\tCoherence windows (frames; default 0, off)\n"
+	"\t-d list\t\tDebounce values (frames)\n"
+	"\t-D list\t\tDoze factors, waking at a quarter of the threshold "
+		"(default 1, off)\n"
+	"\t-G\t\tSubtract the global vector, as -G does\n"
+	"\t-j threads\tWorker threads (default: one per core)\n"
+	"\t-k keyint\tI-frame interval to assume (default %d)\n"
+	"\t-l labels\tLabelled events: lines of 'file.mvr first last'\n"
+	"\t-m heatmap.png\tHeatmap image\n"
+	"\t-N top\t\tOnly print the best N combinations\n"
+	"\t-o list\t\tOutro values (frames; default 2s)\n"
+	"\t-s list\t\tMacroblock sensitivities (default 40)\n"
+	"\t-S\t\tSort by agreement with the labels\n"
+	"\t-t list\t\tThresholds (default 20)\n"
+	"\t-x list\t\tHeatmap scale factors, in percent (default 100)\n"
+	"\nLists are comma-separated values or first:last:step ranges, "
+	"eg. '10,20,40:100:20'.\n"
+		"\n", name, IFRAMEAFTER);
+	exit(1);
+}
+
+
+
+static int parselist(const char *s, int **out)
+{
+	int n = 0, alloc = 16;
+	char *copy, *tok, *save;
+
+	*out = malloc(alloc * sizeof(int));
+	copy = strdup(s);
+	for (tok = strtok_r(copy, ",", &save); tok;
+		tok = strtok_r(NULL, ",", &save)) {
+		int first, last, step = 1, v;
+		int c = sscanf(tok, "%d:%d:%d", &first, &last, &step);
+
+		if (c < 1) {
+			fprintf(stderr, "Can't parse list '%s'\n", s);
+			exit(1);
+		}
+		if (c == 1)
+			last = first;
+		if (step < 1)
+			step = 1;
+		for (v = first; v <= last; v += step) {
+			if (n == alloc) {
+				alloc *= 2;
+				*out = realloc(*out, alloc * sizeof(int));
+			}
+			(*out)[n++] = v;
+		}
+	}
+	free(copy);
+
+	return n;
+}
+
+
+
+static void readlabels(const char *fn)
+{
+	FILE *fd;
+	char line[1024], name[1024];
+	unsigned int first, last;
+	int i;
+
+	fd = fopen(fn, "r");
+	if (!fd) {
+		fprintf(stderr, "Failed to open %s: %s\n", fn, strerror(errno));
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), fd)) {
+		if (line[0] == '#' ||
+			sscanf(line, "%1023s %u %u", name, &first, &last) != 3)
+			continue;
+		for (i = 0; i < sw.ninputs; i++) {
+			struct input *in = &sw.inputs[i];
+			char *a = strdup(in->fn), *b = strdup(name);
+			int match = strcmp(basename(a), basename(b)) == 0;
+
+			free(a);
+			free(b);
+			if (!match)
+				continue;
+			in->labels = realloc(in->labels,
+				(in->nlabels + 1) * sizeof(struct label));
+			in->labels[in->nlabels].first = first;
+			in->labels[in->nlabels].last = last;
+			in->nlabels++;
+			in->labelled += last - first + 1;
+			sw.nlabels++;
+			sw.labelled += last - first + 1;
+			break;
+		}
+		if (i == sw.ninputs)
+			fprintf(stderr, "Label for unknown file %s ignored\n",
+				name);
+	}
+	fclose(fd);
+}
+
+
+
+/* Pass one: count every frame against every map and window. */
+static void *countworker(void *args)
+{
+	struct mvrfile		*m = NULL;
+	struct mvrframe		f;
+	struct motvec		*v;
+	struct coherence	**coh;
+	uint8_t			*grid;
+	int			cur = -1;
+	unsigned int		u, r, first, last;
+	int			k, c, gx = 0, gy = 0;
+	int			n = sw.cols * sw.rows;
+
+	v = malloc(n * sizeof(struct motvec));
+	grid = calloc(n, 1);
+	coh = calloc(sw.nvariants, sizeof(struct coherence *));
+	for (k = 0; k < sw.nmaps; k++)
+		for (c = 0; c < sw.ncoh; c++)
+			if (sw.coh[c] > 0)
+				coh[k * sw.ncoh + c] = cohinit(sw.cols, sw.rows,
+					sw.coh[c]);
+
+	while ((u = __sync_fetch_and_add(&sw.next, 1)) < sw.nunits) {
+		struct input *in = &sw.inputs[sw.units[u][0]];
+
+		if (cur != sw.units[u][0]) {
+			if (m)
+				mvrclose(m);
+			cur = sw.units[u][0];
+			m = mvropen(in->fn);
+			if (!m) {
+				fprintf(stderr, "Failed to reopen %s\n", in->fn);
+				exit(1);
+			}
+		}
+		first = sw.units[u][1];
+		last = first + CHUNK > in->nrecs ? in->nrecs : first + CHUNK;
+		r = first > sw.warmup ? first - sw.warmup : 0;
+		for (k = 0; k < sw.nvariants; k++)
+			if (coh[k])
+				cohreset(coh[k]);
+		fseeko(m->fd, m->index[r].offset, SEEK_SET);
+		for (; r < last; r++) {
+			if (mvrnext(m, &f, v) != 0) {
+				memset(v, 0, n * sizeof(struct motvec));
+			}
+			if (sw.global)
+				globalmotion(v, sw.cols, sw.rows, &gx, &gy);
+			for (k = 0; k < sw.nvariants; k++) {
+				struct active *a = sw.active[k / sw.ncoh];
+				int na = sw.nactive[k / sw.ncoh];
+				int t;
+
+				if (coh[k])
+					t = cohcount(coh[k], a, na, v, gx, gy,
+						NULL);
+				else if (r >= first)
+					t = countactive(a, na, v, gx, gy, grid,
+						0);
+				else
+					continue;
+				if (r >= first)
+					in->hits[k * in->nrecs + r] = t;
+			}
+		}
+	}
+
+	if (m)
+		mvrclose(m);
+	for (k = 0; k < sw.nvariants; k++)
+		free(coh[k]);
+	free(coh);
+	free(grid);
+	free(v);
+
+	return NULL;
+}
+
+
+
+static void score(struct input *in, struct result *res, unsigned int a,
+	unsigned int b, char *hit)
+{
+	int i;
+
+	res->recframes += b - a;
+	for (i = 0; i < in->nlabels; i++) {
+		unsigned int lo = in->labels[i].first;
+		unsigned int hi = in->labels[i].last + 1;
+
+		if (lo < a)
+			lo = a;
+		if (hi > b)
+			hi = b;
+		if (lo < hi) {
+			res->tpframes += hi - lo;
+			hit[i] = 1;
+		}
+	}
+}
+
+
+
+/*
+ * Pass two: replay the hit counts through dozing and the state machine,
+ * as findmotion(), lookformotion() and checkstate() would have.
+ */
+static void simulate(struct result *res, char *hit)
+{
+	int i, k;
+	unsigned int r;
+	int wake = (res->thresh + 3) / 4;
+	int hold = sw.framerate * 2;
+
+	for (i = 0; i < sw.ninputs; i++) {
+		struct input *in = &sw.inputs[i];
+		uint16_t *hits = &in->hits[(res->map * sw.ncoh + res->coh) *
+			in->nrecs];
+		struct recsm sm;
+		int moving = 0;
+		int dozing = 0, skipped = 0, awake = hold;
+		unsigned int start = 0, fn = 0;
+
+		sminit(&sm, res->debounce, res->outro);
+		memset(hit, 0, in->nlabels);
+
+		for (r = 0; r < in->nrecs; r++) {
+			int t = hits[r];
+
+			fn = in->framenum[r];
+/* Frames dozed through aren't looked at, but still reach checkstate(): */
+			if (!dozing || ++skipped >= res->doze) {
+				skipped = 0;
+				if (res->doze <= 1) {
+					/* Not dozing at all */
+				} else if (t >= wake || t >= res->thresh ||
+					sm.state != waiting) {
+					awake = hold;
+					dozing = 0;
+				} else if (awake > 0) {
+					awake--;
+				} else {
+					dozing = 1;
+				}
+				if ((t >= res->thresh) != moving) {
+					moving = t >= res->thresh;
+					smevent(&sm, moving ? movement :
+						quiescent, fn);
+				}
+			}
+			switch (smframe(&sm, fn + 1, (fn % sw.keyint) == 0)) {
+			case SM_START: {
+/* The recorder starts from the I-frame before last: */
+				unsigned int last = (fn / sw.keyint) * sw.keyint;
+				start = last >= sw.keyint ? last - sw.keyint : 0;
+				res->triggers++;
+			}
+				break;
+			case SM_STOP:
+				score(in, res, start, fn + 1, hit);
+				break;
+			}
+		}
+		if (sm.state == recording || sm.state == stopping)
+			score(in, res, start, fn + 1, hit);
+
+		for (k = 0; k < in->nlabels; k++)
+			res->evhit += hit[k];
+	}
+
+	res->precision = res->recframes ?
+		(double) res->tpframes / res->recframes : 0;
+	res->recall = sw.labelled ? (double) res->tpframes / sw.labelled : 0;
+	res->f1 = (res->precision + res->recall) > 0 ?
+		2 * res->precision * res->recall /
+			(res->precision + res->recall) : 0;
+}
+
+
+
+static void *sweepworker(void *args)
+{
+	unsigned int c;
+	char *hit;
+	int maxlabels = 1, i;
+
+	for (i = 0; i < sw.ninputs; i++)
+		if (sw.inputs[i].nlabels > maxlabels)
+			maxlabels = sw.inputs[i].nlabels;
+	hit = malloc(maxlabels);
+
+	while ((c = __sync_fetch_and_add(&sw.next, 1)) < sw.nresults) {
+		struct result *res = &sw.results[c];
+		unsigned int x = c;
+
+		memset(res, 0, sizeof(*res));
+		res->doze = sw.doze[x % sw.ndoze];
+		x /= sw.ndoze;
+		res->outro = sw.outro[x % sw.noutro];
+		x /= sw.noutro;
+		res->debounce = sw.debounce[x % sw.ndebounce];
+		x /= sw.ndebounce;
+		res->thresh = sw.thresh[x % sw.nthresh];
+		x /= sw.nthresh;
+		res->coh = x % sw.ncoh;
+		x /= sw.ncoh;
+		res->map = x;
+		simulate(res, hit);
+	}
+	free(hit);
+
+	return NULL;
+}
+
+
+
+static void runthreads(void *(*fn)(void *), int nthreads)
+{
+	pthread_t *t;
+	int i;
+
+	t = malloc(nthreads * sizeof(pthread_t));
+	sw.next = 0;
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&t[i], NULL, fn, NULL);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(t[i], NULL);
+	free(t);
+}
+
+
+
+static int byf1(const void *a, const void *b)
+{
+	const struct result *ra = a, *rb = b;
+
+	if (ra->f1 != rb->f1)
+		return ra->f1 < rb->f1 ? 1 : -1;
+	return (ra->recframes > rb->recframes) - (ra->recframes < rb->recframes);
+}
+
+
+
+static double elapsed(struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) +
+		(now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	int			opt;
+	int			i, k;
+	int			nthreads;
+	char			*mapfile = NULL;
+	char			*labels = NULL;
+	char			*sens = "40", *scale = "100", *thresh = "20";
+	char			*debounce = NULL, *outro = NULL;
+	char			*window = "0", *doze = "1";
+	char			buf[32];
+	int			sort = 0;
+	int			top = -1;
+	uint64_t		frames = 0;
+	struct timespec		t0;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	sw.keyint = IFRAMEAFTER;
+
+	while ((opt = getopt(argc, argv, "C:d:D:Ghj:k:l:m:N:o:s:St:x:")) != -1) {
+		switch (opt) {
+		case 'C':
+			window = optarg;
+			break;
+		case 'd':
+			debounce = optarg;
+			break;
+		case 'D':
+			doze = optarg;
+			break;
+		case 'G':
+			sw.global = 1;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'k':
+			sw.keyint = atoi(optarg);
+			break;
+		case 'l':
+			labels = optarg;
+			break;
+		case 'm':
+			mapfile = optarg;
+			break;
+		case 'N':
+			top = atoi(optarg);
+			break;
+		case 'o':
+			outro = optarg;
+			break;
+		case 's':
+			sens = optarg;
+			break;
+		case 'S':
+			sort = 1;
+			break;
+		case 't':
+			thresh = optarg;
+			break;
+		case 'x':
+			scale = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind >= argc || sw.keyint < 1)
+		usage(argv[0]);
+	if (nthreads < 1)
+		nthreads = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+/* Work out what we've got: */
+	sw.ninputs = argc - optind;
+	sw.inputs = calloc(sw.ninputs, sizeof(struct input));
+	for (i = 0; i < sw.ninputs; i++) {
+		struct input *in = &sw.inputs[i];
+		struct mvrfile *m;
+		unsigned int r, gaps;
+
+		in->fn = argv[optind + i];
+		m = mvropen(in->fn);
+		if (!m) {
+			fprintf(stderr, "Failed to open %s: %s\n", in->fn,
+				strerror(errno));
+			exit(1);
+		}
+		if (i == 0) {
+			sw.cols = m->hdr.cols;
+			sw.rows = m->hdr.rows;
+			sw.framerate = m->hdr.framerate ? m->hdr.framerate : 25;
+		} else if (m->hdr.cols != sw.cols || m->hdr.rows != sw.rows) {
+			fprintf(stderr, "%s is %dx%d; expected %dx%d\n", in->fn,
+				m->hdr.cols, m->hdr.rows, sw.cols, sw.rows);
+			exit(1);
+		}
+		in->nrecs = m->nindex;
+		in->framenum = malloc(in->nrecs * sizeof(uint32_t) + 1);
+		for (r = 0; r < in->nrecs; r++)
+			in->framenum[r] = m->index[r].framenum;
+/* -D leaves out whole frames, which shows in the ticks: */
+		for (r = 1, gaps = 0; r < in->nrecs; r++)
+			if ((m->index[r].tick - m->index[r-1].tick) * sw.framerate >
+				1500000)
+				gaps++;
+		if (gaps > in->nrecs / 100)
+			fprintf(stderr, "%s is missing %u frames; was it "
+				"recorded with -D?\n", in->fn, gaps);
+		for (r = 0; r < in->nrecs; r += CHUNK) {
+			sw.units = realloc(sw.units,
+				(sw.nunits + 1) * sizeof(*sw.units));
+			sw.units[sw.nunits][0] = i;
+			sw.units[sw.nunits][1] = r;
+			sw.nunits++;
+		}
+		frames += in->nrecs;
+		mvrclose(m);
+	}
+
+	if (labels)
+		readlabels(labels);
+
+/* Build the maps: */
+	sw.heatmap = mapfile != NULL;
+	sw.nmaps = parselist(sw.heatmap ? scale : sens, &sw.mapparam);
+	sw.maps = malloc(sw.nmaps * sizeof(uint16_t *));
+	for (k = 0; k < sw.nmaps; k++) {
+		sw.maps[k] = malloc(sw.cols * sw.rows * sizeof(uint16_t));
+		if (!sw.heatmap) {
+			flatmap(sw.maps[k], sw.cols, sw.rows, sw.mapparam[k]);
+		} else if (loadmap(sw.maps[k], sw.cols, sw.rows, mapfile,
+			sw.mapparam[k]) != 0) {
+			fprintf(stderr, "Failed to read mapfile %s\n", mapfile);
+			exit(1);
+		}
+	}
+	sw.active = malloc(sw.nmaps * sizeof(struct active *));
+	sw.nactive = malloc(sw.nmaps * sizeof(int));
+	for (k = 0; k < sw.nmaps; k++) {
+		sw.active[k] = malloc(sw.cols * sw.rows * sizeof(struct active));
+		sw.nactive[k] = activelist(sw.maps[k], sw.cols * sw.rows,
+			sw.active[k], sw.global);
+	}
+
+/* Long enough for the coherence sums to forget where they started: */
+	sw.ncoh = parselist(window, &sw.coh);
+	for (k = 0; k < sw.ncoh; k++) {
+		int shift;
+
+		if (sw.coh[k] <= 0)
+			continue;
+		for (shift = 1; (1 << shift) < sw.coh[k] && shift < 8; shift++)
+			;
+		if (sw.warmup < (16 << shift))
+			sw.warmup = 16 << shift;
+	}
+	sw.nvariants = sw.nmaps * sw.ncoh;
+	for (i = 0; i < sw.ninputs; i++)
+		sw.inputs[i].hits = malloc(sw.nvariants * sw.inputs[i].nrecs *
+			sizeof(uint16_t) + 1);
+
+	sw.nthresh = parselist(thresh, &sw.thresh);
+	if (!debounce) {
+		snprintf(buf, sizeof(buf), "%d", DEBOUNCE);
+		debounce = buf;
+	}
+	sw.ndebounce = parselist(debounce, &sw.debounce);
+	if (!outro) {
+		snprintf(&buf[16], sizeof(buf)-16, "%d", sw.framerate * 2);
+		outro = &buf[16];
+	}
+	sw.noutro = parselist(outro, &sw.outro);
+	sw.ndoze = parselist(doze, &sw.doze);
+	if (!sw.nthresh || !sw.ndebounce || !sw.noutro || !sw.nmaps ||
+		!sw.ncoh || !sw.ndoze)
+		usage(argv[0]);
+
+	runthreads(countworker, nthreads);
+	fprintf(stderr, "Counted %llu frames against %d maps and %d windows "
+		"in %.2fs (%.0f frames/s)\n", (unsigned long long) frames,
+		sw.nmaps, sw.ncoh, elapsed(&t0), frames / elapsed(&t0));
+
+	sw.nresults = sw.nvariants * sw.nthresh * sw.ndebounce * sw.noutro *
+		sw.ndoze;
+	sw.results = malloc(sw.nresults * sizeof(struct result));
+	runthreads(sweepworker, nthreads);
+	fprintf(stderr, "Evaluated %u combinations in %.2fs total\n",
+		sw.nresults, elapsed(&t0));
+
+	if (sort)
+		qsort(sw.results, sw.nresults, sizeof(struct result), byf1);
+	if (top < 0 || top > sw.nresults)
+		top = sw.nresults;
+
+	printf("# %-7s %6s %6s %8s %6s %4s %8s %10s %7s %9s %7s %6s\n",
+		sw.heatmap ? "scale%" : "sens", "window", "thresh", "debounce",
+		"outro", "doze", "triggers", "seconds", "events", "precision",
+		"recall", "f1");
+	for (i = 0; i < top; i++) {
+		struct result *res = &sw.results[i];
+
+		printf("  %-7d %6d %6d %8d %6d %4d %8u %10.1f %3u/%-3d %9.3f "
+			"%7.3f %6.3f\n", sw.mapparam[res->map],
+			sw.coh[res->coh], res->thresh, res->debounce,
+			res->outro, res->doze, res->triggers,
+			(double) res->recframes / sw.framerate, res->evhit,
+			sw.nlabels, res->precision, res->recall, res->f1);
+	}
+
+	return 0;
+}
@@ -0,0 +1,191 @@
+/* nal.c */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Annex B NAL splitting; see nal.h.
+ *
+ * The encoder hands us whole NALs, but not necessarily one per buffer,
+ * and start codes may be three bytes or four.  Finding them is the only
+ * part of this that touches every byte, so it's done a word (or, with
+ * NEON, sixteen bytes) at a time: a start code contains two consecutive
+ * zero bytes, so any block without a zero byte in it can be skipped
+ * without looking further.  Slice data is emulation-prevented, so zero
+ * bytes are rare and nearly everything is skipped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nal.h"
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+
+
+/* Does this word contain a zero byte? */
+#define ONES		((unsigned long) -1 / 0xff)
+#define HASZERO(v)	(((v) - ONES) & ~(v) & (ONES << 7))
+
+
+
+/*
+ * Returns a pointer to the first 00 00 01 at or after p, or end if there
+ * isn't one.  A four-byte start code is found as the 00 00 01 inside it.
+ */
+const uint8_t *nalstart(const uint8_t *p, const uint8_t *end)
+{
+	unsigned long v;
+
+	while (p + 3 <= end) {
+#ifdef __ARM_NEON__
+		if (p + 16 <= end) {
+			uint8x16_t z = vceqq_u8(vld1q_u8(p), vdupq_n_u8(0));
+			uint8x8_t o = vorr_u8(vget_low_u8(z), vget_high_u8(z));
+			if (vget_lane_u64(vreinterpret_u64_u8(o), 0) == 0) {
+				p += 16;
+				continue;
+			}
+		}
+#endif
+		if (p + sizeof(v) <= end) {
+			memcpy(&v, p, sizeof(v));	/* May be unaligned */
+			if (!HASZERO(v)) {
+				p += sizeof(v);
+				continue;
+			}
+		}
+
+/* There's a zero byte nearby; look properly: */
+		if (p[2] > 1)
+			p += 3;
+		else if (p[1])
+			p += 2;
+		else if (p[0] || p[2] != 1)
+			p++;
+		else
+			return p;
+	}
+
+	return end;
+}
+
+
+
+/*
+ * Split buf into NALs.  Anything before the first start code is ignored.
+ * Returns the number found, up to max; *types has a bit set for each NAL
+ * type seen.
+ */
+int nalsplit(uint8_t *buf, int len, struct nal *nals, int max, int *types)
+{
+	const uint8_t *end = buf + len;
+	const uint8_t *p, *next;
+	int n = 0;
+
+	*types = 0;
+	p = nalstart(buf, end);
+	while (p < end && n < max) {
+		struct nal *u = &nals[n];
+
+		u->p = (uint8_t *) p;
+		u->sclen = 3;
+		if (p > buf && p[-1] == 0) {
+			u->p--;
+			u->sclen = 4;
+		}
+/* If we're out of room, the last one gets the rest: */
+		next = n == max - 1 ? end : nalstart(p + 3, end);
+		u->type = p + 3 < end ? p[3] & 0x1f : 0;
+/* Trailing zeroes belong to the next start code, or are padding: */
+		u->len = next - u->p;
+		while (u->len > u->sclen && u->p[u->len - 1] == 0)
+			u->len--;
+		*types |= NALBIT(u->type);
+		n++;
+		p = next;
+	}
+
+	return n;
+}
+
+
+
+static int store(uint8_t **dst, int *dstlen, const struct nal *u)
+{
+	if (*dstlen == u->len && memcmp(*dst, u->p, u->len) == 0)
+		return 0;
+	free(*dst);
+	*dst = malloc(u->len);
+	memcpy(*dst, u->p, u->len);
+	*dstlen = u->len;
+
+	return 1;
+}
+
+
+
+/*
+ * Remember any SPS or PPS in nals.  The encoder repeats them unchanged,
+ * so this is normally just a memcmp().  Returns NAL_PARAMS bits for the
+ * ones which changed.
+ */
+int nalparams(struct nalparams *np, const struct nal *nals, int n)
+{
+	int i, changed = 0;
+
+	for (i = 0; i < n; i++) {
+		if (nals[i].type == NAL_SPS &&
+			store(&np->sps, &np->spslen, &nals[i]))
+			changed |= NALBIT(NAL_SPS);
+		else if (nals[i].type == NAL_PPS &&
+			store(&np->pps, &np->ppslen, &nals[i]))
+			changed |= NALBIT(NAL_PPS);
+	}
+	if (changed)
+		np->changes++;
+
+	return changed;
+}
+
+
+
+/*
+ * Remove NALs whose type bits are in types from buf, in place; nals and
+ * *n are updated to match.  Returns the new length of buf.
+ */
+int nalstrip(uint8_t *buf, struct nal *nals, int *n, int types)
+{
+	uint8_t *w = buf;
+	int i, j = 0;
+
+	for (i = 0; i < *n; i++) {
+		if (types & NALBIT(nals[i].type))
+			continue;
+		memmove(w, nals[i].p, nals[i].len);
+		nals[j] = nals[i];
+		nals[j].p = w;
+		w += nals[i].len;
+		j++;
+	}
+	*n = j;
+
+	return w - buf;
+}
@@ -0,0 +1,69 @@
+/* nal.h */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __NAL_H
+#define __NAL_H
+
+/*
+ * H.264 Annex B parsing: finding start codes, splitting a buffer into NAL
+ * units, and keeping track of the parameter sets.  Like detect.c, nothing
+ * in here knows about OpenMAX or the global context, so nalbench runs the
+ * same code as omxmotion.
+ */
+
+#include <stdint.h>
+
+#define NAL_SLICE	(1)
+#define NAL_IDR		(5)
+#define NAL_SEI		(6)
+#define NAL_SPS		(7)
+#define NAL_PPS		(8)
+#define NAL_AUD		(9)
+
+#define NALBIT(t)	(1<<(t))
+#define NAL_VCL		(NALBIT(1) | NALBIT(2) | NALBIT(3) | NALBIT(4) | \
+			NALBIT(NAL_IDR))
+#define NAL_PARAMS	(NALBIT(NAL_SPS) | NALBIT(NAL_PPS))
+
+#define MAXNALS		(32)
+
+
+struct nal {
+	uint8_t		*p;		/* Start code onwards */
+	int		len;		/* Including the start code */
+	uint8_t		sclen;		/* 3 or 4 */
+	uint8_t		type;
+};
+
+/* The current SPS and PPS, start codes and all: */
+struct nalparams {
+	uint8_t		*sps;
+	int		spslen;
+	uint8_t		*pps;
+	int		ppslen;
+	unsigned int	changes;
+};
+
+
+const uint8_t *nalstart(const uint8_t *p, const uint8_t *end);
+int nalsplit(uint8_t *buf, int len, struct nal *nals, int max, int *types);
+int nalparams(struct nalparams *, const struct nal *nals, int n);
+int nalstrip(uint8_t *buf, struct nal *nals, int *n, int types);
+
+#endif /* __NAL_H */
@@ -0,0 +1,166 @@
+/* nalbench.c
+ *
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * Usage: ./nalbench [-n passes] file.h264
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Times nal.c's start code search against the obvious byte-at-a-time
+ * loop, over a raw Annex B H.264 file, and checks they agree.  Get one
+ * from a recording with something like:
+ *
+ *   ffmpeg -i 2015-05-10T12:00:00.mkv -c copy -f h264 clip.h264
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "nal.h"
+
+extern char *optarg;
+extern int optind;
+
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-n passes] file.h264\n\n"
+		"Where:\n"
+	"\t-n passes\tTimes round the file (default 20)\n"
+		"\n", name);
+	exit(1);
+}
+
+
+
+static const uint8_t *refstart(const uint8_t *p, const uint8_t *end)
+{
+	for (; p + 3 <= end; p++)
+		if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+			return p;
+
+	return end;
+}
+
+
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+
+/* Count the start codes in buf, and the NAL types after them: */
+static unsigned int scan(const uint8_t *(*find)(const uint8_t *,
+	const uint8_t *), const uint8_t *buf, long len, unsigned int *types)
+{
+	const uint8_t *end = buf + len;
+	const uint8_t *p;
+	unsigned int n = 0;
+
+	for (p = find(buf, end); p < end; p = find(p + 3, end)) {
+		if (types && p + 3 < end)
+			types[p[3] & 0x1f]++;
+		n++;
+	}
+
+	return n;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	FILE		*fd;
+	uint8_t		*buf;
+	long		len;
+	int		opt, i;
+	int		passes = 20;
+	unsigned int	types[32], reftypes[32];
+	unsigned int	n, refn = 0;
+	double		t, reft, fast;
+
+	while ((opt = getopt(argc, argv, "hn:")) != -1) {
+		switch (opt) {
+		case 'n':
+			passes = atoi(optarg);
+			if (passes < 1)
+				passes = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	fd = fopen(argv[optind], "rb");
+	if (!fd) {
+		fprintf(stderr, "Failed to open %s: %s\n", argv[optind],
+			strerror(errno));
+		exit(1);
+	}
+	fseek(fd, 0, SEEK_END);
+	len = ftell(fd);
+	fseek(fd, 0, SEEK_SET);
+	buf = malloc(len);
+	if (!buf || fread(buf, 1, len, fd) != len) {
+		fprintf(stderr, "Failed to read %s\n", argv[optind]);
+		exit(1);
+	}
+	fclose(fd);
+
+	memset(types, 0, sizeof(types));
+	memset(reftypes, 0, sizeof(reftypes));
+	n = scan(nalstart, buf, len, types);
+	refn = scan(refstart, buf, len, reftypes);
+	if (n != refn || memcmp(types, reftypes, sizeof(types)) != 0) {
+		fprintf(stderr, "Mismatch: %u NALs found, expected %u\n",
+			n, refn);
+		exit(1);
+	}
+
+	t = now();
+	for (i = 0; i < passes; i++)
+		refn = scan(refstart, buf, len, NULL);
+	reft = now() - t;
+	t = now();
+	for (i = 0; i < passes; i++)
+		n = scan(nalstart, buf, len, NULL);
+	fast = now() - t;
+
+	printf("%ld bytes, %u NALs:", len, n);
+	for (i = 0; i < 32; i++)
+		if (types[i])
+			printf(" %d:%u", i, types[i]);
+	printf("\n");
+	printf("bytewise  %8.1f MB/s\n", len * passes / reft / 1e6);
+	printf("nalstart  %8.1f MB/s\n", len * passes / fast / 1e6);
+
+	free(buf);
+
+	return 0;
+}
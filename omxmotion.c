@@ -38,6 +38,22 @@
 
 #include "omxmotion.h"
 #include "motion.h"
+#include "monitor.h"
+#include "hook.h"
+#include "snapshot.h"
+#include "actindex.h"
+#include "ratectl.h"
+#include "ctl.h"
+#include "nal.h"
+#include "prio.h"
+#include "journal.h"
+#include "swsource.h"
+#include "shmring.h"
+#include "httpd.h"
+#include "log.h"
+#include "recio.h"
+#include "timebase.h"
+#include "bus.h"
 #include <unistd.h>
 #include <signal.h>
 
@@ -62,12 +78,12 @@ static OMX_VERSIONTYPE SpecificationVersion = {
 				OMX_ERRORTYPE oerr = cmd;		\
 				ctx.waiting = 0; \
 				if (oerr != OMX_ErrorNone) {		\
-					fprintf(stderr, #cmd		\
+					logmsg(V_ERROR, #cmd		\
 						" failed on line %d: %x\n", \
 						__LINE__, oerr);	\
 					exit(1);			\
 				} else {				\
-					fprintf(stderr, #cmd		\
+					logmsg(V_DEBUG, #cmd		\
 						" completed at %d.\n",	\
 						__LINE__);		\
 				}					\
@@ -77,7 +93,7 @@ static OMX_VERSIONTYPE SpecificationVersion = {
 				pthread_mutex_lock(&ctx.lock);		\
 				ctx.waiting = 0; \
 				OERR(cmd);				\
-				printf("Waiting: %d\n", ctx.waiting);	\
+				logmsg(V_DEBUG, "Waiting: %d\n", ctx.waiting);\
 				if (ctx.waiting) {			\
 					ctx.waiting = 1;		\
 					pthread_cond_wait(&ctx.cond, &ctx.lock);\
@@ -88,7 +104,7 @@ static OMX_VERSIONTYPE SpecificationVersion = {
 
 #define OERRq(cmd)	do {	oerr = cmd;				\
 				if (oerr != OMX_ErrorNone) {		\
-					fprintf(stderr, #cmd		\
+					logmsg(V_ERROR, #cmd		\
 						" failed: %x\n", oerr);	\
 					exit(1);			\
 				}					\
@@ -97,18 +113,6 @@ static OMX_VERSIONTYPE SpecificationVersion = {
 #define WAIT usleep(500000)
 /* ... but damn useful.*/
 
-#define V_ALWAYS	0
-#define V_INFO		1
-#define V_LOTS		2
-
-/* Not vprintf(); there's already one of those in libc... */
-#define logprintf(v, ...) \
-    do { \
-        if ((v) <= ctx.verbosity) { \
-            printf( __VA_ARGS__); \
-        } \
-    } while (0)
-
 
 /* Hardware component names: */
 #define CLKNAME "OMX.broadcom.clock"
@@ -125,6 +129,11 @@ static OMX_VERSIONTYPE SpecificationVersion = {
 #define PORT_ENC 200
 #define PORT_NUL 240
 
+/* Space reserved for a recording, a chunk at a time; see recio.c: */
+#define RECRESERVE	(60)		/* Seconds at the -b bitrate */
+#define RECAVIOBUF	(65536)
+#define RINGSLACK	(INMEMFRAMES / 4)	/* Frames; see ringclamp() */
+
 
 
 struct packetentry {
@@ -153,10 +162,10 @@ static void dumpport(OMX_HANDLETYPE handle, int port)
 	portdef->nPortIndex = port;
 	OERR(OMX_GetParameter(handle, OMX_IndexParamPortDefinition, portdef));
 
-	printf("Port %d is %s, %s\n", portdef->nPortIndex,
+	logmsg(V_INFO, "Port %d is %s, %s\n", portdef->nPortIndex,
 		(portdef->eDir == 0 ? "input" : "output"),
 		(portdef->bEnabled == 0 ? "disabled" : "enabled"));
-	printf("Wants %d bufs, needs %d, size %d, enabled: %d, pop: %d, "
+	logmsg(V_INFO, "Wants %d bufs, needs %d, size %d, enabled: %d, pop: %d, "
 		"aligned %d, domain %d\n", portdef->nBufferCountActual,
 		portdef->nBufferCountMin, portdef->nBufferSize,
 		portdef->bEnabled, portdef->bPopulated,
@@ -165,7 +174,7 @@ static void dumpport(OMX_HANDLETYPE handle, int port)
 
 	switch (portdef->eDomain) {
 	case OMX_PortDomainVideo:
-		printf("Video type is currently:\n"
+		logmsg(V_INFO, "Video type is currently:\n"
 			"\tMIME:\t\t%s\n"
 			"\tNative:\t\t%p\n"
 			"\tWidth:\t\t%d\n"
@@ -187,7 +196,7 @@ static void dumpport(OMX_HANDLETYPE handle, int port)
 			viddef->eCompressionFormat, viddef->eColorFormat);
 		break;
 	case OMX_PortDomainImage:
-		printf("Image type is currently:\n"
+		logmsg(V_INFO, "Image type is currently:\n"
 			"\tMIME:\t\t%s\n"
 			"\tNative:\t\t%p\n"
 			"\tWidth:\t\t%d\n"
@@ -270,14 +279,56 @@ static void writeframe(AVFormatContext *oc, struct frame *f, int index)
 	if (r != 0) {
 		char err[256];
 		av_strerror(r, err, sizeof(err));
-		fprintf(stderr, "Failed to write frame %d (%x.%x): %s\n", ctx.framenum, f->tick.nHighPart, f->tick.nLowPart, err);
+		logmsg(V_ERROR, "Failed to write frame %d (%x.%x): %s\n", ctx.framenum, f->tick.nHighPart, f->tick.nLowPart, err);
 	}
 //	av_write_frame(oc, NULL);
 }
 
 
 
-static AVFormatContext *openoutput(char *url, int *index)
+/* Recordings go through recio.c rather than avio's own file protocol: */
+static int recwrite(void *opaque, uint8_t *buf, int len)
+{
+	return riowrite(opaque, buf, len);
+}
+
+
+
+static int64_t recseek(void *opaque, int64_t offset, int whence)
+{
+	if (whence & AVSEEK_SIZE)
+		return riosize(opaque);
+
+	return rioseek(opaque, offset, whence & ~AVSEEK_FORCE);
+}
+
+
+
+static int openrecio(AVFormatContext *oc, const char *url)
+{
+	struct recio	*rio;
+	uint8_t		*buf;
+
+	rio = rioopen(url, (int64_t) ctx.bitrate / 8 * RECRESERVE,
+		ctx.flags & FLAGS_DIRECT ? RIO_DIRECT : 0);
+	if (!rio)
+		return AVERROR(errno);
+	buf = av_malloc(RECAVIOBUF);
+	oc->pb = avio_alloc_context(buf, RECAVIOBUF, 1, rio, NULL, recwrite,
+		recseek);
+	oc->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+	return 0;
+}
+
+
+
+/*
+ * Everything that doesn't depend on the frames being recorded: the format,
+ * the context and stream, and the file itself.  This is the slow part, so
+ * the recorder thread does it in advance.
+ */
+static AVFormatContext *prepareoutput(const char *url, int *index)
 {
 	int			r;
 	AVFormatContext		*oc;
@@ -289,13 +340,6 @@ static AVFormatContext *openoutput(char *url, int *index)
 	AVCodecContext		*cc;
 	AVRational		omxtimebase = { 1, 1000000 };
 	AVRational		framerate;
-	struct frame		*f;
-
-//	ctx.fd = open(err, O_CREAT|O_LARGEFILE|O_RDWR, 0666);
-	if (ctx.fd != -1) {
-		write(ctx.fd, ctx.sps, ctx.spslen);
-		write(ctx.fd, ctx.pps, ctx.ppslen);
-	}
 
 //	fmt = av_guess_format("matroska", err, "video/x-matroska");
 //	fmt = av_guess_format("mp4", err, "video/mp4");
@@ -308,14 +352,14 @@ static AVFormatContext *openoutput(char *url, int *index)
 	}
 
 	if (!fmt) {
-		fprintf(stderr, "Failed.  Bye bye.\n");
+		logmsg(V_ERROR, "Failed.  Bye bye.\n");
 		exit(1);
 	}
 
 	r = avformat_alloc_output_context2(&oc, fmt, NULL, url);
 	if (r != 0) {
 		av_strerror(r, err, sizeof(err));
-		fprintf(stderr, "Failed to alloc outputcontext: %s\n", err);
+		logmsg(V_ERROR, "Failed to alloc outputcontext: %s\n", err);
 		exit(1);
 	}
 	oc->oformat = fmt;
@@ -323,7 +367,6 @@ static AVFormatContext *openoutput(char *url, int *index)
 	oc->debug = 1;
 	oc->duration = 0;
 	oc->start_time = 0;
-	oc->start_time_realtime = time(NULL) * 1000000;
 	oc->bit_rate = ctx.bitrate;
 
 	c = avcodec_find_encoder(AV_CODEC_ID_H264);
@@ -349,24 +392,10 @@ static AVFormatContext *openoutput(char *url, int *index)
 	st->time_base = omxtimebase;
 	*index = st->index;
 
-	if (ctx.spslen + ctx.ppslen > 0) {
-		if (cc->extradata) {
-			av_free(cc->extradata);
-		}
-		cc->extradata_size = ctx.spslen + ctx.ppslen;
-		cc->extradata = av_malloc(ctx.spslen + ctx.ppslen);
-		memcpy(cc->extradata, ctx.sps, ctx.spslen);
-		memcpy(&cc->extradata[ctx.spslen], ctx.pps, ctx.ppslen);
-	}
-
 	framerate.num = ctx.framerate;
 	framerate.den = 1;
 	st->avg_frame_rate = framerate;
 	st->r_frame_rate = framerate;
-	f = &ctx.frames[ctx.previframe & (INMEMFRAMES-1)];
-	st->start_time = av_rescale_q(((((uint64_t) f->tick.nHighPart)<<32) | 
-		f->tick.nLowPart), omxtimebase, st->time_base);
-	oc->start_time = st->start_time;
 	for (i = 0; i < oc->nb_streams; i++) {
 		if (oc->oformat->flags & AVFMT_GLOBALHEADER)
 			oc->streams[i]->codec->flags
@@ -379,21 +408,133 @@ static AVFormatContext *openoutput(char *url, int *index)
 	if (r != 0) {
 		av_strerror(r, err, sizeof(err));
 
-		if (!(ctx.flags & FLAGS_MONITOR))
-			printf("Failed to open codec: %d (%p, %p): %s\n",
-				r, cc, c, err);
+		logmsg(V_WARN, "Failed to open codec: %d (%p, %p): %s\n",
+			r, cc, c, err);
 	}
 		
 /* At some point they changed the API: */
 #ifndef URL_WRONLY
 #define URL_WRONLY AVIO_FLAG_WRITE
 #endif
-	avio_open(&oc->pb, url, URL_WRONLY);
+	if (strstr(url, "://"))
+		r = avio_open(&oc->pb, url, URL_WRONLY);
+	else
+		r = openrecio(oc, url);
+	if (r < 0) {
+		av_strerror(r, err, sizeof(err));
+		logmsg(V_ERROR, "Failed to open %s: %s\n", url, err);
+		avformat_free_context(oc);
+		return NULL;
+	}
+
+	return oc;
+}
+
+
+
+/*
+ * The rest, which needs the SPS and PPS and the first frame's timestamp,
+ * and is cheap: the header only goes into the AVIO buffer.
+ */
+static int beginoutput(AVFormatContext *oc, const char *url, int index,
+	unsigned int first)
+{
+	int			r;
+	char			err[256];
+	AVStream		*st;
+	AVCodecContext		*cc;
+	AVRational		omxtimebase = { 1, 1000000 };
+	struct frame		*f;
+	struct tm		tm;
+	time_t			t;
+	char			created[32];
+
+	strcpy(oc->filename, url);
+	st = oc->streams[index];
+	cc = st->codec;
+
+//	ctx.fd = open(err, O_CREAT|O_LARGEFILE|O_RDWR, 0666);
+	if (ctx.fd != -1) {
+		write(ctx.fd, ctx.params.sps, ctx.params.spslen);
+		write(ctx.fd, ctx.params.pps, ctx.params.ppslen);
+	}
+
+	pthread_mutex_lock(&ctx.lock);
+	if (ctx.params.spslen + ctx.params.ppslen > 0) {
+		if (cc->extradata) {
+			av_free(cc->extradata);
+		}
+		cc->extradata_size = ctx.params.spslen + ctx.params.ppslen;
+		cc->extradata = av_malloc(cc->extradata_size);
+		memcpy(cc->extradata, ctx.params.sps, ctx.params.spslen);
+		memcpy(&cc->extradata[ctx.params.spslen], ctx.params.pps,
+			ctx.params.ppslen);
+	}
+	pthread_mutex_unlock(&ctx.lock);
+
+	f = &ctx.frames[first & (INMEMFRAMES-1)];
+	oc->start_time_realtime = f->walltime;
+/*
+ * The name is the trigger time, which is after the pre-roll starts; the
+ * first frame's time goes in the header, where clip can find it:
+ */
+	t = f->walltime / 1000000;
+	gmtime_r(&t, &tm);
+	strftime(created, sizeof(created), "%Y-%m-%dT%H:%M:%S", &tm);
+	snprintf(&created[19], sizeof(created) - 19, ".%06dZ",
+		(int) (f->walltime % 1000000));
+	av_dict_set(&oc->metadata, "creation_time", created, 0);
+	st->start_time = av_rescale_q(((((uint64_t) f->tick.nHighPart)<<32) | 
+		f->tick.nLowPart), omxtimebase, st->time_base);
+	oc->start_time = st->start_time;
 
 	r = avformat_write_header(oc, NULL);
 	if (r < 0) {
 		av_strerror(r, err, sizeof(err));
-		fprintf(stderr, "Failed to write header: %s\n", err);
+		logmsg(V_ERROR, "Failed to write header: %s\n", err);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+
+static void closeoutput(AVFormatContext *oc, int index)
+{
+	struct riostats rs;
+
+	avcodec_close(oc->streams[index]->codec);
+	if (oc->flags & AVFMT_FLAG_CUSTOM_IO) {
+		avio_flush(oc->pb);
+		if (rioclose(oc->pb->opaque, &rs) != 0)
+			logmsg(V_ERROR, "Failed to write %s: %s\n",
+				oc->filename, strerror(errno));
+		else if (rs.bytes)
+			logmsg(V_INFO, "Wrote %llu bytes in %u writes%s "
+				"and %u patches; write time 50%% < %uus, "
+				"99%% < %uus, max %uus\n",
+				(unsigned long long) rs.bytes, rs.writes,
+				rs.direct ? " (direct)" : "", rs.patches,
+				rs.p50, rs.p99, rs.max);
+		av_free(oc->pb->buffer);
+		av_free(oc->pb);
+	} else {
+		avio_close(oc->pb);
+	}
+	avformat_free_context(oc);
+}
+
+
+
+static AVFormatContext *openoutput(char *url, int *index)
+{
+	AVFormatContext		*oc;
+
+	if ((oc = prepareoutput(url, index)) == NULL)
+		return NULL;
+	if (beginoutput(oc, url, *index, ctx.previframe) != 0) {
+		closeoutput(oc, *index);
 		return NULL;
 	}
 	if (!(ctx.flags & FLAGS_MONITOR))
@@ -409,35 +550,9 @@ static void motioncallback(void *context, enum movementevents state)
 	context = context;	/* Shush */
 	pthread_mutex_lock(&ctx.lock);
 //	printf("\nmotioncallback(%d) called at frame %d\n", state, ctx.framenum);
-	ctx.lastevent = ctx.framenum;
-	if (state == quiescent) {
-		switch (ctx.recstate) {
-		case waiting:
-			break;
-		case triggered:
-			ctx.recstate = waiting;
-			break;
-		case recording:
-			ctx.recstate = stopping;
-			break;
-		case stopping:
-			break;
-		}
-	} else if (state == movement) {
-		switch (ctx.recstate) {
-		case waiting:
-			ctx.recstate = triggered;
-			break;
-		case triggered:
-			break;
-		case recording:
-			break;
-		case stopping:
-			ctx.recstate = recording;
-			break;
-		}
-	}
+	smevent(&ctx.sm, state, ctx.framenum);
 	pthread_mutex_unlock(&ctx.lock);
+	ratemotion(state);
 }
 
 
@@ -449,10 +564,7 @@ OMX_ERRORTYPE genericeventhandler(OMX_HANDLETYPE component,
 				OMX_U32 data2,
 				OMX_PTR eventdata)
 {
-	if (ctx->flags & FLAGS_VERBOSE) {
-		printf("Event %d on %p\n", event, component);
-		fflush(stdout);
-	}
+	logmsg(V_DEBUG, "Event %d on %p\n", event, component);
 
 	if (ctx->waiting) {
 		pthread_mutex_lock(&ctx->lock);
@@ -462,30 +574,24 @@ OMX_ERRORTYPE genericeventhandler(OMX_HANDLETYPE component,
 
 	switch (event) {
 	case OMX_EventError:
-		if (ctx->flags & FLAGS_VERBOSE)
-			printf("%s %p has errored: %x\n",
-				mapcomponent(ctx, component),
-				component, data1);
+		logmsg(V_DEBUG, "%s %p has errored: %x\n",
+			mapcomponent(ctx, component), component, data1);
 		return data1;
 		break;
 	case OMX_EventCmdComplete:
-		if (ctx->flags & FLAGS_VERBOSE)
-			printf("%s %p has completed the last command.\n",
-				mapcomponent(ctx, component), component);
+		logmsg(V_DEBUG, "%s %p has completed the last command.\n",
+			mapcomponent(ctx, component), component);
 		break;
 	case OMX_EventPortSettingsChanged: {
-//	if (ctx->flags & FLAGS_VERBOSE)
-		printf("%s %p port %d settings changed.\n",
+		logmsg(V_INFO, "%s %p port %d settings changed.\n",
 			mapcomponent(ctx, component), component, data1);
 		dumpport(component, data1);
 	}
 		break;
 	default:
-		if (ctx->flags & FLAGS_VERBOSE)
-			printf("Got an event of type %x on %s %p "
-				"(d1: %x, d2 %x)\n", event,
-				mapcomponent(ctx, component), component,
-				data1, data2);
+		logmsg(V_DEBUG, "Got an event of type %x on %s %p "
+			"(d1: %x, d2 %x)\n", event,
+			mapcomponent(ctx, component), component, data1, data2);
 	}
 	
 	return OMX_ErrorNone;
@@ -512,9 +618,8 @@ OMX_ERRORTYPE filled(OMX_HANDLETYPE component,
 {
 	OMX_BUFFERHEADERTYPE *spare;
 
-	if (ctx->flags & FLAGS_VERBOSE)
-		printf("Got buffer %p filled (len %d)\n", buf,
-			buf->nFilledLen);
+	logmsg(V_DEBUG, "Got buffer %p filled (len %d)\n", buf,
+		buf->nFilledLen);
 
 /*
  * Don't call OMX_FillThisBuffer() here, as the hardware craps out after
@@ -528,6 +633,7 @@ OMX_ERRORTYPE filled(OMX_HANDLETYPE component,
 	if (ctx->bufhead == NULL) {
 		buf->pAppPrivate = NULL;
 		ctx->bufhead = buf;
+		clock_gettime(CLOCK_MONOTONIC, &ctx->bufstamp);
 		pthread_mutex_unlock(&ctx->lock);
 		return OMX_ErrorNone;
 	}
@@ -577,7 +683,7 @@ static OMX_BUFFERHEADERTYPE *allocbufs(OMX_HANDLETYPE h, int port, int enable)
 
 		buf = vcos_malloc_aligned(portdef->nBufferSize,
 			portdef->nBufferAlignment, "buffer");
-		printf("Allocated a buffer of %d bytes\n",
+		logmsg(V_INFO, "Allocated a buffer of %d bytes\n",
 			portdef->nBufferSize);
 		OERRw(OMX_UseBuffer(h, end, port, NULL, portdef->nBufferSize,
 			buf));
@@ -596,119 +702,263 @@ static void usage(const char *name)
 	fprintf(stderr, "Usage: %s [-b bitrate] [-d outputdir] [-r framerate ]\n"
 		"\t<[-s 0..255] | [-m mapfile.png]> [-t 0..100]\n\n"
 		"Where:\n"
+	"\t-a\t\tWrite a motion activity index (.act) per recording\n"
 	"\t-b bitrate\tTarget bitrate (Mb/s)\n"
+	"\t-B bitrate\tBitrate while nothing's moving (Mb/s; fractions ok)\n"
 	"\t-c url\tContinuous streaming URL\n"
+	"\t-C frames\tIgnore motion which doesn't keep its direction\n"
 	"\t-d outputdir\tRecordings directory\n"
+	"\t-D n[:wake]\tOnly look at 1 in n frames until wake blocks are hot\n"
 	"\t-e command\tExecute $command on state change\n"
+	"\t-E command\tSend state changes to $command's stdin as JSON\n"
 	"\t-f format\tSubtitle format\n"
+	"\t-G percent\tCompensate for camera shake; flag it above percent\n"
 	"\t-h\t\tThis help\n"
+	"\t-H frames\tQuiet frames before dropping to the -B bitrate\n"
+	"\t-i input\tRead H.264 from a file or URL instead of the camera\n"
+	"\t-j width\tWrite a JPEG snapshot of each event, width pixels wide\n"
+	"\t-L dest\tLog to a file, or 'syslog' (default stdout)\n"
 	"\t-m mapfile.png\tHeatmap image\n"
 	"\t\tOR:\n"
 	"\t-s 0..255\tMacroblock sensitivity\n"
+	"\t-M\t\tWrite a PNG of where the motion was per recording\n"
 	"\t-n\t\tncurses visualisation of motion"
 	"\t-o outro\tFrames to record after motion has ceased\n"
+	"\t-O\t\tWrite recordings with O_DIRECT, bypassing the page cache\n"
+	"\t-P role=setting\tThread priorities and CPUs (see README)\n"
 	"\t-r rate\t\tEncoding framerate\n"
+	"\t-R name\tPublish the frame ring in shared memory (see shmcat)\n"
+	"\t-S path\t\tControl socket\n"
 	"\t-t 0..100\tMacroblocks over threshold to trigger (raw)\n"
+	"\t-U path\tPublish detection results on a datagram socket (see busdump)\n"
 	"\t-v\t\tVerbose\n"
-	"\t-z pattern\tDump motion vector images (debug)\n"
-	"\nPlease note: -v and -n are exclusive (due to messy output\n"
+	"\t-w [addr:]port\tServe the live stream over HTTP (on 127.0.0.1)\n"
+	"\t-z file.mvr\tRecord motion vectors (see mvconv)\n"
+	"\nPlease note: -v and -n are exclusive without -L (due to messy output\n"
 	"\n", name);
 	exit(1);
 }
 
 
 
-static void run(enum recstate state, char *url)
+/*
+ * One subtitle per wall clock second, shown from the first frame of that
+ * second until the first frame of the next.  Times in the file count from
+ * the recording's first frame, by encoder timestamp, so they line up with
+ * the video to the frame.
+ */
+struct sctx {
+	FILE	*fd;
+	int	n;		/* Subtitles written */
+	int64_t	first;		/* Tick of the first frame */
+	int64_t	second;		/* Wall clock second being shown */
+	int64_t	from;		/* ... since, us into the recording */
+	int64_t	last;		/* Latest frame, us into the recording */
+};
+
+static void srttime(char *out, size_t len, int64_t us)
+{
+	int64_t ms = us / 1000;
+
+	snprintf(out, len, "%02d:%02d:%02d,%03d", (int) (ms / 3600000),
+		(int) (ms / 60000) % 60, (int) (ms / 1000) % 60,
+		(int) (ms % 1000));
+}
+
+static void subout(struct sctx *sctx, int64_t to)
 {
-	pid_t pid;
+	struct tm		tm;
+	time_t			t = sctx->second;
+	char			*fmt = ctx.subs;
+	char			st[256], from[16], until[16];
 
-	if (!ctx.command)
+	localtime_r(&t, &tm);
+	if (!fmt || strftime(st, sizeof(st), fmt, &tm) == 0)
 		return;
-	pid = fork();
-	if (pid)
+	srttime(from, sizeof(from), sctx->from);
+	srttime(until, sizeof(until), to);
+	fprintf(sctx->fd, "%d\n%s --> %s\n%s\n\n", ++sctx->n, from, until,
+		st);
+}
+
+static void sub(struct sctx *sctx, struct frame *f)
+{
+	int64_t tick = (((int64_t) f->tick.nHighPart)<<32) | f->tick.nLowPart;
+	int64_t second = f->walltime / 1000000;
+
+	if (!sctx->fd)
 		return;
+	if (sctx->last == -1) {
+		sctx->first = tick;
+		sctx->second = second;
+		sctx->from = 0;
+	}
+	sctx->last = tick - sctx->first;
 
-	execlp(ctx.command, ctx.command,
-		(state == recording) ? "start" : "stop",
-		url,
-		NULL);
-	exit(0);
+	if (second != sctx->second) {
+		subout(sctx, sctx->last);
+		sctx->second = second;
+		sctx->from = sctx->last;
+	}
+}
+
+/* The last one lasts until the end of the last frame: */
+static void subclose(struct sctx *sctx)
+{
+	if (!sctx->fd)
+		return;
+	if (sctx->last != -1)
+		subout(sctx, sctx->last + 1000000 / ctx.framerate);
+	fclose(sctx->fd);
+	sctx->fd = NULL;
 }
 
 
 
+/* Note where this frame is about to go, for the -a sidecar: */
+static void indexframe(FILE *act, AVFormatContext *oc, struct frame *f)
+{
+	struct actrecord r;
 
-struct sctx {
-	FILE	*fd;
-	int	n;
-	int	ot;		/* Old time */
-	int	to;		/* Offset of timestamp from file start */
-	int	nspf;
-	int	fc;
-};
+	if (!act)
+		return;
 
-static void sub(struct sctx *sctx, struct frame *f)
+	memset(&r, 0, sizeof(r));
+	r.pts = (((int64_t) f->tick.nHighPart)<<32) | f->tick.nLowPart;
+	if (ctx.fd != -1)
+		r.offset = lseek(ctx.fd, 0, SEEK_CUR);
+	else if (oc->pb)
+		r.offset = avio_tell(oc->pb);
+	r.hits = f->hits;
+	if (f->flags & OMX_BUFFERFLAG_SYNCFRAME)
+		r.flags |= ACT_KEY;
+	if (f->hits >= motionthreshold())
+		r.flags |= ACT_MOVING;
+	r.x0 = f->box[0];
+	r.y0 = f->box[1];
+	r.x1 = f->box[2];
+	r.y1 = f->box[3];
+	actframe(act, &r);
+}
+
+
+
+/* walltime is the first frame's for a start, and the last's for a stop: */
+static void journal(int event, const char *url, unsigned int first,
+	unsigned int last, int64_t tick, int64_t walltime, int peak)
 {
-	struct tm		tm;
-	char			st[256];
+	struct jnlrecord	r;
+
+	memset(&r, 0, sizeof(r));
+	r.event = event;
+	r.walltime = walltime;
+	r.tick = tick;
+	r.firstframe = first;
+	r.lastframe = last;
+	r.peak = peak;
+	r.threshold = motionthreshold();
+	snprintf(r.file, sizeof(r.file), "%s", url);
+	jnlappend(&r);
+}
 
-	if (sctx->nspf == 0) {	/* Proxy for uninitialised */
-		sctx->nspf = 1000 / ctx.framerate;
-		sctx->ot = f->time;
-		sctx->to = -1;
-		sctx->n = 1;
-	}
 
-	if (f->time == sctx->ot) {
-		sctx->fc++;
-		return;
-	}
-	sctx->ot = f->time;
 
-	if (sctx->to == -1) {
-		sctx->to = sctx->nspf * sctx->fc;
-	}
+/*
+ * Where to carry on from, if the capture thread has got so far ahead that
+ * pfn is about to be, or already has been, overwritten: the oldest I-frame
+ * with RINGSLACK frames to spare, to write while it carries on.  If even
+ * that's gone, the newest frame, and the writer must wait for an I-frame.
+ * Called with ctx.lock held.
+ */
+static unsigned int ringclamp(unsigned int pfn, const char *url)
+{
+	unsigned int oldest = ctx.framenum - (INMEMFRAMES - RINGSLACK);
+	unsigned int n;
+
+	if ((int) (pfn - oldest) >= 0)
+		return pfn;
+	for (n = oldest; n != ctx.framenum; n++)
+		if (ctx.frames[n & (INMEMFRAMES - 1)].flags &
+			OMX_BUFFERFLAG_SYNCFRAME)
+			break;
+	logmsg(V_ERROR, "%s: %u frames went from the ring before they could "
+		"be written\n", url, n - pfn);
+
+	return n;
+}
+
+
+
+/* The end of a recording, which the next one needn't wait for: */
+struct finishing {
+	AVFormatContext	*oc;
+	int		index;
+	char		url[256];
+	FILE		*act;
+	struct sctx	sctx;
+	uint16_t	*heat;
+	unsigned int	first, last;
+	int64_t		tick;
+	int64_t		lastwall;
+	int		peak;
+};
 
-	localtime_r(&f->time, &tm);
-	if (strftime(st, sizeof(st), ctx.subs, &tm) != 0) {
-		int hh, mm, ss, nh, nm, ns;
-		int n = sctx->n;
-		hh =  n / 3600;
-		mm = (n / 60) % 60;
-		ss = (n % 60);
-
-		n++;
-		nh =  n / 3600;
-		nm = (n / 60) % 60;
-		ns = (n % 60);
-
-		fprintf(sctx->fd, "%d\n%02d:%02d:%02d,%03d --> "
-				"%02d:%02d:%02d,%03d\n%s\n\n", sctx->n++,
-				hh, mm, ss, sctx->to, nh, nm, ns, sctx->to, st);
+static void *finishoff(void *args)
+{
+	struct finishing *fin = args;
+
+	if (fin->oc) {
+		av_write_trailer(fin->oc);
+/* Closing writes out the last of it; the hook may want to read it: */
+		closeoutput(fin->oc, fin->index);
+		hook(waiting, fin->url);
 	}
+	journal(JNL_STOP, fin->url, fin->first, fin->last, fin->tick,
+		fin->lastwall, fin->peak);
+	motionheat(fin->url, fin->heat);
+	actclose(fin->act);
+	subclose(&fin->sctx);
+	logmsg(V_INFO, "\nDone %s.\n", fin->url);
+	free(fin);
+
+	pthread_mutex_lock(&ctx.lock);
+	ctx.recfinishing--;
+	pthread_cond_broadcast(&ctx.reccond);
+	pthread_mutex_unlock(&ctx.lock);
+
+	return NULL;
 }
 
 
 
-static void *startrecording(void *args)
+static void record(AVFormatContext *oc, int index, const char *next)
 {
 	struct tm		tm;
 	time_t			t;
 	char			url[256];
-	AVFormatContext		*oc;
 	unsigned int		ftw;
 	int			i;
-	unsigned int		rp, pfn;
-	int			index;
-	pthread_t		self;
+	unsigned int		rp, pfn, resume;
 	int			done;
 	struct sctx		sctx;
+	FILE			*act = NULL;
+	struct timespec		now;
+	unsigned int		latency;
+	struct jitterstats	js;
+	unsigned int		first;
+	int64_t			tick, firstwall, lastwall;
+	struct finishing	*fin;
+	pthread_attr_t		detach;
+	pthread_t		thread;
+	int			synced = 1;
+	struct frame		*f;
 
 	t = time(NULL);
 	localtime_r(&t, &tm);
 
 	memset(&sctx, 0, sizeof(sctx));
 	sctx.fd = NULL;
+	sctx.last = -1;
 	if (ctx.subs) {
 		snprintf(url, sizeof(url), "%s/%d-%02d-%02dT%02d:%02d:%02d.srt",
 			ctx.outdir, tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday,
@@ -720,56 +970,117 @@ static void *startrecording(void *args)
 			ctx.outdir, tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday,
 			tm.tm_hour, tm.tm_min, tm.tm_sec);
 
-	if ((oc = openoutput(url, &index)) == NULL) {
-		ctx.recstate = waiting;
-		return NULL;
+	if (oc && rename(next, url) != 0) {
+		logmsg(V_ERROR, "Failed to rename %s to %s: %s\n", next, url,
+			strerror(errno));
+		closeoutput(oc, index);
+		unlink(next);
+		oc = NULL;
 	}
+/* Nothing prepared; do it the slow way: */
+	if (!oc)
+		oc = prepareoutput(url, &index);
 
+/* We may have been held up by the end of the last one: */
 	pthread_mutex_lock(&ctx.lock);
-	pfn = ctx.previframe;
+	pfn = ringclamp(ctx.recstart, url);
+	pthread_mutex_unlock(&ctx.lock);
+	getjitter(&js, 1);
+
+	if (!oc || beginoutput(oc, url, index, pfn) != 0) {
+		if (oc)
+			closeoutput(oc, index);
+		pthread_mutex_lock(&ctx.lock);
+		ctx.sm.state = waiting;
+		pthread_mutex_unlock(&ctx.lock);
+		if (sctx.fd)
+			fclose(sctx.fd);
+		return;
+	}
+	if (ctx.flags & FLAGS_INDEX)
+		act = actopen(url, (ctx.width + 15) / 16, (ctx.height + 15) / 16,
+			ctx.framerate, motionthreshold(),
+			oc->start_time_realtime);
+
+	pthread_mutex_lock(&ctx.lock);
+	pfn = ringclamp(pfn, url);
 	ftw = ctx.framenum - pfn;
 	pthread_mutex_unlock(&ctx.lock);
-	if (!(ctx.flags & FLAGS_MONITOR))
-		printf("Writing initial %d frames out...\n", ftw);
 
 	rp = pfn & (INMEMFRAMES - 1);
+	first = pfn;
+	tick = (((int64_t) ctx.frames[rp].tick.nHighPart)<<32) |
+		ctx.frames[rp].tick.nLowPart;
+	firstwall = lastwall = ctx.frames[rp].walltime;
+	synced = (ctx.frames[rp].flags & OMX_BUFFERFLAG_SYNCFRAME) != 0;
 
 	for (i = 0; i < ftw; i++) {
-		if (ctx.subs)
-			sub(&sctx, &ctx.frames[rp]);
-		writeframe(oc, &ctx.frames[rp], index);
+		f = &ctx.frames[rp];
 		rp++;
 		rp &= (INMEMFRAMES - 1);
+		if (!synced && !(f->flags & OMX_BUFFERFLAG_SYNCFRAME))
+			continue;
+		synced = 1;
+		if (ctx.subs)
+			sub(&sctx, f);
+		indexframe(act, oc, f);
+		writeframe(oc, f, index);
+		lastwall = f->walltime;
+		if (i == 0) {
+/* Make sure the header and first frame are actually on their way (to
+ * recio's buffer, for a file): */
+			if (ctx.fd == -1)
+				avio_flush(oc->pb);
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			latency = (now.tv_sec - ctx.rectrigger.tv_sec) * 1000000 +
+				(now.tv_nsec - ctx.rectrigger.tv_nsec) / 1000;
+			ctx.reclatency = latency;
+			if (latency > ctx.recmaxlatency)
+				ctx.recmaxlatency = latency;
+		}
 	}
 	pfn += ftw;
-	if (!ctx.outdir) {
-		snprintf(url, sizeof(url), "%d-%02d-%02dT%02d:%02d:%02d",
-			tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday,
-			tm.tm_hour, tm.tm_min, tm.tm_sec);
-		run(recording, url);
-		return NULL;
-	}
 
 	if (!(ctx.flags & FLAGS_MONITOR))
-		printf("done.\n");
+		av_dump_format(oc, 0, url, 1);
+	logmsg(V_INFO, "Wrote initial %d frames; trigger to first write "
+		"%d.%03dms\n", ftw, ctx.reclatency / 1000,
+		ctx.reclatency % 1000);
+
+/* The slow bits, now the pre-roll is safely out of the ring: */
+	journal(JNL_START, url, first, first, tick, firstwall, motionpeak(0));
+	if (ctx.flags & FLAGS_HEAT)
+		motionaccum();
+	hook(recording, url);
+	snapshot(url);
 
-/* This is a little messy, but there's a race condition: */
-	self = pthread_self();
 	done = 0;
 
 	while (1) {
 		pthread_mutex_lock(&ctx.lock);
 		pthread_cond_wait(&ctx.framecond, &ctx.lock);
+		resume = ringclamp(pfn, url);
+		if (resume != pfn) {
+			pfn = resume;
+			rp = pfn & (INMEMFRAMES - 1);
+			synced = 0;
+		}
 		ftw = ctx.framenum - pfn;
-		if (ctx.recthread != self || ctx.recstate == waiting)
+		if (ctx.recpending || ctx.sm.state == waiting)
 			done = 1;
 		pthread_mutex_unlock(&ctx.lock);
 		for (i = 0; i < ftw; i++) {
-			if (ctx.subs)
-				sub(&sctx, &ctx.frames[rp]);
-			writeframe(oc, &ctx.frames[rp], index);
+			f = &ctx.frames[rp];
 			rp++;
-			rp &= (INMEMFRAMES-1);
+			rp &= (INMEMFRAMES - 1);
+			if (!synced && !(f->flags & OMX_BUFFERFLAG_SYNCFRAME))
+				continue;
+			synced = 1;
+			if (ctx.subs)
+				sub(&sctx, f);
+			indexframe(act, oc, f);
+			writeframe(oc, f, index);
+			lastwall = f->walltime;
 		}
 		pfn += ftw;
 
@@ -777,65 +1088,244 @@ static void *startrecording(void *args)
 			break;
 	}
 
-	if (!(ctx.flags & FLAGS_MONITOR))
-		printf("\nStopping recording %s at frame %d\n", url, pfn);
+	getjitter(&js, 0);
+	logmsg(V_INFO, "\nStopping recording %s at frame %d\n", url, pfn);
+	logmsg(V_INFO, "Capture turnaround while recording: mean %uus, "
+		"sd %uus, 99%% < %uus, max %uus\n", js.mean, js.stddev,
+		js.p99, js.max);
+
+/*
+ * Anything which has to be done before the next recording can start --
+ * the heat counts and the peak are shared -- is done here; the rest, the
+ * trailer, closing (which waits for it all to reach the card), the hooks
+ * and the heat map, on a thread of its own, so a trigger which arrives
+ * meanwhile isn't kept waiting while the ring runs on.
+ */
+	fin = calloc(1, sizeof(*fin));
+	fin->index = index;
+	snprintf(fin->url, sizeof(fin->url), "%s", url);
+	fin->act = act;
+	fin->sctx = sctx;
+	fin->heat = (ctx.flags & FLAGS_HEAT) ? motionheatstop() : NULL;
+	fin->first = first;
+	fin->last = pfn - 1;
+	fin->tick = tick;
+	fin->lastwall = lastwall;
+	fin->peak = motionpeak(1);
 	if (ctx.fd == -1) {
-		if (oc) {
-			av_write_trailer(oc);
-			avcodec_close(oc->streams[index]->codec);
-			avio_close(oc->pb);
-			run(waiting, oc->filename);
-			avformat_free_context(oc);
-			oc = NULL;
-		} else {
-			run(waiting, "");
-		}
+		fin->oc = oc;
 	} else {
-		run(waiting, "");
+		hook(waiting, "");
 		close(ctx.fd);
 		ctx.fd = -1;
 	}
 
-	if (ctx.subs) {
-		fflush(sctx.fd);
-		fclose(sctx.fd);
+	pthread_mutex_lock(&ctx.lock);
+	ctx.recfinishing++;
+	pthread_mutex_unlock(&ctx.lock);
+	pthread_attr_init(&detach);
+	pthread_attr_setdetachstate(&detach, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &detach, finishoff, fin) != 0)
+		finishoff(fin);
+	pthread_attr_destroy(&detach);
+}
+
+
+
+/*
+ * The recorder thread.  Setting up an output -- guessing the format,
+ * allocating the context and stream, creating the file -- used to happen
+ * after the trigger, while the ring carried on filling.  Now the next
+ * output is prepared in advance, as a hidden file in the output
+ * directory, and a trigger only has to rename it, write the header and
+ * start draining the ring.
+ *
+ * There's only one recorder: a trigger which arrives while the previous
+ * recording is still going cuts that one short.  The end of a recording
+ * is finished off on a thread of its own; see record().
+ */
+static void *recorder(void *args)
+{
+	AVFormatContext		*oc = NULL;
+	int			index = 0;
+	char			next[256];
+
+	snprintf(next, sizeof(next), "%s/.next.mkv", ctx.outdir);
+	schedthread(ROLE_RECORD);
+
+	while (1) {
+		if (!oc)
+			oc = prepareoutput(next, &index);
+
+		pthread_mutex_lock(&ctx.lock);
+		while (!ctx.recpending)
+			pthread_cond_wait(&ctx.reccond, &ctx.lock);
+		ctx.recpending = 0;
+		ctx.recbusy = 1;
+		pthread_mutex_unlock(&ctx.lock);
+
+		record(oc, index, next);
+		oc = NULL;
+
+		pthread_mutex_lock(&ctx.lock);
+		ctx.recbusy = 0;
+		pthread_cond_broadcast(&ctx.reccond);
+		pthread_mutex_unlock(&ctx.lock);
 	}
 
-	if (!(ctx.flags & FLAGS_MONITOR))
-		printf("\nDone.\n");
+	return NULL; /* to shut the compiler up */
+}
 
-	return NULL;
+
+
+/*
+ * The source has run out; let any recording finish properly.  The
+ * recorder only looks at the state when it's woken for a frame, and may
+ * not have been waiting the first time, so keep nudging it.
+ */
+static void finish(void)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&ctx.lock);
+	ctx.sm.state = waiting;
+	while (ctx.recbusy || ctx.recpending || ctx.recfinishing) {
+		pthread_cond_signal(&ctx.framecond);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&ctx.reccond, &ctx.lock, &ts);
+	}
+	pthread_mutex_unlock(&ctx.lock);
 }
 
 
 
 static void checkstate(struct frame *f)
 {
+	struct motionstats ms;
+	enum recstate was;
+	unsigned int lastevent;
+
 	pthread_mutex_lock(&ctx.lock);
-	switch (ctx.recstate) {
-	case waiting:
-		break;
-	case triggered:
-		if ((ctx.framenum - ctx.lastevent) > ctx.debounce) {
-			pthread_attr_t detach;
-			pthread_attr_init(&detach);
-			pthread_attr_setdetachstate(&detach, PTHREAD_CREATE_DETACHED);
-			ctx.recstate = recording;
-			pthread_create(&ctx.recthread, &detach, startrecording, NULL);
-		}
-		break;
-	case recording:
-		pthread_cond_signal(&ctx.framecond);
-		break;
-	case stopping:
-		if ((ctx.framenum - ctx.lastevent) > ctx.outro &&
-			(f->flags & OMX_BUFFERFLAG_SYNCFRAME)) {
-			ctx.recstate = waiting;
+	was = ctx.sm.state;
+	if (smframe(&ctx.sm, ctx.framenum, f->flags & OMX_BUFFERFLAG_SYNCFRAME)
+		== SM_START) {
+/*
+ * Forced over -S in a still scene, there'll be no quiescent event to end
+ * it, so start the outro now; movement will still extend it as usual.
+ * The detector's events need ctx.lock, so none can slip in between.
+ */
+		getmotionstats(&ms);
+		if (!ms.moving) {
+			ctx.sm.state = stopping;
+			ctx.sm.lastevent = ctx.framenum;
 		}
-		pthread_cond_signal(&ctx.framecond);
-		break;
+		clock_gettime(CLOCK_MONOTONIC, &ctx.rectrigger);
+		ctx.recstart = ctx.previframe;
+		ctx.recpending = 1;
+		pthread_cond_signal(&ctx.reccond);
 	}
+	if (was == recording || was == stopping || ctx.recpending)
+		pthread_cond_signal(&ctx.framecond);
+	was = ctx.sm.state;
+	lastevent = ctx.sm.lastevent;
 	pthread_mutex_unlock(&ctx.lock);
+
+	rateframe(ctx.framenum, lastevent, was == waiting);
+}
+
+
+
+/*
+ * Take a complete access unit from the source, and put it in the ring.
+ * Parameter sets are kept to one side, and put back in front of each IDR
+ * frame, so every recording and the -c stream can start from any
+ * I-frame.  Returns 0 if the buffer went into the ring, or 1 if there was
+ * no picture in it; in that case, it's left as it is, for the rest of the
+ * next access unit to be appended to.
+ */
+int storeframe(uint8_t **buf, off_t *len, OMX_TICKS tick, int flags)
+{
+	struct frame *pkt;
+	struct nal nals[MAXNALS];
+	int n, types, changed;
+
+	n = nalsplit(*buf, *len, nals, MAXNALS, &types);
+	if (types & NAL_PARAMS) {
+		pthread_mutex_lock(&ctx.lock);
+		changed = nalparams(&ctx.params, nals, n);
+		pthread_mutex_unlock(&ctx.lock);
+		if (changed)
+			logmsg(V_DEBUG, "New%s%s at frame %d\n",
+				changed & NALBIT(NAL_SPS) ? " SPS" : "",
+				changed & NALBIT(NAL_PPS) ? " PPS" : "",
+				ctx.framenum);
+		*len = nalstrip(*buf, nals, &n, NAL_PARAMS);
+	}
+	if (ctx.cocurl && ctx.params.sps && ctx.params.pps) {
+		ctx.coc = openoutput(ctx.cocurl, &ctx.cocvidindex);
+		ctx.cocurl = NULL;
+	}
+
+/* No picture; hang on to any SEI and the like for the next one: */
+	if (!(types & NAL_VCL))
+		return 1;
+
+	if (types & NALBIT(NAL_IDR)) {
+		int pl = ctx.params.spslen + ctx.params.ppslen;
+
+		*buf = av_realloc(*buf, *len + pl);
+		memmove(&(*buf)[pl], *buf, *len);
+		memcpy(*buf, ctx.params.sps, ctx.params.spslen);
+		memcpy(&(*buf)[ctx.params.spslen], ctx.params.pps,
+			ctx.params.ppslen);
+		*len += pl;
+	}
+
+	pkt = &ctx.frames[ctx.framenum % INMEMFRAMES];
+	pkt->walltime = tbwall((((int64_t) tick.nHighPart)<<32) |
+		tick.nLowPart);
+	if (pkt->buf) {
+		av_free(pkt->buf);
+		pkt->buf = NULL;
+	}
+
+	pkt->buf = *buf;
+	pkt->len = *len;
+	pkt->flags = flags;
+	pkt->tick = tick;
+	if (types & NALBIT(NAL_IDR))
+		pkt->flags |= OMX_BUFFERFLAG_SYNCFRAME;
+	if (pkt->flags & OMX_BUFFERFLAG_SYNCFRAME) {
+		ctx.previframe = ctx.lastiframe;
+		ctx.lastiframe = ctx.framenum;
+	}
+	if (ctx.flags & FLAGS_INDEX) {
+		struct motionstats ms;
+		getmotionstats(&ms);
+		pkt->hits = ms.hits;
+		memcpy(pkt->box, ms.box, sizeof(pkt->box));
+	}
+	*buf = NULL;
+	*len = 0;
+	shmwframe(pkt->buf, pkt->len, (((int64_t) tick.nHighPart)<<32) |
+		tick.nLowPart, pkt->walltime,
+		pkt->flags & OMX_BUFFERFLAG_SYNCFRAME);
+	httpframe(pkt->buf, pkt->len, (((int64_t) tick.nHighPart)<<32) |
+		tick.nLowPart, pkt->flags & OMX_BUFFERFLAG_SYNCFRAME);
+
+	ctx.framenum++;
+	if (ctx.coc)
+		writeframe(ctx.coc, pkt, ctx.cocvidindex);
+
+	applyctl();
+	checkstate(pkt);
+
+	return 0;
 }
 
 
@@ -852,7 +1342,9 @@ int main(int argc, char *argv[])
 	int		fd;
 	char		*mapfile = NULL;
 	int		threshold, sensitivity;
-	char		*url = NULL;
+	char		*ctlpath = NULL;
+	char		*input = NULL;
+	int		loglevel = V_INFO;
 
 /* Various OpenMAX configuration parameters: */
 	OMX_VIDEO_PARAM_AVCTYPE		*avc;
@@ -892,90 +1384,206 @@ int main(int argc, char *argv[])
 	if (argc < 2)
 		usage(argv[0]);
 
-	signal(SIGCHLD, SIG_IGN);
-
 	memset(&ctx, 0, sizeof(ctx));
 	ctx.bitrate = 2*1024*1024;
 	ctx.framerate = 25;
 	ctx.flags = 0; //FLAGS_VERBOSE;
 	ctx.width = 1920;
 	ctx.height = 1080;
-	ctx.recstate = waiting;
-	ctx.debounce = DEBOUNCE;
+	ctx.sm.state = waiting;
+	ctx.sm.debounce = DEBOUNCE;
 	ctx.fd = -1;
-	ctx.outro = -1;
+	ctx.sm.outro = -1;
+	ctx.ratehold = -1;
 	threshold = 20;
 	sensitivity = 40;
 	pthread_cond_init(&ctx.cond, NULL);
+	pthread_cond_init(&ctx.framecond, NULL);
+	pthread_cond_init(&ctx.reccond, NULL);
 	TAILQ_INIT(&packetq);
 
-	while ((opt = getopt(argc, argv, "b:c:d:e:f:hm:no:r:s:t:vz:")) != -1) {
+	while ((opt = getopt(argc, argv, "ab:B:c:C:d:D:e:E:f:G:hH:i:j:L:m:MnOo:P:r:R:s:S:t:U:vw:z:")) != -1) {
 		switch (opt) {
 		int l;
+		case 'a':
+			ctx.flags |= FLAGS_INDEX;
+			break;
 		case 'b':
 			ctx.bitrate = atoi(optarg)*1024*1024;
 			break;
+		case 'B':
+			ctx.idlebitrate = atof(optarg)*1024*1024;
+			break;
 		case 'c':
-			url = optarg;
+			ctx.cocurl = optarg;
+			break;
+		case 'C':
+			ctx.cohwindow = atoi(optarg);
 			break;
 		case 'd':
 			l = strlen(optarg)+1;
 			ctx.outdir = malloc(l);
 			memcpy(ctx.outdir, optarg, l);
 			break;
+		case 'D':
+			if (sscanf(optarg, "%d:%d", &ctx.dozeframes,
+				&ctx.dozewake) < 1)
+				usage(argv[0]);
+			break;
 		case 'e':
 			ctx.command = optarg;
 			break;
+		case 'E':
+			ctx.helper = optarg;
+			break;
 		case 'f':
 			ctx.subs = optarg;
 			break;
+		case 'G':
+			ctx.camagree = atoi(optarg);
+			break;
 		case 'h':
 			usage(argv[0]);
 			break;
+		case 'H':
+			ctx.ratehold = atoi(optarg);
+			break;
+		case 'j':
+			ctx.snapwidth = atoi(optarg);
+			break;
+		case 'i':
+			input = optarg;
+			break;
+		case 'L':
+			ctx.logdest = optarg;
+			break;
 		case 'm':
 			mapfile = optarg;
 			break;
+		case 'M':
+			ctx.flags |= FLAGS_HEAT;
+			break;
 		case 'n':
 			ctx.flags |= FLAGS_MONITOR;
 			break;
 		case 'o':
-			ctx.outro = atoi(optarg);
+			ctx.sm.outro = atoi(optarg);
+			break;
+		case 'O':
+			ctx.flags |= FLAGS_DIRECT;
 			break;
 		case 'r':
 			ctx.framerate = atoi(optarg);
 			break;
+		case 'R':
+			ctx.shmname = optarg;
+			break;
 		case 's':
 			sensitivity = atoi(optarg);
 			break;
+		case 'P':
+			if (schedparse(optarg) != 0)
+				exit(1);
+			break;
+		case 'S':
+			ctlpath = optarg;
+			break;
 		case 't':
 			threshold = atoi(optarg);
 			break;
+		case 'U':
+			ctx.buspath = optarg;
+			break;
 		case 'v':
 			ctx.flags |= FLAGS_VERBOSE;
 			break;
+		case 'w':
+/* [address:]port; only this machine can watch unless told otherwise: */
+			if (strrchr(optarg, ':')) {
+				ctx.httpaddr = strdup(optarg);
+				*strrchr(ctx.httpaddr, ':') = '\0';
+				ctx.httpport = atoi(strrchr(optarg, ':') + 1);
+			} else {
+				ctx.httpport = atoi(optarg);
+			}
+			break;
 		case 'z':
-			ctx.dumppattern = optarg;
+			ctx.vecfile = optarg;
 			break;
 		default:
 			usage(argv[0]);
 		}
 	}
 
-	if (ctx.flags & FLAGS_VERBOSE && ctx.flags & FLAGS_MONITOR) {
+	if (ctx.flags & FLAGS_VERBOSE && ctx.flags & FLAGS_MONITOR &&
+		!ctx.logdest) {
 		usage(argv[0]);
 		exit(1);
 	}
 
-	if (ctx.outro == -1)
-		ctx.outro = ctx.framerate * 2;
+/* Only errors on the terminal while the monitor's using it: */
+	if (ctx.flags & FLAGS_VERBOSE)
+		loglevel = V_DEBUG;
+	else if (ctx.flags & FLAGS_MONITOR && !ctx.logdest)
+		loglevel = V_ERROR;
+	if (initlog(ctx.logdest, loglevel) != 0) {
+		fprintf(stderr, "Failed to open %s: %s\n", ctx.logdest,
+			strerror(errno));
+		exit(1);
+	}
+
+/* A software source sets the size and rate from the input: */
+	if (input && swopen(input) != 0)
+		exit(1);
+
+	if (ctx.sm.outro == -1)
+		ctx.sm.outro = ctx.framerate * 2;
+	if (ctx.ratehold == -1)
+		ctx.ratehold = ctx.framerate * 5;
 
+	tbinit(ctx.framerate);
+	if (initbus(ctx.buspath) != 0) {
+		logmsg(V_ERROR, "Failed to bind %s: %s\n", ctx.buspath,
+			strerror(errno));
+		exit(1);
+	}
 	initmotion(&ctx, mapfile, sensitivity, threshold, motioncallback,
 		NULL);
+	if (ctx.flags & FLAGS_MONITOR)
+		initmonitor(&ctx);
+	inithooks(ctx.command, ctx.helper);
+	if (initctl(ctlpath) != 0)
+		exit(1);
 
 	av_register_all();
 	avcodec_register_all();
+	initsnapshot(ctx.snapwidth);
 
 	pthread_mutex_init(&ctx.lock, NULL);
+	if (!ctx.outdir)
+		ctx.outdir = ".";
+	if (jnlopen(ctx.outdir) != 0)
+		logmsg(V_ERROR, "Failed to open the journal in %s: %s\n",
+			ctx.outdir, strerror(errno));
+	pthread_create(&ctx.recthread, NULL, recorder, NULL);
+/* About eight seconds' worth: */
+	if (ctx.shmname && shmwopen(ctx.shmname, ctx.width, ctx.height,
+		ctx.framerate, ctx.bitrate) != 0)
+		logmsg(V_ERROR, "Failed to create %s: %s\n", ctx.shmname,
+			strerror(errno));
+	if (inithttp(ctx.httpaddr, ctx.httpport) != 0)
+		exit(1);
+
+	if (input) {
+/* No encoder to adjust; status just shows the -b rate: */
+		initratectl(NULL, 0, ctx.bitrate, 0, 0);
+		swsource();
+		closemotion();
+		finish();
+		shmwclose();
+		jnlclose();
+		return 0;
+	}
 
 /* Initialise OMX: */
 	bcm_host_init();
@@ -988,6 +1596,8 @@ int main(int argc, char *argv[])
 	ctx.cam = cam;
 	ctx.enc = enc;
 	ctx.nul = nul;
+	initratectl(enc, PORT_ENC+1, ctx.bitrate, ctx.idlebitrate,
+		ctx.ratehold);
 
 /* Disable all ports.  Why this isn't the default I don't know... */
 	for (i = 0; i < 6; i++)
@@ -1034,14 +1644,14 @@ int main(int argc, char *argv[])
 	smt->nPortIndex = OMX_ALL;
 	smt->sFrameSize.nPortIndex = OMX_ALL;
 	OERR(OMX_GetParameter(cam, OMX_IndexParamCommonSensorMode, smt));
-	printf("Sensor mode: framerate %d (%x), oneshot: %d\n",
+	logmsg(V_INFO, "Sensor mode: framerate %d (%x), oneshot: %d\n",
 		smt->nFrameRate, smt->nFrameRate, smt->bOneShot);
 	smt->bOneShot = 0;
 	smt->nFrameRate = ctx.framerate<<16;
 	OERR(OMX_SetParameter(cam, OMX_IndexParamCommonSensorMode, smt));
 	frt->nPortIndex = PORT_CAM + 1;
 	OERR(OMX_GetConfig(cam, OMX_IndexConfigVideoFramerate, frt));
-	printf("Alleged framerate: %d (%x)\n",
+	logmsg(V_INFO, "Alleged framerate: %d (%x)\n",
 		frt->xEncodeFramerate, frt->xEncodeFramerate);
 	frt->xEncodeFramerate = ctx.framerate << 16;
 	OERR(OMX_SetConfig(cam, OMX_IndexConfigVideoFramerate, frt));
@@ -1144,31 +1754,29 @@ WAIT;
 	dumpport(cam, PORT_CAM+1);
 
 	OERR(OMX_FillThisBuffer(enc, ctx.encbufs));
+	schedthread(ROLE_CAPTURE);
 	do {
+		struct timespec stamp, now;
+
 		pthread_mutex_lock(&ctx.lock);
 		spare = ctx.bufhead;
 		ctx.bufhead = NULL;
+		stamp = ctx.bufstamp;
 		pthread_mutex_unlock(&ctx.lock);
 		if (!spare) {
 			usleep(10);
 			continue;
 		}
 		while (spare) {
-			struct frame *pkt;
 			OMX_TICKS tick = spare->nTimeStamp;
-			int nt = 0;
-
-			tmpbuf = av_realloc(tmpbuf,
-					tmpbufoff + spare->nFilledLen);
-			memcpy(&tmpbuf[tmpbufoff],
-					&spare->pBuffer[spare->nOffset],
-					spare->nFilledLen);
-			tmpbufoff += spare->nFilledLen;
 
 			if (spare->nFlags & OMX_BUFFERFLAG_CODECSIDEINFO) {
-				findmotion(tmpbuf);
-				tmpbuf = NULL;
-				tmpbufoff = 0;
+				uint8_t *vecs = av_malloc(spare->nFilledLen);
+				memcpy(vecs, &spare->pBuffer[spare->nOffset],
+					spare->nFilledLen);
+				findmotion(vecs,
+					(((int64_t) tick.nHighPart)<<32) |
+					tick.nLowPart);
 				spare->nFilledLen = 0;
 				spare->nOffset = 0;
 				OERRq(OMX_FillThisBuffer(enc, spare));
@@ -1176,8 +1784,16 @@ WAIT;
 				continue;
 			}
 
-			if ((spare->nFlags & OMX_BUFFERFLAG_ENDOFNAL)
-					== 0) {
+			tmpbuf = av_realloc(tmpbuf,
+					tmpbufoff + spare->nFilledLen);
+			memcpy(&tmpbuf[tmpbufoff],
+					&spare->pBuffer[spare->nOffset],
+					spare->nFilledLen);
+			tmpbufoff += spare->nFilledLen;
+
+/* Wait for the rest of the access unit: */
+			if ((spare->nFlags & (OMX_BUFFERFLAG_ENDOFFRAME |
+					OMX_BUFFERFLAG_CODECCONFIG)) == 0) {
 				spare->nFilledLen = 0;
 				spare->nOffset = 0;
 				OERRq(OMX_FillThisBuffer(enc, spare));
@@ -1185,70 +1801,18 @@ WAIT;
 				continue;
 			}
 
-			pkt = &ctx.frames[ctx.framenum % INMEMFRAMES];
-			pkt->time = time(NULL);
-			if (pkt->buf) {
-				av_free(pkt->buf);
-				pkt->buf = NULL;
-			}
-
-			if (spare->nFlags & OMX_BUFFERFLAG_SYNCFRAME) {
-				ctx.previframe = ctx.lastiframe;
-				ctx.lastiframe = ctx.framenum;
-			}
-
-			pkt->buf = tmpbuf;
-			pkt->len = tmpbufoff;
-			pkt->flags = spare->nFlags;
-			pkt->tick = tick;
-			tmpbuf = NULL;
-			tmpbufoff = 0;
-
-			if (pkt->buf[0] == 0 && pkt->buf[1] == 0 &&
-					pkt->buf[2] == 0 && pkt->buf[3] == 1) {
-				nt = pkt->buf[4] & 0x1f;
-				if (nt == 7) {
-					if (ctx.sps)
-						free(ctx.sps);
-					ctx.sps = malloc(pkt->len);
-					memcpy(ctx.sps, pkt->buf, pkt->len);
-					ctx.spslen = pkt->len;
-//					printf("New SPS, length %d\n",
-//							ctx.spslen);
-				} else if (nt == 8) {
-					if (ctx.pps)
-						free(ctx.pps);
-					ctx.pps = malloc(pkt->len);
-					memcpy(ctx.pps, pkt->buf, pkt->len);
-					ctx.ppslen = pkt->len;
-//					printf("New PPS, length %d\n",
-//							ctx.ppslen);
-				}
-/* I don't seem to be seeing PPSes any longer.  5 is arbitrary. */
-				if (url && (ctx.framenum > 5)) {
-					ctx.coc = openoutput(url, &ctx.cocvidindex);
-					url = NULL;
-				}
-				if (nt == 7 || nt == 8) {
-					spare->nFilledLen = 0;
-					spare->nOffset = 0;
-					OERRq(OMX_FillThisBuffer(enc, spare));
-					spare = spare->pAppPrivate;
-					continue;
-				}
-			}
-			ctx.framenum++;
-			if (ctx.coc)
-				writeframe(ctx.coc, pkt, ctx.cocvidindex);
-
-			if (nt != 7 && nt != 8)
-				checkstate(pkt);
+			storeframe(&tmpbuf, &tmpbufoff, tick, spare->nFlags);
 
 			spare->nFilledLen = 0;
 			spare->nOffset = 0;
 			OERRq(OMX_FillThisBuffer(enc, spare));
 			spare = spare->pAppPrivate;
 		}
+
+/* How long the encoder's been waiting for its buffers back: */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		schedturnaround((now.tv_sec - stamp.tv_sec) * 1000000 +
+			(now.tv_nsec - stamp.tv_nsec) / 1000);
 	} while (1);
 
 	if (oc) {
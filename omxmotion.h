@@ -66,17 +66,11 @@
 #include <arpa/inet.h>
 
 
-#define INMEMFRAMES	(128)
-#define IFRAMEAFTER	(64)
-#define DEBOUNCE	(12)
+#include "detect.h"
+#include "nal.h"
 
 
-enum recstate {
-	waiting,
-	triggered,
-	recording,
-	stopping,
-};
+#define INMEMFRAMES	(128)
 
 
 
@@ -85,7 +79,9 @@ struct frame {
 	int		len;
 	OMX_TICKS	tick;
 	int		flags;
-	time_t		time;
+	int64_t		walltime;	/* us since the epoch; see timebase.c */
+	uint16_t	hits;		/* Detector's latest, when stored */
+	uint8_t		box[4];
 };
 
 
@@ -95,44 +91,66 @@ struct context {
 	int		cocvidindex;
 	volatile int	flags;
 	OMX_BUFFERHEADERTYPE *encbufs, *bufhead;
+	struct timespec	bufstamp;	/* When bufhead was filled */
 	OMX_HANDLETYPE	clk, cam, enc, nul;
 	pthread_mutex_t	lock;
 	pthread_cond_t	cond;
 	pthread_cond_t	framecond;
 	AVBitStreamFilterContext *bsfc;
 	char		*subs;
-	enum recstate	recstate;
+	struct recsm	sm;
 	pthread_t	recthread;
+	pthread_cond_t	reccond;
+	int		recpending;
+	int		recbusy;	/* In record() */
+	int		recfinishing;	/* finishoff() threads */
+	unsigned int	recstart;	/* Pre-roll start for the pending one */
+	struct timespec	rectrigger;
+	unsigned int	reclatency;	/* Trigger to first write, us */
+	unsigned int	recmaxlatency;
 	int		width, height;
 	int		bitrate;
+	int		idlebitrate;
+	int		ratehold;
 	int		framerate;
-	int		verbosity;
 	int64_t		ptsoff;
 	char		*outdir;
-	uint8_t		*sps;
-	int		spslen;
-	uint8_t		*pps;
-	int		ppslen;
+	struct nalparams params;
 	int		waiting;
 	unsigned int	framenum;
 	unsigned int	lastiframe;
 	unsigned int	previframe;
-	char		*dumppattern;
-	int		debounce;
-	int		outro;
-	unsigned int	lastevent;
+	char		*vecfile;
 	struct frame	frames[INMEMFRAMES];
 	int		fd;
 	char		*command;
+	char		*helper;
+	int		snapwidth;
+	int		cohwindow;
+	int		camagree;
+	int		dozeframes;
+	int		dozewake;
+	char		*shmname;
+	int		httpport;
+	char		*httpaddr;	/* NULL for the loopback */
+	char		*logdest;
+	char		*buspath;
+	char		*cocurl;	/* -c, until it's opened */
 };
 #define FLAGS_VERBOSE		(1<<0)
 #define FLAGS_RECORDING		(1<<1)
 #define FLAGS_MONITOR		(1<<2)
 #define FLAGS_RAW		(1<<4)
 #define FLAGS_NOSUBS		(1<<5)
+#define FLAGS_INDEX		(1<<6)
+#define FLAGS_HEAT		(1<<7)
+#define FLAGS_DIRECT		(1<<8)
 
 
 extern struct context ctx;
 
 
+int storeframe(uint8_t **buf, off_t *len, OMX_TICKS tick, int flags);
+
+
 #endif /* __OMXMOTION_H */
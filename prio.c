@@ -0,0 +1,270 @@
+/* prio.c */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Thread priorities and CPU affinity, by role.
+ *
+ * -P takes a comma-separated list of role=setting, where role is one of
+ * capture, detect, record, hook, monitor, snapshot, http or log, and
+ * setting is "fifo:N" for SCHED_FIFO priority N, "nice:N" for an ordinary
+ * thread at nice N, or "other", optionally followed by "@cpus": a CPU
+ * number, a range, or several joined with '+'.  For example:
+ *
+ *   -P capture=fifo:40@0,detect=nice:-5@1,record=nice:5@2+3,hook=nice:19@3
+ *
+ * Each thread applies its own role when it starts; roles which aren't
+ * mentioned are left as they are (so inherit from whoever started them).
+ * Hook commands inherit the hook thread's settings.  SCHED_FIFO needs
+ * root or CAP_SYS_NICE.
+ *
+ * The capture loop also reports how long each batch of encoder buffers
+ * spends with us before being handed back, so the effect can be seen.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "prio.h"
+
+static const char *rolenames[ROLES] = {
+	"capture", "detect", "record", "hook", "monitor", "snapshot",
+	"http", "log"
+};
+
+#define JITTERBUCKETS	(24)	/* Powers of two of us; up to 8s */
+
+
+
+static struct {
+	struct {
+		int		set;
+		int		policy;
+		int		prio;		/* SCHED_FIFO priority or nice */
+		int		hascpus;
+		cpu_set_t	cpus;
+	} roles[ROLES];
+
+	pthread_mutex_t		lock;
+	unsigned int		count;
+	uint64_t		sum, sumsq;
+	unsigned int		max;
+	unsigned int		buckets[JITTERBUCKETS];
+} sc = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+
+
+static int parsecpus(const char *s, cpu_set_t *cpus)
+{
+	char *end;
+	long a, b;
+
+	CPU_ZERO(cpus);
+	while (*s) {
+		a = strtol(s, &end, 10);
+		if (end == s || a < 0 || a >= CPU_SETSIZE)
+			return -1;
+		b = a;
+		if (*end == '-') {
+			s = end + 1;
+			b = strtol(s, &end, 10);
+			if (end == s || b < a || b >= CPU_SETSIZE)
+				return -1;
+		}
+		for (; a <= b; a++)
+			CPU_SET(a, cpus);
+		if (*end == '+')
+			end++;
+		else if (*end)
+			return -1;
+		s = end;
+	}
+
+	return 0;
+}
+
+
+
+static int parseone(char *item)
+{
+	char *setting, *cpus, *end;
+	int r;
+
+	setting = strchr(item, '=');
+	if (!setting)
+		return -1;
+	*setting++ = '\0';
+	for (r = 0; r < ROLES; r++)
+		if (strcmp(item, rolenames[r]) == 0)
+			break;
+	if (r == ROLES)
+		return -1;
+
+	cpus = strchr(setting, '@');
+	if (cpus) {
+		*cpus++ = '\0';
+		if (parsecpus(cpus, &sc.roles[r].cpus) != 0)
+			return -1;
+		sc.roles[r].hascpus = 1;
+	}
+
+	if (strncmp(setting, "fifo:", 5) == 0) {
+		sc.roles[r].policy = SCHED_FIFO;
+		sc.roles[r].prio = strtol(&setting[5], &end, 10);
+		if (*end || sc.roles[r].prio < sched_get_priority_min(SCHED_FIFO)
+			|| sc.roles[r].prio > sched_get_priority_max(SCHED_FIFO))
+			return -1;
+	} else if (strncmp(setting, "nice:", 5) == 0) {
+		sc.roles[r].policy = SCHED_OTHER;
+		sc.roles[r].prio = strtol(&setting[5], &end, 10);
+		if (*end || sc.roles[r].prio < -20 || sc.roles[r].prio > 19)
+			return -1;
+	} else if (strcmp(setting, "other") == 0 || (!*setting && cpus)) {
+		sc.roles[r].policy = SCHED_OTHER;
+		sc.roles[r].prio = 0;
+	} else {
+		return -1;
+	}
+	sc.roles[r].set = 1;
+
+	return 0;
+}
+
+
+
+int schedparse(const char *spec)
+{
+	char *s, *item, *save;
+	int r = 0;
+
+	s = strdup(spec);
+	for (item = strtok_r(s, ",", &save); item;
+		item = strtok_r(NULL, ",", &save)) {
+		if (parseone(item) != 0) {
+			fprintf(stderr, "Bad scheduling setting '%s'\n", item);
+			r = -1;
+			break;
+		}
+	}
+	free(s);
+
+	return r;
+}
+
+
+
+/* Apply role to the calling thread: */
+void schedthread(enum schedrole role)
+{
+	struct sched_param sp;
+	int r;
+
+	if (!sc.roles[role].set)
+		return;
+
+	memset(&sp, 0, sizeof(sp));
+	sp.sched_priority = sc.roles[role].policy == SCHED_FIFO ?
+		sc.roles[role].prio : 0;
+	r = pthread_setschedparam(pthread_self(), sc.roles[role].policy, &sp);
+	if (r != 0)
+		fprintf(stderr, "Failed to set %s thread's scheduling: %s\n",
+			rolenames[role], strerror(r));
+	if (sc.roles[role].policy != SCHED_FIFO &&
+		setpriority(PRIO_PROCESS, syscall(SYS_gettid),
+			sc.roles[role].prio) != 0)	/* Per-thread on Linux */
+		fprintf(stderr, "Failed to renice %s thread: %s\n",
+			rolenames[role], strerror(errno));
+
+	if (sc.roles[role].hascpus) {
+		r = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+			&sc.roles[role].cpus);
+		if (r != 0)
+			fprintf(stderr, "Failed to set %s thread's CPUs: %s\n",
+				rolenames[role], strerror(r));
+	}
+}
+
+
+
+/*
+ * Called from the capture loop with the time a batch of encoder buffers
+ * spent waiting for us to hand them back.
+ */
+void schedturnaround(unsigned int us)
+{
+	int b = 0;
+
+	while (b < JITTERBUCKETS - 1 && (1u << b) <= us)
+		b++;
+
+	pthread_mutex_lock(&sc.lock);
+	sc.count++;
+	sc.sum += us;
+	sc.sumsq += (uint64_t) us * us;
+	if (us > sc.max)
+		sc.max = us;
+	sc.buckets[b]++;
+	pthread_mutex_unlock(&sc.lock);
+}
+
+
+
+void getjitter(struct jitterstats *js, int reset)
+{
+	unsigned int n, target;
+	double mean;
+	int b;
+
+	memset(js, 0, sizeof(*js));
+	pthread_mutex_lock(&sc.lock);
+	if (sc.count) {
+		mean = (double) sc.sum / sc.count;
+		js->count = sc.count;
+		js->mean = mean;
+		js->stddev = sqrt(fmax(0, (double) sc.sumsq / sc.count -
+			mean * mean));
+		js->max = sc.max;
+		target = sc.count - sc.count / 100;
+		for (b = 0, n = 0; b < JITTERBUCKETS; b++) {
+			n += sc.buckets[b];
+			if (n >= target)
+				break;
+		}
+		js->p99 = 1u << b;
+	}
+	if (reset) {
+		sc.count = 0;
+		sc.sum = sc.sumsq = 0;
+		sc.max = 0;
+		memset(sc.buckets, 0, sizeof(sc.buckets));
+	}
+	pthread_mutex_unlock(&sc.lock);
+}
@@ -0,0 +1,50 @@
+/* prio.h */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PRIO_H
+#define __PRIO_H
+
+#include <stdint.h>
+
+enum schedrole {
+	ROLE_CAPTURE,
+	ROLE_DETECT,
+	ROLE_RECORD,
+	ROLE_HOOK,
+	ROLE_MONITOR,
+	ROLE_SNAPSHOT,
+	ROLE_HTTP,
+	ROLE_LOG,
+	ROLES
+};
+
+struct jitterstats {
+	unsigned int	count;
+	unsigned int	mean;		/* us */
+	unsigned int	stddev;
+	unsigned int	p99;		/* Upper bound, to a power of two */
+	unsigned int	max;
+};
+
+int schedparse(const char *spec);
+void schedthread(enum schedrole);
+void schedturnaround(unsigned int us);
+void getjitter(struct jitterstats *, int reset);
+
+#endif /* __PRIO_H */
@@ -0,0 +1,153 @@
+/* ratectl.c */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Motion-driven bitrate switching.
+ *
+ * While nothing's happening, there's no point filling the ring and the
+ * -c stream at the full -b rate.  Once we've been waiting for more than
+ * hold frames since the detector last changed its mind, the encoder is
+ * dropped to the -B rate; as soon as the detector reports movement, it's
+ * put back, before the debounce has even finished.  Only the pre-roll
+ * ends up at the lower rate; everything from the motion onwards is at
+ * full quality.  It stays up for as long as we aren't waiting, whether
+ * or not the detector said anything, so a recording forced over -S is
+ * at full quality too.
+ *
+ * The only thing in here that talks to the hardware is OMX_SetConfig(),
+ * which goes through the component's own SetConfig pointer, and nothing
+ * here touches ctx; ratetest drives it against a stub component that
+ * just records calls.  We hold our own lock across it, never ctx.lock,
+ * which the OMX callbacks want.
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include "OMX_Core.h"
+#include "OMX_Video.h"
+#include "OMX_Index.h"
+#include "ratectl.h"
+#include "log.h"
+
+
+
+static struct {
+	pthread_mutex_t		lock;
+	OMX_HANDLETYPE		enc;
+	int			port;
+	int			high, low;
+	int			hold;
+	int			current;
+	unsigned int		changes;
+} rc;
+
+
+
+static void setrate(int bps)
+{
+	OMX_VIDEO_CONFIG_BITRATETYPE	br;
+	OMX_ERRORTYPE			oerr;
+
+	memset(&br, 0, sizeof(br));
+	br.nSize = sizeof(br);
+	br.nVersion.s.nVersionMajor = 1;
+	br.nVersion.s.nVersionMinor = 1;
+	br.nVersion.s.nRevision = 2;
+	br.nPortIndex = rc.port;
+	br.nEncodeBitrate = bps;
+
+	oerr = OMX_SetConfig(rc.enc, OMX_IndexConfigVideoBitrate, &br);
+	if (oerr != OMX_ErrorNone) {
+		logmsg(V_ERROR, "Failed to set bitrate to %d: %x\n", bps, oerr);
+		return;
+	}
+	rc.current = bps;
+	rc.changes++;
+	logmsg(V_INFO, "Encoder bitrate now %d kb/s\n", bps / 1024);
+}
+
+
+
+/* Disabled unless low is set, and below high; high is reported regardless. */
+int initratectl(OMX_HANDLETYPE enc, int port, int high, int low, int hold)
+{
+	memset(&rc, 0, sizeof(rc));
+	rc.current = high;
+	if (low <= 0 || low >= high)
+		return 0;
+
+	pthread_mutex_init(&rc.lock, NULL);
+	rc.enc = enc;
+	rc.port = port;
+	rc.high = high;
+	rc.low = low;
+	rc.hold = hold;
+
+	return 0;
+}
+
+
+
+/* From motioncallback(), on the detection thread: */
+void ratemotion(enum movementevents state)
+{
+	if (!rc.enc || state != movement)
+		return;
+
+	pthread_mutex_lock(&rc.lock);
+	if (rc.current != rc.high)
+		setrate(rc.high);
+	pthread_mutex_unlock(&rc.lock);
+}
+
+
+
+/*
+ * From checkstate(), on the capture thread, once per frame.  Anything but
+ * waiting -- a recording forced over -S, say, with no movement event --
+ * gets the high rate; a refused change is retried on the next frame.
+ */
+void rateframe(unsigned int framenum, unsigned int lastevent, int waiting)
+{
+	if (!rc.enc)
+		return;
+	if (!waiting) {
+		if (rc.current == rc.high)
+			return;
+		pthread_mutex_lock(&rc.lock);
+		if (rc.current != rc.high)
+			setrate(rc.high);
+		pthread_mutex_unlock(&rc.lock);
+		return;
+	}
+	if (rc.current == rc.low || framenum - lastevent <= rc.hold)
+		return;
+
+	pthread_mutex_lock(&rc.lock);
+	if (rc.current != rc.low)
+		setrate(rc.low);
+	pthread_mutex_unlock(&rc.lock);
+}
+
+
+
+int currentrate(void)
+{
+	return rc.current;
+}
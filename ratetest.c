@@ -0,0 +1,216 @@
+/* ratetest.c
+ *
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * Usage: ./ratetest
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Drives ratectl.c through quiet spells, movement and recordings against
+ * a stub encoder component whose SetConfig just records what it was
+ * asked for, and checks the bitrate changes come when they should and
+ * only then.  No camera or GPU needed; exits non-zero on any mismatch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "OMX_Core.h"
+#include "OMX_Component.h"
+#include "OMX_Video.h"
+#include "OMX_Index.h"
+#include "ratectl.h"
+#include "log.h"
+
+#define HIGH		(17000000)
+#define LOW		(2000000)
+#define HOLD		(10)
+#define PORT		(201)
+#define MAXCALLS	(16)
+
+static struct {
+	int		rates[MAXCALLS];
+	int		ncalls;
+	int		fail;		/* Refuse the next n calls */
+	int		bad;		/* Malformed or unexpected calls */
+} stub;
+
+static int failures;
+
+
+
+static OMX_ERRORTYPE stubsetconfig(OMX_HANDLETYPE h, OMX_INDEXTYPE index,
+	OMX_PTR p)
+{
+	OMX_VIDEO_CONFIG_BITRATETYPE *br = p;
+
+	if (index != OMX_IndexConfigVideoBitrate || br->nSize != sizeof(*br) ||
+		br->nPortIndex != PORT || stub.ncalls == MAXCALLS) {
+		stub.bad++;
+		return OMX_ErrorUndefined;
+	}
+	if (stub.fail) {
+		stub.fail--;
+		return OMX_ErrorUndefined;
+	}
+	stub.rates[stub.ncalls++] = br->nEncodeBitrate;
+
+	return OMX_ErrorNone;
+}
+
+
+
+/* What's been set since last time, in order, against what should have: */
+static void expect(const char *what, int n, ...)
+{
+	va_list	ap;
+	int	i, ok = stub.ncalls == n && !stub.bad;
+
+	va_start(ap, n);
+	for (i = 0; i < n && ok; i++)
+		ok = stub.rates[i] == va_arg(ap, int);
+	va_end(ap);
+
+	printf("%-40s %s\n", what, ok ? "ok" : "FAILED");
+	if (!ok) {
+		for (i = 0; i < stub.ncalls; i++)
+			printf("\tset %d\n", stub.rates[i]);
+		if (stub.bad)
+			printf("\t%d bad calls\n", stub.bad);
+		failures++;
+	}
+	memset(&stub, 0, sizeof(stub));
+}
+
+
+
+/* Frames from..to inclusive, with the last event at lastevent: */
+static void frames(unsigned int from, unsigned int to,
+	unsigned int lastevent, int waiting)
+{
+	unsigned int f;
+
+	for (f = from; ; f++) {
+		rateframe(f, lastevent, waiting);
+		if (f == to)
+			break;
+	}
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	OMX_COMPONENTTYPE	enc;
+
+	memset(&enc, 0, sizeof(enc));
+	enc.nSize = sizeof(enc);
+	enc.SetConfig = stubsetconfig;
+	initlog(NULL, V_ERROR);
+
+/* Disabled: nothing's ever set, and the -b rate is reported: */
+	initratectl(&enc, PORT, HIGH, 0, HOLD);
+	frames(0, 100, 0, 1);
+	ratemotion(movement);
+	expect("disabled without a low rate", 0);
+	if (currentrate() != HIGH) {
+		printf("currentrate() %d while disabled\n", currentrate());
+		failures++;
+	}
+	initratectl(&enc, PORT, HIGH, HIGH, HOLD);
+	frames(0, 100, 0, 1);
+	expect("disabled with low >= high", 0);
+
+	initratectl(&enc, PORT, HIGH, LOW, HOLD);
+	frames(0, HOLD, 0, 1);
+	expect("held for hold frames", 0);
+	frames(HOLD + 1, HOLD + 1, 0, 1);
+	expect("dropped after hold frames", 1, LOW);
+	frames(HOLD + 2, 200, 0, 1);
+	expect("dropped only once", 0);
+	if (currentrate() != LOW) {
+		printf("currentrate() %d after dropping\n", currentrate());
+		failures++;
+	}
+
+	ratemotion(quiescent);
+	expect("quiescence doesn't raise it", 0);
+	ratemotion(movement);
+	expect("movement raises it at once", 1, HIGH);
+	ratemotion(movement);
+	expect("raised only once", 0);
+
+/* Recording, and the outro after motion stops, stay at the high rate: */
+	frames(201, 400, 201, 0);
+	expect("held while recording", 0);
+	ratemotion(quiescent);
+	frames(401, 500, 450, 0);
+	expect("held while stopping", 0);
+
+/* Back to waiting; hold counts from the last event, not the stop: */
+	frames(501, 501, 450, 1);
+	expect("dropped as soon as it stops", 1, LOW);
+	frames(502, 600, 450, 1);
+	expect("dropped only once", 0);
+
+/* Movement inside the hold: straight back up, then the hold restarts: */
+	ratemotion(movement);
+	frames(601, 601 + HOLD, 601, 1);
+	expect("raised, then held again", 1, HIGH);
+	frames(602 + HOLD, 602 + HOLD, 601, 1);
+	expect("dropped again", 1, LOW);
+
+/* A refused change is retried on the next frame: */
+	ratemotion(movement);
+	expect("raised", 1, HIGH);
+	stub.fail = 1;
+	frames(700, 700, 601, 1);
+	expect("refused", 0);
+	if (currentrate() != HIGH) {
+		printf("currentrate() %d after a refusal\n", currentrate());
+		failures++;
+	}
+	frames(701, 701, 601, 1);
+	expect("retried", 1, LOW);
+
+/* Forced over -S, with no movement event; the state alone raises it: */
+	frames(702, 702, 601, 0);
+	expect("raised by a forced recording", 1, HIGH);
+	frames(703, 800, 601, 0);
+	expect("raised only once", 0);
+	frames(801, 801, 601, 1);
+	expect("dropped when it stops", 1, LOW);
+	stub.fail = 1;
+	frames(802, 802, 601, 0);
+	expect("refused while recording", 0);
+	frames(803, 803, 601, 0);
+	expect("retried while recording", 1, HIGH);
+	frames(804, 804, 601, 1);
+	expect("dropped again", 1, LOW);
+
+/* Frame numbers wrap: */
+	ratemotion(movement);
+	frames(0xfffffffa, 0xfffffffa + HOLD, 0xfffffffa, 1);
+	expect("held across a wrap", 1, HIGH);
+	frames(0xfffffffb + HOLD, 0xfffffffb + HOLD, 0xfffffffa, 1);
+	expect("dropped across a wrap", 1, LOW);
+
+	printf("%s\n", failures ? "FAILED" : "All ok");
+
+	return failures ? 1 : 0;
+}
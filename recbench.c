@@ -0,0 +1,264 @@
+/* recbench.c
+ *
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * Usage: ./recbench [-b bitrate] [-d] [-k] [-r rate] [-s seconds] file
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Writes a recording's worth of frame-sized chunks to a file as fast as
+ * it'll go, first as avio would (a write() per 32k, the file growing as
+ * it goes), then through recio.c, and reports the throughput and how
+ * long each write() took.  Point it at the card the recordings go to.
+ *
+ * At each I-frame it goes back and fills in eight bytes at the start of
+ * the last one, as matroska does with a cluster's size.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "recio.h"
+
+#define AVIOBUF		(32768)		/* avio's default */
+#define BUCKETS		(24)
+#define PATCHLEN	(8)
+
+extern char *optarg;
+extern int optind;
+
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-b bitrate] [-d] [-k] [-r rate] "
+		"[-s seconds] file\n\n"
+		"Where:\n"
+	"\t-b bitrate\tBitrate to simulate (Mb/s; default 17)\n"
+	"\t-d\t\tUse O_DIRECT for the recio pass\n"
+	"\t-k\t\tKeep the file afterwards\n"
+	"\t-r rate\t\tFramerate (default 25)\n"
+	"\t-s seconds\tLength of the recording (default 60)\n"
+		"\n", name);
+	exit(1);
+}
+
+
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+
+/* An I-frame every second, eight times the size of the P-frames: */
+static int framesize(int i, int rate, int bitrate)
+{
+	int p = (int) ((double) bitrate / 8 * rate / (rate + 7) / rate);
+
+	return (i % rate) == 0 ? p * 8 : p;
+}
+
+
+
+static unsigned int percentile(const unsigned int *buckets, unsigned int n,
+	unsigned int target)
+{
+	unsigned int c = 0;
+	int b;
+
+	for (b = 0; b < BUCKETS; b++) {
+		c += buckets[b];
+		if (c >= target)
+			break;
+	}
+
+	return 1u << b;
+}
+
+
+
+/* avio's way: */
+static int plain(const char *fn, const uint8_t *frame, int frames, int rate,
+	int bitrate, double *secs)
+{
+	uint8_t		*buf;
+	int		fd, i, len = 0, b;
+	unsigned int	buckets[BUCKETS], writes = 0, max = 0;
+	uint64_t	bytes = 0, cluster = 0;
+	double		t0, t1, t;
+
+	fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1)
+		return -1;
+	buf = malloc(AVIOBUF);
+	memset(buckets, 0, sizeof(buckets));
+
+	t0 = now();
+	for (i = 0; i < frames; i++) {
+		int n = framesize(i, rate, bitrate), done = 0;
+
+/* avio writes out what it has before seeking: */
+		if (i && (i % rate) == 0) {
+			if (len && write(fd, buf, len) != len)
+				return -1;
+			len = 0;
+			if (pwrite(fd, frame, PATCHLEN, cluster) != PATCHLEN)
+				return -1;
+			cluster = bytes;
+		}
+		while (done < n) {
+			int c = n - done;
+
+			if (c > AVIOBUF - len)
+				c = AVIOBUF - len;
+			memcpy(&buf[len], &frame[done], c);
+			len += c;
+			done += c;
+			if (len < AVIOBUF)
+				continue;
+			t = now();
+			if (write(fd, buf, len) != len)
+				return -1;
+			t1 = (now() - t) * 1e6;
+			for (b = 0; b < BUCKETS - 1 && (1u << b) <= t1; b++)
+				;
+			buckets[b]++;
+			writes++;
+			if (t1 > max)
+				max = t1;
+			len = 0;
+		}
+		bytes += n;
+	}
+	if (len && write(fd, buf, len) != len)
+		return -1;
+	fsync(fd);
+	close(fd);
+	*secs = now() - t0;
+	free(buf);
+
+	printf("avio   %8.1f MB/s  %6u writes  p50 < %uus  p99 < %uus  "
+		"max %uus\n", bytes / *secs / 1e6, writes,
+		percentile(buckets, writes, (writes + 1) / 2),
+		percentile(buckets, writes, writes - writes / 100), max);
+
+	return 0;
+}
+
+
+
+static int recio(const char *fn, const uint8_t *frame, int frames, int rate,
+	int bitrate, int flags, double *secs)
+{
+	struct recio	*r;
+	struct riostats	rs;
+	int		i;
+	int64_t		cluster = 0;
+	double		t0;
+
+	t0 = now();
+	r = rioopen(fn, (int64_t) bitrate / 8 * frames / rate, flags);
+	if (!r)
+		return -1;
+	for (i = 0; i < frames; i++) {
+		if (i && (i % rate) == 0) {
+			if (rioseek(r, cluster, SEEK_SET) < 0 ||
+				riowrite(r, frame, PATCHLEN) < 0)
+				return -1;
+			cluster = rioseek(r, 0, SEEK_END);
+		}
+		if (riowrite(r, frame, framesize(i, rate, bitrate)) < 0)
+			return -1;
+	}
+	if (rioclose(r, &rs) != 0)
+		return -1;
+	*secs = now() - t0;
+
+	printf("recio  %8.1f MB/s  %6u writes  p50 < %uus  p99 < %uus  "
+		"max %uus  %u patched%s\n", rs.bytes / *secs / 1e6, rs.writes,
+		rs.p50, rs.p99, rs.max, rs.patches,
+		rs.direct ? "  (O_DIRECT)" : "");
+
+	return 0;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	uint8_t		*frame;
+	int		opt, i;
+	int		bitrate = 17 * 1024 * 1024;
+	int		rate = 25, seconds = 60;
+	int		flags = 0, keep = 0;
+	double		secs;
+
+	while ((opt = getopt(argc, argv, "b:dhkr:s:")) != -1) {
+		switch (opt) {
+		case 'b':
+			bitrate = atof(optarg) * 1024 * 1024;
+			break;
+		case 'd':
+			flags |= RIO_DIRECT;
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || bitrate <= 0 || rate <= 0 || seconds <= 0)
+		usage(argv[0]);
+
+	frame = malloc(framesize(0, rate, bitrate));
+	for (i = 0; i < framesize(0, rate, bitrate); i++)
+		frame[i] = random();
+
+	printf("%d frames, %.1f MB\n", seconds * rate,
+		(double) bitrate / 8 * seconds / 1e6);
+	if (plain(argv[optind], frame, seconds * rate, rate, bitrate,
+		&secs) != 0 ||
+		recio(argv[optind], frame, seconds * rate, rate, bitrate,
+		flags, &secs) != 0) {
+		fprintf(stderr, "Failed to write %s: %s\n", argv[optind],
+			strerror(errno));
+		exit(1);
+	}
+
+	if (!keep)
+		unlink(argv[optind]);
+	free(frame);
+
+	return 0;
+}
@@ -0,0 +1,406 @@
+/* recio.c */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Recording output, tuned for SD cards.
+ *
+ * Left to itself, avio hands the kernel a write per 32k buffer, the file
+ * grows a little at a time, and the page cache fills with video nobody
+ * will read back until, every so often, it all goes to the card at once.
+ * Cards don't much like any of that: small writes cost a whole erase
+ * block's worth of work inside the card, and months of files growing in
+ * parallel with the journal and the .act files leave them in pieces.
+ *
+ * So here the muxer's output is collected into RIOBUF-sized, aligned
+ * buffers, each written at an aligned offset in one go -- optionally with
+ * O_DIRECT, bypassing the page cache altogether.  Otherwise, each buffer
+ * is pushed to the card as soon as it's written, and dropped from the
+ * cache once it's there.  Space is reserved up front with fallocate(),
+ * expect bytes at a time, so the file system can find it in one piece,
+ * and what isn't used is given back when the file is closed.
+ *
+ * The muxer seeks back now and then -- matroska does at the end of every
+ * cluster, so at every keyframe, to fill in its size, and again at the
+ * end for the segment and the cues -- and writes a few bytes.  If they're
+ * still in the buffer they're patched there; if they've gone, they're
+ * written through a second, ordinary descriptor when O_DIRECT is in use,
+ * which the kernel keeps coherent with the first.  Either way the next
+ * write at the end carries on filling the buffer where it left off.  A
+ * seek past the end is filled with zeroes, as the file system would.
+ *
+ * This doesn't depend on libav; the AVIOContext is wrapped around it in
+ * omxmotion.c, and recbench uses it directly.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "recio.h"
+
+#define RIOBUF		(1 << 20)	/* Bytes per write */
+#define RIOALIGN	(4096)
+#define RIOBUCKETS	(24)		/* Powers of two of us */
+
+struct recio {
+	int		fd;
+	int		pfd;		/* For patches, when fd is O_DIRECT */
+	int		flags;
+	uint8_t		*buf;
+	int		len;		/* Bytes in buf */
+	int64_t		bufpos;		/* File offset of buf[0] */
+	int64_t		pos;		/* Where the next write goes */
+	int64_t		size;		/* Always bufpos + len */
+	int64_t		alloc;		/* Reserved up to here */
+	int64_t		step;
+	int		failed;
+	struct timespec	opened;
+	unsigned int	writes;
+	unsigned int	patches;
+	unsigned int	max;
+	unsigned int	buckets[RIOBUCKETS];
+};
+
+
+
+static unsigned int since(const struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) * 1000000 +
+		(t1.tv_nsec - t0->tv_nsec) / 1000;
+}
+
+
+
+struct recio *rioopen(const char *fn, int64_t expect, int flags)
+{
+	struct recio	*r;
+	int		of = O_WRONLY | O_CREAT | O_TRUNC;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	if (posix_memalign((void **) &r->buf, RIOALIGN, RIOBUF) != 0) {
+		free(r);
+		return NULL;
+	}
+
+	r->fd = -1;
+	r->pfd = -1;
+	if (flags & RIO_DIRECT) {
+		r->fd = open(fn, of | O_DIRECT, 0666);
+		if (r->fd != -1)
+			r->pfd = open(fn, O_WRONLY);
+		if (r->pfd == -1 && r->fd != -1) {
+			close(r->fd);
+			r->fd = -1;
+		}
+	}
+/* tmpfs, for one, won't have it: */
+	if (r->fd == -1) {
+		flags &= ~RIO_DIRECT;
+		r->fd = open(fn, of, 0666);
+	}
+	if (r->fd == -1) {
+		free(r->buf);
+		free(r);
+		return NULL;
+	}
+	r->flags = flags;
+
+/* Not every file system can; it's only a hint, so carry on regardless: */
+	r->step = (expect + RIOBUF - 1) & ~((int64_t) RIOBUF - 1);
+	if (r->step > 0 && fallocate(r->fd, FALLOC_FL_KEEP_SIZE, 0,
+		r->step) == 0)
+		r->alloc = r->step;
+	clock_gettime(CLOCK_MONOTONIC, &r->opened);
+
+	return r;
+}
+
+
+
+static int timedwrite(struct recio *r, const uint8_t *buf, int len,
+	int64_t off)
+{
+	struct timespec	t0;
+	unsigned int	us;
+	ssize_t		n;
+	int		b = 0, whole = len == RIOBUF;
+
+	if (r->alloc && off + len > r->alloc) {
+		if (fallocate(r->fd, FALLOC_FL_KEEP_SIZE, r->alloc,
+			r->step) == 0)
+			r->alloc += r->step;
+		else
+			r->alloc = 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (len > 0) {
+		n = pwrite(r->fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			r->failed = 1;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		off += n;
+	}
+
+/*
+ * Start this buffer on its way to the card, and wait for the last one,
+ * which should have got there by now, so its pages can be dropped.  This
+ * keeps the card busy all the time, rather than idle and then swamped.
+ */
+	if (!(r->flags & RIO_DIRECT) && whole) {
+		sync_file_range(r->fd, off - RIOBUF, RIOBUF,
+			SYNC_FILE_RANGE_WRITE);
+		if (off >= 2 * RIOBUF) {
+			sync_file_range(r->fd, off - 2 * RIOBUF, RIOBUF,
+				SYNC_FILE_RANGE_WAIT_BEFORE |
+				SYNC_FILE_RANGE_WRITE |
+				SYNC_FILE_RANGE_WAIT_AFTER);
+			posix_fadvise(r->fd, off - 2 * RIOBUF, RIOBUF,
+				POSIX_FADV_DONTNEED);
+		}
+	}
+
+	us = since(&t0);
+	while (b < RIOBUCKETS - 1 && (1u << b) <= us)
+		b++;
+	r->buckets[b]++;
+	r->writes++;
+	if (us > r->max)
+		r->max = us;
+
+	return 0;
+}
+
+
+
+/* Something already on its way to the card; only ever a few bytes: */
+static int patch(struct recio *r, const uint8_t *buf, int len, int64_t off)
+{
+	int	fd = r->pfd != -1 ? r->pfd : r->fd;
+	ssize_t	n;
+
+	while (len > 0) {
+		n = pwrite(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			r->failed = 1;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	r->patches++;
+
+	return 0;
+}
+
+
+
+/* On to the end of the buffer, writing it out as it fills; NULL for zeroes: */
+static int append(struct recio *r, const uint8_t *buf, int64_t len)
+{
+	int64_t	done = 0;
+	int	n;
+
+	while (done < len) {
+		n = RIOBUF - r->len;
+		if (n > len - done)
+			n = len - done;
+		if (buf)
+			memcpy(&r->buf[r->len], &buf[done], n);
+		else
+			memset(&r->buf[r->len], 0, n);
+		r->len += n;
+		done += n;
+		if (r->len == RIOBUF) {
+			if (timedwrite(r, r->buf, RIOBUF, r->bufpos) != 0)
+				return -1;
+			r->bufpos += RIOBUF;
+			r->len = 0;
+		}
+	}
+	r->size = r->bufpos + r->len;
+
+	return 0;
+}
+
+
+
+/* Write out whatever's buffered, when closing: */
+static int flushtail(struct recio *r)
+{
+	int aligned = r->len & ~(RIOALIGN - 1);
+	int ret = 0;
+
+	if (r->flags & RIO_DIRECT) {
+		if (aligned > 0 &&
+			timedwrite(r, r->buf, aligned, r->bufpos) != 0)
+			return -1;
+		fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL) & ~O_DIRECT);
+	} else {
+		aligned = 0;
+	}
+	if (r->len > aligned)
+		ret = timedwrite(r, &r->buf[aligned], r->len - aligned,
+			r->bufpos + aligned);
+	r->bufpos += r->len;
+	r->len = 0;
+
+	return ret;
+}
+
+
+
+int riowrite(struct recio *r, const uint8_t *buf, int len)
+{
+	int64_t	n;
+	int	done = 0;
+
+	if (r->failed)
+		return -1;
+
+/* Back over what's been written, on the card or still in the buffer: */
+	while (done < len && r->pos < r->size) {
+		if (r->pos >= r->bufpos) {
+			n = r->size - r->pos;
+			if (n > len - done)
+				n = len - done;
+			memcpy(&r->buf[r->pos - r->bufpos], &buf[done], n);
+		} else {
+			n = r->bufpos - r->pos;
+			if (n > len - done)
+				n = len - done;
+			if (patch(r, &buf[done], n, r->pos) != 0)
+				return -1;
+		}
+		r->pos += n;
+		done += n;
+	}
+	if (done == len)
+		return len;
+
+	if (r->pos > r->size && append(r, NULL, r->pos - r->size) != 0)
+		return -1;
+	if (append(r, &buf[done], len - done) != 0)
+		return -1;
+	r->pos += len - done;
+
+	return len;
+}
+
+
+
+int64_t rioseek(struct recio *r, int64_t offset, int whence)
+{
+	int64_t to;
+
+	switch (whence) {
+	case SEEK_SET:
+		to = offset;
+		break;
+	case SEEK_CUR:
+		to = r->pos + offset;
+		break;
+	case SEEK_END:
+		to = r->size + offset;
+		break;
+	default:
+		return -1;
+	}
+	if (to < 0)
+		return -1;
+	r->pos = to;
+
+	return to;
+}
+
+
+
+int64_t riosize(struct recio *r)
+{
+	return r->size;
+}
+
+
+
+int rioclose(struct recio *r, struct riostats *rs)
+{
+	struct timespec	now;
+	unsigned int	n, target;
+	int		b, ret;
+
+	ret = flushtail(r);
+/* Give back the reservation past the end: */
+	if (ftruncate(r->fd, r->size) != 0)
+		ret = -1;
+/* With O_DIRECT, only the patches and the tail went via the page cache: */
+	sync_file_range(r->fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE |
+		SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	posix_fadvise(r->fd, 0, 0, POSIX_FADV_DONTNEED);
+	if (r->pfd != -1 && close(r->pfd) != 0)
+		ret = -1;
+	if (close(r->fd) != 0 || r->failed)
+		ret = -1;
+
+	if (rs) {
+		memset(rs, 0, sizeof(*rs));
+		rs->bytes = r->size;
+		rs->writes = r->writes;
+		rs->patches = r->patches;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		rs->ms = (now.tv_sec - r->opened.tv_sec) * 1000 +
+			(now.tv_nsec - r->opened.tv_nsec) / 1000000;
+		rs->max = r->max;
+		rs->direct = !!(r->flags & RIO_DIRECT);
+		for (b = 0, n = 0; b < RIOBUCKETS && r->writes; b++) {
+			n += r->buckets[b];
+			if (!rs->p50 && n >= (r->writes + 1) / 2)
+				rs->p50 = 1u << b;
+			target = r->writes - r->writes / 100;
+			if (n >= target) {
+				rs->p99 = 1u << b;
+				break;
+			}
+		}
+	}
+
+	free(r->buf);
+	free(r);
+
+	return ret;
+}
@@ -0,0 +1,49 @@
+/* recio.h */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __RECIO_H
+#define __RECIO_H
+
+/*
+ * Recording output, tuned for SD cards.  See recio.c.
+ */
+
+#include <stdint.h>
+
+#define RIO_DIRECT	(1<<0)		/* O_DIRECT, where it's supported */
+
+struct riostats {
+	uint64_t	bytes;
+	unsigned int	writes;
+	unsigned int	patches;	/* Seeks back past the buffer */
+	unsigned int	ms;		/* Open to close */
+	unsigned int	p50, p99;	/* us per write; upper bounds */
+	unsigned int	max;
+	int		direct;		/* Whether O_DIRECT was used */
+};
+
+struct recio;
+
+struct recio *rioopen(const char *fn, int64_t expect, int flags);
+int riowrite(struct recio *, const uint8_t *buf, int len);
+int64_t rioseek(struct recio *, int64_t offset, int whence);
+int64_t riosize(struct recio *);
+int rioclose(struct recio *, struct riostats *);
+
+#endif /* __RECIO_H */
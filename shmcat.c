@@ -0,0 +1,145 @@
+/* shmcat.c
+ *
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * Usage: ./shmcat [-l] [-n frames] [-p] name > live.h264
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Example reader for omxmotion's -R shared-memory ring: writes the live
+ * H.264 to stdout as a raw Annex B stream, starting from the latest
+ * keyframe (or with -p, the one before, as a recording's pre-roll would),
+ * and following new frames as they arrive.  If it falls far enough
+ * behind to be overrun, it says so and starts again from the latest
+ * keyframe.  Frames are written straight from the segment.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "shmring.h"
+
+extern char *optarg;
+extern int optind;
+
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-l] [-n frames] [-p] name\n\n"
+		"Where:\n"
+	"\t-l\t\tList frames instead of writing them\n"
+	"\t-n frames\tStop after this many frames\n"
+	"\t-p\t\tStart from the pre-roll, not the latest keyframe\n"
+	"\tname\t\tAs passed to omxmotion -R, eg. /omxmotion\n"
+		"\n", name);
+	exit(1);
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	struct shmreader	*r;
+	struct shmframe		f;
+	int			opt, list = 0, count = -1, n = 0, lost = 0;
+	int			resync = 1;
+	int			where = SHMR_KEY;
+
+	while ((opt = getopt(argc, argv, "hln:p")) != -1) {
+		switch (opt) {
+		case 'l':
+			list = 1;
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'p':
+			where = SHMR_PREROLL;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	r = shmropen(argv[optind]);
+	if (!r) {
+		fprintf(stderr, "Failed to open %s: %s\n", argv[optind],
+			strerror(errno));
+		exit(1);
+	}
+	fprintf(stderr, "%s: %dx%d at %dfps, %u frames written\n",
+		argv[optind], r->hdr->width, r->hdr->height,
+		r->hdr->framerate, (unsigned int) r->hdr->head);
+	shmrseek(r, where);
+
+	while (count < 0 || n < count) {
+		switch (shmrnext(r, &f)) {
+		case 1:
+			shmrwait(r, 1000);
+			continue;
+		case -1:
+			fprintf(stderr, "Overrun at frame %llu; skipping to the "
+				"latest keyframe\n",
+				(unsigned long long) r->next);
+			shmrseek(r, SHMR_KEY);
+			continue;
+		}
+
+/*
+ * A keyframe before anything else, so the output can be decoded; and
+ * after omxmotion had to drop something, the same again:
+ */
+		if ((f.flags & (SHM_GAP | SHM_KEY)) == SHM_GAP) {
+			fprintf(stderr, "Frames dropped before frame %llu; "
+				"waiting for a keyframe\n",
+				(unsigned long long) f.frame);
+			resync = 1;
+		}
+		if (f.flags & SHM_KEY)
+			resync = 0;
+		if (resync)
+			continue;
+
+		if (list) {
+			printf("%8llu %14lld %7u %c\n",
+				(unsigned long long) f.frame,
+				(long long) f.tick, f.len,
+				f.flags & SHM_KEY ? 'K' : ' ');
+		} else {
+			if (fwrite(f.buf, 1, f.len, stdout) != f.len)
+				break;
+/* Too late to unwrite it; the decoder will have to cope: */
+			if (shmrcheck(r, &f) != 0)
+				lost++;
+		}
+		n++;
+	}
+
+	fflush(stdout);
+	fprintf(stderr, "%d frames, %u overruns, %d overwritten while being "
+		"written out, %u too big for the ring\n", n, r->overruns, lost,
+		r->hdr->dropped);
+	shmrclose(r);
+
+	return 0;
+}
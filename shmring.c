@@ -0,0 +1,309 @@
+/* shmring.c */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Shared-memory frame ring; see shmring.h for the protocol.
+ *
+ * Like mvrec.c, this doesn't depend on OpenMAX, so readers can link it
+ * on its own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shmring.h"
+
+#define load(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+
+
+static struct {
+	struct shmheader	*hdr;
+	struct shmslot		*slots;
+	uint8_t			*data;
+	size_t			maplen;
+	uint64_t		mask;
+	int			gap;
+	char			name[256];
+} wctx;
+
+
+
+int shmwopen(const char *name, int width, int height, int framerate,
+	size_t datasize)
+{
+	size_t	size;
+	int	fd;
+
+/* Round up to a power of two: */
+	for (size = 1 << 20; size < datasize; size <<= 1)
+		;
+
+	memset(&wctx, 0, sizeof(wctx));
+	snprintf(wctx.name, sizeof(wctx.name), "%s", name);
+	wctx.maplen = sizeof(struct shmheader) +
+		SHM_SLOTS * sizeof(struct shmslot) + size;
+	wctx.mask = size - 1;
+
+	shm_unlink(name);
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd == -1)
+		return -1;
+	if (ftruncate(fd, wctx.maplen) != 0) {
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+	wctx.hdr = mmap(NULL, wctx.maplen, PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	close(fd);
+	if (wctx.hdr == MAP_FAILED) {
+		wctx.hdr = NULL;
+		shm_unlink(name);
+		return -1;
+	}
+	wctx.slots = (struct shmslot *) &wctx.hdr[1];
+	wctx.data = (uint8_t *) &wctx.slots[SHM_SLOTS];
+
+	wctx.hdr->hdrsize = sizeof(struct shmheader);
+	wctx.hdr->slotsize = sizeof(struct shmslot);
+	wctx.hdr->slots = SHM_SLOTS;
+	wctx.hdr->datasize = size;
+	wctx.hdr->width = width;
+	wctx.hdr->height = height;
+	wctx.hdr->framerate = framerate;
+	wctx.hdr->created = time(NULL);
+	wctx.hdr->lastkey = wctx.hdr->prevkey = SHM_NOKEY;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(wctx.hdr->magic, SHM_MAGIC, sizeof(wctx.hdr->magic));
+
+	return 0;
+}
+
+
+
+/*
+ * Called from the capture loop for every frame stored.  Never waits; a
+ * frame too big for the data ring is dropped and counted, and the next
+ * one is marked SHM_GAP.
+ */
+void shmwframe(const uint8_t *buf, int len, int64_t tick, int64_t walltime,
+	int key)
+{
+	struct shmheader	*h = wctx.hdr;
+	struct shmslot		*s;
+	uint64_t		n, pos;
+
+	if (!h)
+		return;
+	if (len > h->datasize) {
+		store(&h->dropped, h->dropped + 1);
+		wctx.gap = 1;
+		return;
+	}
+
+	n = h->head;
+	s = &wctx.slots[n & (SHM_SLOTS - 1)];
+	pos = h->datahead;
+/* Frames are never split across the end of the ring: */
+	if ((pos & wctx.mask) + len > h->datasize)
+		pos += h->datasize - (pos & wctx.mask);
+
+	__atomic_store_n(&s->seq, 2 * n + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->datahead, pos + len, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy(&wctx.data[pos & wctx.mask], buf, len);
+	s->frame = n;
+	s->offset = pos;
+	s->len = len;
+	s->flags = (key ? SHM_KEY : 0) | (wctx.gap ? SHM_GAP : 0);
+	wctx.gap = 0;
+	s->tick = tick;
+	s->time = walltime;
+	store(&s->seq, 2 * n + 2);
+
+	if (key) {
+		store(&h->prevkey, h->lastkey);
+		store(&h->lastkey, n);
+	}
+	store(&h->head, n + 1);
+}
+
+
+
+void shmwclose(void)
+{
+	if (!wctx.hdr)
+		return;
+	munmap(wctx.hdr, wctx.maplen);
+	shm_unlink(wctx.name);
+	wctx.hdr = NULL;
+}
+
+
+
+/* Reader: */
+
+struct shmreader *shmropen(const char *name)
+{
+	struct shmreader	*r;
+	struct stat		st;
+	int			fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(struct shmheader)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	r = calloc(1, sizeof(*r));
+	r->maplen = st.st_size;
+	r->hdr = mmap(NULL, r->maplen, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r->hdr == MAP_FAILED) {
+		free(r);
+		return NULL;
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (memcmp(r->hdr->magic, SHM_MAGIC, sizeof(r->hdr->magic)) != 0 ||
+		r->hdr->hdrsize != sizeof(struct shmheader) ||
+		r->hdr->slotsize != sizeof(struct shmslot) ||
+		r->hdr->slots != SHM_SLOTS ||
+		r->maplen < sizeof(struct shmheader) +
+			SHM_SLOTS * sizeof(struct shmslot) +
+			r->hdr->datasize) {
+		munmap(r->hdr, r->maplen);
+		free(r);
+		errno = EINVAL;
+		return NULL;
+	}
+	r->slots = (struct shmslot *) &r->hdr[1];
+	r->data = (const uint8_t *) &r->slots[SHM_SLOTS];
+	shmrseek(r, SHMR_LIVE);
+
+	return r;
+}
+
+
+
+void shmrseek(struct shmreader *r, int where)
+{
+	uint64_t k = SHM_NOKEY;
+
+	if (where == SHMR_PREROLL)
+		k = load(&r->hdr->prevkey);
+	if (where == SHMR_KEY || (where == SHMR_PREROLL && k == SHM_NOKEY))
+		k = load(&r->hdr->lastkey);
+	r->next = k != SHM_NOKEY ? k : load(&r->hdr->head);
+}
+
+
+
+/*
+ * Is a frame's data still intact?  Call after using it; if this fails,
+ * whatever was read from f->buf may be garbage.
+ */
+int shmrcheck(const struct shmreader *r, const struct shmframe *f)
+{
+	uint64_t head;
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	head = __atomic_load_n(&r->hdr->datahead, __ATOMIC_RELAXED);
+
+	return head - f->offset > r->hdr->datasize ? -1 : 0;
+}
+
+
+
+/*
+ * The next frame: 0 if there is one, 1 if the writer hasn't got there
+ * yet, or -1 if it's been and gone: overrun.  After an overrun, seek.
+ */
+int shmrnext(struct shmreader *r, struct shmframe *f)
+{
+	struct shmslot	*s;
+	uint64_t	head, seq;
+
+	head = load(&r->hdr->head);
+	if (r->next >= head)
+		return 1;
+	if (head - r->next > SHM_SLOTS)
+		goto overrun;
+
+	s = &r->slots[r->next & (SHM_SLOTS - 1)];
+	seq = load(&s->seq);
+	if (seq != 2 * r->next + 2)
+		goto overrun;
+	f->frame = s->frame;
+	f->offset = s->offset;
+	f->len = s->len;
+	f->flags = s->flags;
+	f->tick = s->tick;
+	f->time = s->time;
+	f->buf = &r->data[f->offset & (r->hdr->datasize - 1)];
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq ||
+		shmrcheck(r, f) != 0)
+		goto overrun;
+
+	r->next++;
+	return 0;
+
+overrun:
+	r->overruns++;
+	return -1;
+}
+
+
+
+/*
+ * Wait up to ms for a new frame; there's nothing to block on, so this
+ * polls, a couple of times per frame at any sensible rate.  Returns 0 if
+ * there's one, 1 if not.
+ */
+int shmrwait(struct shmreader *r, int ms)
+{
+	while (load(&r->hdr->head) <= r->next) {
+		if (ms <= 0)
+			return 1;
+		usleep(2000);
+		ms -= 2;
+	}
+
+	return 0;
+}
+
+
+
+void shmrclose(struct shmreader *r)
+{
+	munmap(r->hdr, r->maplen);
+	free(r);
+}
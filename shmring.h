@@ -0,0 +1,117 @@
+/* shmring.h */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __SHMRING_H
+#define __SHMRING_H
+
+/*
+ * The frame ring, in POSIX shared memory, for other processes to read
+ * the live H.264 without going through -c.
+ *
+ * The segment is a struct shmheader, then slots struct shmslots, then
+ * datasize bytes of frame data used as a ring of its own.  There's one
+ * writer, omxmotion's capture loop, and it never waits for readers: each
+ * slot is a seqlock, odd while the writer's in it, 2n + 2 once it holds
+ * frame n; and datahead only ever grows, and is moved past a frame's
+ * bytes before they're overwritten.  A reader uses a frame in place, then
+ * checks it's still what it was (shmrcheck()); if not, it was overrun,
+ * and should pick up again from the latest keyframe.
+ *
+ * Each frame is a complete access unit, in Annex B; keyframes start with
+ * the SPS and PPS, so a reader can start at any of them.  A frame too big
+ * for the data ring never gets a slot: it's counted in dropped, and the
+ * next frame stored is marked SHM_GAP, after which a reader should skip
+ * to a keyframe.  Everything is in host byte order.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHM_MAGIC	"OMR1"
+#define SHM_SLOTS	(256)		/* Power of two */
+#define SHM_NOKEY	(~(uint64_t) 0)
+
+struct shmheader {
+	char		magic[4];	/* Written last */
+	uint16_t	hdrsize;
+	uint16_t	slotsize;
+	uint32_t	slots;
+	uint32_t	dropped;	/* Frames too big for the data ring */
+	uint64_t	datasize;	/* Power of two */
+	uint16_t	width, height;
+	uint16_t	framerate;
+	uint16_t	reserved2;
+	int64_t		created;	/* time(NULL) */
+	uint64_t	head;		/* Next frame number to be written */
+	uint64_t	lastkey;	/* Latest keyframe, or SHM_NOKEY */
+	uint64_t	prevkey;	/* The one before: the pre-roll */
+	uint64_t	datahead;	/* Bytes, ever; offsets are mod datasize */
+};
+
+struct shmslot {
+	uint64_t	seq;
+	uint64_t	frame;
+	uint64_t	offset;		/* As datahead */
+	uint32_t	len;
+	uint32_t	flags;
+#define SHM_KEY		(1<<0)
+#define SHM_GAP		(1<<1)		/* Frames were dropped before this */
+	int64_t		tick;		/* OMX timestamp, us */
+	int64_t		time;		/* Wall clock at capture, us */
+};
+
+/* Writer; used by omxmotion: */
+int shmwopen(const char *name, int width, int height, int framerate,
+	size_t datasize);
+void shmwframe(const uint8_t *buf, int len, int64_t tick, int64_t walltime,
+	int key);
+void shmwclose(void);
+
+/* Reader: */
+struct shmreader {
+	struct shmheader *hdr;
+	struct shmslot	*slots;
+	const uint8_t	*data;
+	size_t		maplen;
+	uint64_t	next;
+	unsigned int	overruns;
+};
+
+struct shmframe {
+	uint64_t	frame;
+	const uint8_t	*buf;		/* In the segment; see shmrcheck() */
+	uint32_t	len;
+	uint32_t	flags;
+	int64_t		tick;
+	int64_t		time;
+	uint64_t	offset;
+};
+
+#define SHMR_LIVE	(0)		/* The next frame written */
+#define SHMR_KEY	(1)		/* The latest keyframe */
+#define SHMR_PREROLL	(2)		/* The keyframe before that */
+
+struct shmreader *shmropen(const char *name);
+void shmrseek(struct shmreader *, int where);
+int shmrnext(struct shmreader *, struct shmframe *);
+int shmrcheck(const struct shmreader *, const struct shmframe *);
+int shmrwait(struct shmreader *, int ms);
+void shmrclose(struct shmreader *);
+
+#endif /* __SHMRING_H */
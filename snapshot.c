@@ -0,0 +1,278 @@
+/* snapshot.c */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Keyframe snapshots.
+ *
+ * When a recording starts, snapshot() copies the most recent I-frame
+ * (which carries its SPS and PPS) out of the ring, and hands it to a
+ * thread running at idle priority.  That decodes the one frame (with the
+ * loop filter off; it's a thumbnail), scales it down, and writes a JPEG
+ * next to the recording.  There's only ever one snapshot in hand: if the
+ * last one hasn't finished, the new one is skipped rather than queued,
+ * so the cost is bounded at one decode and one encode per trigger and
+ * the capture and recording threads never wait on it.
+ */
+
+#include "omxmotion.h"
+#include "snapshot.h"
+#include "prio.h"
+#include "log.h"
+#include "libswscale/swscale.h"
+#include "libavutil/imgutils.h"
+#include <sched.h>
+#include <sys/resource.h>
+
+static void *snapshotstart(void *);
+
+
+
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	pthread_t		thread;
+	int			width;
+	uint8_t			*buf;		/* Pending; NULL if none */
+	int			len;
+	char			fn[256];
+	int			busy;
+	unsigned int		skipped;
+} snap;
+
+
+
+int initsnapshot(int width)
+{
+	pthread_attr_t detach;
+
+	memset(&snap, 0, sizeof(snap));
+	snap.width = width & ~1;
+	if (snap.width <= 0)
+		return 0;
+
+	pthread_mutex_init(&snap.lock, NULL);
+	pthread_cond_init(&snap.cond, NULL);
+	pthread_attr_init(&detach);
+	pthread_attr_setdetachstate(&detach, PTHREAD_CREATE_DETACHED);
+	pthread_create(&snap.thread, &detach, snapshotstart, NULL);
+
+	return 0;
+}
+
+
+
+/*
+ * Called from the recording thread as it starts.  The copy is the only
+ * work done here: about one I-frame's worth of memcpy().
+ */
+void snapshot(const char *recording)
+{
+	struct frame *f;
+	uint8_t *buf;
+	int len;
+	const char *dot;
+
+	if (snap.width <= 0)
+		return;
+
+	pthread_mutex_lock(&snap.lock);
+	if (snap.busy || snap.buf) {
+		snap.skipped++;
+		pthread_mutex_unlock(&snap.lock);
+		return;
+	}
+	pthread_mutex_unlock(&snap.lock);
+
+	pthread_mutex_lock(&ctx.lock);
+	f = &ctx.frames[ctx.lastiframe & (INMEMFRAMES-1)];
+	if (!f->buf || !(f->flags & OMX_BUFFERFLAG_SYNCFRAME)) {
+		pthread_mutex_unlock(&ctx.lock);
+		return;
+	}
+/* I-frames carry their own SPS and PPS: */
+	len = f->len;
+	buf = malloc(len + FF_INPUT_BUFFER_PADDING_SIZE);
+	memcpy(buf, f->buf, f->len);
+	pthread_mutex_unlock(&ctx.lock);
+	memset(&buf[len], 0, FF_INPUT_BUFFER_PADDING_SIZE);
+
+	pthread_mutex_lock(&snap.lock);
+	snap.buf = buf;
+	snap.len = len;
+	dot = strrchr(recording, '.');
+	snprintf(snap.fn, sizeof(snap.fn), "%.*s.jpg",
+		dot ? (int) (dot - recording) : (int) strlen(recording),
+		recording);
+	pthread_cond_signal(&snap.cond);
+	pthread_mutex_unlock(&snap.lock);
+}
+
+
+
+static AVFrame *decode(uint8_t *buf, int len)
+{
+	AVCodec			*c;
+	AVCodecContext		*cc;
+	AVFrame			*frame;
+	AVPacket		pkt;
+	int			got = 0;
+
+	c = avcodec_find_decoder(AV_CODEC_ID_H264);
+	cc = avcodec_alloc_context3(c);
+	cc->thread_count = 1;
+	cc->skip_loop_filter = AVDISCARD_ALL;
+	if (avcodec_open2(cc, c, NULL) < 0) {
+		avcodec_free_context(&cc);
+		return NULL;
+	}
+	frame = av_frame_alloc();
+
+	av_init_packet(&pkt);
+	pkt.data = buf;
+	pkt.size = len;
+	pkt.flags = AV_PKT_FLAG_KEY;
+	avcodec_decode_video2(cc, frame, &got, &pkt);
+	if (!got) {
+/* Drain; there are no B-frames, so it's this or nothing: */
+		pkt.data = NULL;
+		pkt.size = 0;
+		avcodec_decode_video2(cc, frame, &got, &pkt);
+	}
+	avcodec_close(cc);
+	avcodec_free_context(&cc);
+	if (!got)
+		av_frame_free(&frame);
+
+	return frame;
+}
+
+
+
+static int encode(AVFrame *in, const char *fn)
+{
+	struct SwsContext	*sws;
+	AVCodec			*c;
+	AVCodecContext		*cc;
+	AVFrame			*out;
+	AVPacket		pkt;
+	int			w, h;
+	int			got = 0, r = -1;
+	FILE			*fd;
+
+	w = snap.width < in->width ? snap.width : in->width & ~1;
+	h = ((in->height * w) / in->width) & ~1;
+
+	out = av_frame_alloc();
+	out->width = w;
+	out->height = h;
+	out->format = AV_PIX_FMT_YUVJ420P;
+	av_image_alloc(out->data, out->linesize, w, h, AV_PIX_FMT_YUVJ420P, 16);
+	sws = sws_getContext(in->width, in->height, in->format, w, h,
+		AV_PIX_FMT_YUVJ420P, SWS_FAST_BILINEAR, NULL, NULL, NULL);
+	sws_scale(sws, (const uint8_t * const *) in->data, in->linesize, 0,
+		in->height, out->data, out->linesize);
+	sws_freeContext(sws);
+
+	c = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+	cc = avcodec_alloc_context3(c);
+	cc->width = w;
+	cc->height = h;
+	cc->pix_fmt = AV_PIX_FMT_YUVJ420P;
+	cc->time_base.num = 1;
+	cc->time_base.den = 1;
+	cc->thread_count = 1;
+	if (avcodec_open2(cc, c, NULL) >= 0) {
+		av_init_packet(&pkt);
+		pkt.data = NULL;
+		pkt.size = 0;
+		if (avcodec_encode_video2(cc, &pkt, out, &got) == 0 && got) {
+			fd = fopen(fn, "wb");
+			if (fd) {
+				if (fwrite(pkt.data, 1, pkt.size, fd) == pkt.size)
+					r = 0;
+				fclose(fd);
+			}
+			av_free_packet(&pkt);
+		}
+		avcodec_close(cc);
+	}
+	avcodec_free_context(&cc);
+	av_freep(&out->data[0]);
+	av_frame_free(&out);
+
+	return r;
+}
+
+
+
+static void *snapshotstart(void *args)
+{
+	struct sched_param	sp;
+	uint8_t			*buf;
+	int			len;
+	char			fn[256];
+	AVFrame			*frame;
+	struct timespec		t0, t1;
+
+/* We're the least important thing in the building: */
+	memset(&sp, 0, sizeof(sp));
+#ifdef SCHED_IDLE
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp);
+#endif
+	setpriority(PRIO_PROCESS, 0, 19);	/* Per-thread, on Linux */
+	schedthread(ROLE_SNAPSHOT);	/* Unless told otherwise */
+
+	while (1) {
+		pthread_mutex_lock(&snap.lock);
+		while (!snap.buf)
+			pthread_cond_wait(&snap.cond, &snap.lock);
+		buf = snap.buf;
+		len = snap.len;
+		memcpy(fn, snap.fn, sizeof(fn));
+		snap.buf = NULL;
+		snap.busy = 1;
+		pthread_mutex_unlock(&snap.lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		frame = decode(buf, len);
+		free(buf);
+		if (!frame) {
+			logmsg(V_ERROR, "Snapshot: failed to decode I-frame "
+				"for %s\n", fn);
+		} else {
+			if (encode(frame, fn) != 0) {
+				logmsg(V_ERROR, "Snapshot: failed to write %s\n",
+					fn);
+			} else {
+				clock_gettime(CLOCK_MONOTONIC, &t1);
+				logmsg(V_INFO, "Snapshot %s written in %.0fms\n",
+					fn,
+					(t1.tv_sec - t0.tv_sec) * 1000.0 +
+					(t1.tv_nsec - t0.tv_nsec) / 1000000.0);
+			}
+			av_frame_free(&frame);
+		}
+
+		pthread_mutex_lock(&snap.lock);
+		snap.busy = 0;
+		pthread_mutex_unlock(&snap.lock);
+	}
+
+	return NULL; /* to shut the compiler up */
+}
@@ -0,0 +1,343 @@
+/* swsource.c */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Software capture source, for -i: any H.264 file or stream libavformat
+ * can open, in place of the camera and encoder.
+ *
+ * The packets go into the ring as they are, after converting to Annex B
+ * if the container has them length-prefixed, so recordings are stream
+ * copies.  They're also decoded, with frame threading and +export_mvs,
+ * purely for the motion vectors: these are the decoder's per-partition
+ * vectors, which we average per macroblock, weighted by area, into the
+ * same cols x rows grid (spare column and all) the encoder's side info
+ * gives us.  Only vectors from past references are used; intra blocks
+ * come out as zero, as they do from the encoder.  The SAD isn't known.
+ *
+ * Input is paced to its timestamps, so files play out in real time and
+ * the recorder and detector see what they'd see from a camera.
+ */
+
+#include "omxmotion.h"
+#include "motion.h"
+#include "swsource.h"
+#include "prio.h"
+#include "log.h"
+#include "libavutil/motion_vector.h"
+
+#define REPORTEVERY	(10)	/* Seconds between throughput reports */
+
+
+
+static struct {
+	AVFormatContext		*ic;
+	AVCodecContext		*dec;
+	AVBitStreamFilterContext *annexb;
+	AVFrame			*frame;
+	int			stream;
+	int			cols, rows;
+	int32_t			*sx, *sy, *area;
+	int64_t			first;		/* us; first pts, and when */
+	struct timespec		start;
+	unsigned int		decoded;	/* Since the last report */
+	struct timespec		wall, cpu;	/* At the last report */
+} sw;
+
+
+
+static int64_t elapsed(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000LL +
+		(to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+
+
+int swopen(const char *url)
+{
+	AVCodec		*codec;
+	AVDictionary	*opts = NULL;
+	AVStream	*st;
+	char		err[256];
+	int		r, i, n;
+
+	av_register_all();
+	avformat_network_init();
+
+	r = avformat_open_input(&sw.ic, url, NULL, NULL);
+	if (r == 0)
+		r = avformat_find_stream_info(sw.ic, NULL);
+	if (r < 0) {
+		av_strerror(r, err, sizeof(err));
+		fprintf(stderr, "Failed to open %s: %s\n", url, err);
+		return -1;
+	}
+	for (i = 0; i < sw.ic->nb_streams; i++)
+		if (sw.ic->streams[i]->codec->codec_id == AV_CODEC_ID_H264)
+			break;
+	if (i == sw.ic->nb_streams) {
+		fprintf(stderr, "No H.264 video in %s\n", url);
+		return -1;
+	}
+	sw.stream = i;
+	st = sw.ic->streams[i];
+	sw.dec = st->codec;
+
+	codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+	sw.dec->thread_type = FF_THREAD_FRAME;
+	sw.dec->thread_count = 0;
+	av_dict_set(&opts, "flags2", "+export_mvs", 0);
+	r = avcodec_open2(sw.dec, codec, &opts);
+	av_dict_free(&opts);
+	if (r < 0) {
+		av_strerror(r, err, sizeof(err));
+		fprintf(stderr, "Failed to open the decoder: %s\n", err);
+		return -1;
+	}
+
+/* avcC extradata means length-prefixed NALs, as from MP4 or MKV: */
+	if (sw.dec->extradata_size > 0 && sw.dec->extradata[0] == 1)
+		sw.annexb = av_bitstream_filter_init("h264_mp4toannexb");
+
+	ctx.width = sw.dec->width;
+	ctx.height = sw.dec->height;
+	if (st->avg_frame_rate.num > 0 && st->avg_frame_rate.den > 0)
+		ctx.framerate = (st->avg_frame_rate.num +
+			st->avg_frame_rate.den / 2) / st->avg_frame_rate.den;
+
+	sw.cols = ((ctx.width + 15) / 16) + 1;
+	sw.rows = (ctx.height + 15) / 16;
+	n = sw.cols * sw.rows;
+	sw.sx = malloc(n * sizeof(int32_t));
+	sw.sy = malloc(n * sizeof(int32_t));
+	sw.area = malloc(n * sizeof(int32_t));
+	sw.frame = av_frame_alloc();
+	sw.first = AV_NOPTS_VALUE;
+
+	logmsg(V_INFO, "Reading %s: %dx%d at %dfps, %d decoder threads\n",
+		url, ctx.width, ctx.height, ctx.framerate,
+		sw.dec->thread_count);
+
+	return 0;
+}
+
+
+
+/* The decoder's vectors for one frame, into the detector's grid: */
+static void vectors(AVFrame *f, int64_t tick)
+{
+	AVFrameSideData		*sd;
+	const AVMotionVector	*mv;
+	struct motvec		*v;
+	int			i, n, x, y, a;
+
+	sd = av_frame_get_side_data(f, AV_FRAME_DATA_MOTION_VECTORS);
+	if (!sd)
+		return;		/* Intra; nothing to compare against */
+
+	n = sw.cols * sw.rows;
+	memset(sw.sx, 0, n * sizeof(int32_t));
+	memset(sw.sy, 0, n * sizeof(int32_t));
+	memset(sw.area, 0, n * sizeof(int32_t));
+
+	mv = (const AVMotionVector *) sd->data;
+	for (i = sd->size / sizeof(*mv); i > 0; i--, mv++) {
+		if (mv->source > 0)
+			continue;
+		x = mv->dst_x >> 4;
+		y = mv->dst_y >> 4;
+		if (x < 0 || x >= sw.cols - 1 || y < 0 || y >= sw.rows)
+			continue;
+		a = mv->w * mv->h;
+		sw.sx[y * sw.cols + x] += (mv->src_x - mv->dst_x) * a;
+		sw.sy[y * sw.cols + x] += (mv->src_y - mv->dst_y) * a;
+		sw.area[y * sw.cols + x] += a;
+	}
+
+	v = av_mallocz(n * sizeof(struct motvec));
+	for (i = 0; i < n; i++) {
+		int dx, dy;
+
+		if (!sw.area[i])
+			continue;
+		dx = sw.sx[i] / sw.area[i];
+		dy = sw.sy[i] / sw.area[i];
+		v[i].dx = dx < -128 ? -128 : dx > 127 ? 127 : dx;
+		v[i].dy = dy < -128 ? -128 : dy > 127 ? 127 : dy;
+	}
+	findmotion((uint8_t *) v, tick);
+}
+
+
+
+/*
+ * Frames per second of wall clock, and per second of CPU across the
+ * whole process -- the decoder threads, in practice -- which is roughly
+ * what one core could sustain on its own.
+ */
+static void report(int final)
+{
+	struct timespec wall, cpu;
+	int64_t w, c;
+
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+	if (!sw.wall.tv_sec) {
+		sw.wall = wall;
+		sw.cpu = cpu;
+		return;
+	}
+	w = elapsed(&sw.wall, &wall);
+	if (!final && w < REPORTEVERY * 1000000LL)
+		return;
+	c = elapsed(&sw.cpu, &cpu);
+
+	if (w > 0 && c > 0)
+		logmsg(V_INFO, "Decoded %u frames in %d.%01ds: %d.%01d fps, "
+			"%d.%01d fps per core, %d.%02d cores busy\n",
+			sw.decoded, (int) (w / 1000000),
+			(int) (w / 100000) % 10,
+			(int) (sw.decoded * 1000000LL / w),
+			(int) (sw.decoded * 10000000LL / w) % 10,
+			(int) (sw.decoded * 1000000LL / c),
+			(int) (sw.decoded * 10000000LL / c) % 10,
+			(int) (c / w), (int) ((c * 100) / w) % 100);
+	sw.wall = wall;
+	sw.cpu = cpu;
+	sw.decoded = 0;
+}
+
+
+
+/* Sleep until tick (us, in the stream's terms) is due: */
+static void pace(int64_t tick)
+{
+	struct timespec now;
+	int64_t due;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (sw.first == AV_NOPTS_VALUE) {
+		sw.first = tick;
+		sw.start = now;
+		return;
+	}
+	due = (tick - sw.first) - elapsed(&sw.start, &now);
+	if (due > 0 && due < 10 * 1000000LL)
+		usleep(due);
+}
+
+
+
+static int decode(AVPacket *pkt)
+{
+	AVRational	us = { 1, 1000000 };
+	int		got = 0;
+	int64_t		pts;
+
+	if (avcodec_decode_video2(sw.dec, sw.frame, &got, pkt) < 0 || !got)
+		return 0;
+	sw.decoded++;
+	pts = sw.frame->best_effort_timestamp;
+	if (pts == AV_NOPTS_VALUE)
+		pts = sw.frame->pkt_pts;
+	vectors(sw.frame, pts == AV_NOPTS_VALUE ? 0 :
+		av_rescale_q(pts, sw.ic->streams[sw.stream]->time_base, us));
+	av_frame_unref(sw.frame);
+
+	return 1;
+}
+
+
+
+/*
+ * The capture loop, for a software source.  Returns at the end of the
+ * input.
+ */
+int swsource(void)
+{
+	AVRational	us = { 1, 1000000 };
+	AVPacket	pkt;
+	uint8_t		*tmpbuf = NULL, *out;
+	off_t		tmpbufoff = 0;
+	int		outlen, key;
+	int64_t		t, last = 0;
+	OMX_TICKS	tick;
+
+	schedthread(ROLE_CAPTURE);
+	report(0);
+	av_init_packet(&pkt);
+	while (av_read_frame(sw.ic, &pkt) >= 0) {
+		if (pkt.stream_index != sw.stream) {
+			av_free_packet(&pkt);
+			continue;
+		}
+
+		t = pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts;
+		if (t != AV_NOPTS_VALUE)
+			t = av_rescale_q(t, sw.ic->streams[sw.stream]->time_base,
+				us);
+		else
+			t = last + 1000000 / ctx.framerate;
+		last = t;
+		pace(t);
+
+		key = pkt.flags & AV_PKT_FLAG_KEY;
+		out = pkt.data;
+		outlen = pkt.size;
+		if (sw.annexb && av_bitstream_filter_filter(sw.annexb, sw.dec,
+			NULL, &out, &outlen, pkt.data, pkt.size, key) < 0) {
+			logmsg(V_ERROR, "Failed to convert frame %d to Annex B\n",
+				ctx.framenum);
+			av_free_packet(&pkt);
+			continue;
+		}
+
+/* The ring owns what it's given, so it gets a copy: */
+		tmpbuf = av_realloc(tmpbuf, tmpbufoff + outlen);
+		memcpy(&tmpbuf[tmpbufoff], out, outlen);
+		tmpbufoff += outlen;
+		if (out != pkt.data)
+			av_free(out);
+
+		decode(&pkt);
+		tick.nLowPart = (uint32_t) t;
+		tick.nHighPart = (uint32_t) (t >> 32);
+		storeframe(&tmpbuf, &tmpbufoff, tick,
+			key ? OMX_BUFFERFLAG_SYNCFRAME : 0);
+
+		av_free_packet(&pkt);
+		report(0);
+	}
+
+/* Frame threading holds some back; flush them out: */
+	pkt.data = NULL;
+	pkt.size = 0;
+	while (decode(&pkt))
+		;
+	report(1);
+
+	av_free(tmpbuf);
+	if (sw.annexb)
+		av_bitstream_filter_close(sw.annexb);
+	avcodec_close(sw.dec);
+	avformat_close_input(&sw.ic);
+	av_frame_free(&sw.frame);
+
+	return 0;
+}
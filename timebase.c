@@ -0,0 +1,120 @@
+/* timebase.c */
+/*
+ * (c) 2015 Dickon Hood <dickon@fluff.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Encoder timestamps to wall clock.
+ *
+ * Every frame carries the camera's STC timestamp (microseconds, from
+ * whenever the firmware started counting), which is exact relative to
+ * the other frames but says nothing about the time of day.  Rather than
+ * ask the kernel the time for each frame -- and get the time the frame
+ * happened to reach us, give or take however long the encoder and the
+ * capture loop took -- we keep an offset between the two and add it.
+ *
+ * Once a second, the offset is measured again: the wall clock now, less
+ * the tick of the frame in hand.  That's always later than the frame was
+ * captured, by a varying amount, so the smallest of the last TBWINDOW
+ * measurements is taken as the best estimate.  The offset in use is slewed
+ * towards it by at most TBSLEW each time, so timestamps never go backwards
+ * and two frames a frame apart are always about a frame apart; that copes
+ * with the STC and the system clock drifting apart, and with NTP's gentle
+ * corrections.  If the two disagree by more than TBSTEP -- the clock's
+ * been set, or the encoder's restarted -- we start again from scratch.
+ *
+ * Only the capture thread calls tbwall().
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "timebase.h"
+#include "log.h"
+
+#define TBWINDOW	(8)		/* Measurements */
+#define TBSLEW		(500)		/* us per measurement, at most */
+#define TBSTEP		(1000000)	/* us */
+
+static struct {
+	int		every;		/* Frames between measurements */
+	int		count;
+	int		valid;
+	int64_t		offset;		/* Wall clock less tick, us */
+	int64_t		window[TBWINDOW];
+	unsigned int	n;
+} tb;
+
+
+
+void tbinit(int framerate)
+{
+	tb.every = framerate > 0 ? framerate : 1;
+	tb.count = 0;
+	tb.valid = 0;
+	tb.n = 0;
+}
+
+
+
+static void measure(int64_t tick)
+{
+	struct timespec	now;
+	int64_t		d, best;
+	unsigned int	i;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	d = (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000 - tick;
+
+	if (tb.valid && (d - tb.offset > TBSTEP || tb.offset - d > TBSTEP)) {
+		logmsg(V_WARN, "Wall clock and encoder timestamps jumped "
+			"%+lldms apart; resynchronising\n",
+			(long long) (d - tb.offset) / 1000);
+		tb.valid = 0;
+	}
+	if (!tb.valid) {
+		tb.offset = d;
+		tb.n = 0;
+		tb.valid = 1;
+	}
+
+	tb.window[tb.n++ % TBWINDOW] = d;
+	best = d;
+	for (i = 0; i < TBWINDOW && i < tb.n; i++)
+		if (tb.window[i] < best)
+			best = tb.window[i];
+
+	if (best > tb.offset + TBSLEW)
+		tb.offset += TBSLEW;
+	else if (best < tb.offset - TBSLEW)
+		tb.offset -= TBSLEW;
+	else
+		tb.offset = best;
+}
+
+
+
+/* Microseconds since the epoch at which the frame stamped tick happened: */
+int64_t tbwall(int64_t tick)
+{
+	if (tb.count-- <= 0) {
+		measure(tick);
+		tb.count = tb.every - 1;
+	}
+
+	return tick + tb.offset;
+}